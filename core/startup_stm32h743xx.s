@@ -93,6 +93,9 @@ LoopFillZerobss:
   cmp r2, r4
   bcc FillZerobss
 
+/* .dtcm_data, .dma_buf and .d2_buf */
+  bl  section_init
+
 /* Call static constructors */
     bl __libc_init_array
 /* Call the application's entry point.*/
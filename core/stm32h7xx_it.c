@@ -18,6 +18,7 @@
 #include "stm32h7xx_it.h"
 #include <stdio.h>
 #include "bsp.h"
+#include "sdmmc_sd.h"
 /*
  *      Cortex Processor Interruption and Exception Handlers
  */
@@ -30,6 +31,7 @@ void SysTick_Handler(void)
 void HardFault_Handler(void)
 {
         error_print();
+        console_flush();
         while ( 1 );
 }
 
@@ -101,6 +103,20 @@ void DebugMon_Handler(void)
 /**
   * @brief This function handles USART1 global interrupt.
   */
+void USART1_IRQHandler(void)
+{
+        console_irq_handler();
+}
+
+void DMA1_Stream0_IRQHandler(void)
+{
+        console_tx_dma_irq_handler();
+}
+
+void DMA1_Stream1_IRQHandler(void)
+{
+        console_rx_dma_irq_handler();
+}
 
 
 /*
@@ -109,5 +125,5 @@ void DebugMon_Handler(void)
 
 void SDMMC1_IRQHandler(void)
 {
-        HAL_SD_IRQHandler(0);
+        BSP_SD_IRQHandler(0);
 }
\ No newline at end of file
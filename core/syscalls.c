@@ -117,6 +117,7 @@ __attribute__((weak)) int _write(int file, char *ptr, int len)
 caddr_t _sbrk(int incr)
 {
 	extern char end asm("end");
+	extern char _Min_Heap_Size;
 	static char *heap_end;
 	char *prev_heap_end;
 
@@ -124,7 +125,8 @@ caddr_t _sbrk(int incr)
 		heap_end = &end;
 
 	prev_heap_end = heap_end;
-	if (heap_end + incr > stack_ptr)
+	/* the dtcm arena starts above the heap */
+	if (heap_end + incr > stack_ptr || heap_end + incr > &end + (int)&_Min_Heap_Size)
 	{
 		errno = ENOMEM;
 		return (caddr_t) -1;
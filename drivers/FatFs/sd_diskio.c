@@ -43,9 +43,21 @@
 
 #define DISABLE_SD_INIT
 
+/*
+ * SDMMC1 IDMA sits in D1: it reaches AXI SRAM and the FMC (SDRAM) only,
+ * not the TCMs, SRAM1-3 or SRAM4, buffers there use polling.
+ * DMA buffers must be cache line aligned for the maintenance below.
+ */
+#define SD_DMA_CAPABLE(buff) \
+  ((((uint32_t)(buff) & 31U) == 0U) && \
+   (((uint32_t)(buff) - D1_AXISRAM_BASE < 0x80000U) || \
+    ((uint32_t)(buff) - 0xC0000000U < 0x20000000U)))
+
 /* Private variables ---------------------------------------------------------*/
 /* Disk status */
 static volatile DSTATUS Stat = STA_NOINIT;
+static volatile uint32_t ReadStatus;
+static volatile uint32_t WriteStatus;
 
 /* Private function prototypes -----------------------------------------------*/
 static DSTATUS SD_CheckStatus(BYTE lun);
@@ -124,6 +136,34 @@ DSTATUS SD_status(BYTE lun)
 DRESULT SD_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
 {
   DRESULT res = RES_ERROR;
+  uint32_t timeout;
+
+  if(SD_DMA_CAPABLE(buff))
+  {
+    /* write back dirty lines first, they must not be evicted over DMA data */
+    SCB_CleanInvalidateDCache_by_Addr((uint32_t*)buff, count * SD_DEFAULT_BLOCK_SIZE);
+    ReadStatus = 0;
+
+    if(BSP_SD_ReadBlocks_DMA(0, (uint32_t*)buff,
+                             (uint32_t)(sector),
+                             count) == BSP_ERROR_NONE)
+    {
+      timeout = HAL_GetTick();
+      while((ReadStatus == 0) && ((HAL_GetTick() - timeout) < SD_TIMEOUT))
+      {
+      }
+      if(ReadStatus != 0)
+      {
+        while(BSP_SD_GetCardState(0) != BSP_ERROR_NONE)
+        {
+        }
+        /* drop lines speculatively fetched during the transfer */
+        SCB_InvalidateDCache_by_Addr((uint32_t*)buff, count * SD_DEFAULT_BLOCK_SIZE);
+        res = RES_OK;
+      }
+    }
+    return res;
+  }
 
   if(BSP_SD_ReadBlocks(0, (uint32_t*)buff,
                        (uint32_t) (sector),
@@ -151,6 +191,33 @@ DRESULT SD_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
 DRESULT SD_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count)
 {
   DRESULT res = RES_ERROR;
+  uint32_t timeout;
+
+  if(SD_DMA_CAPABLE(buff))
+  {
+    /* the card gets memory, not the dcache */
+    SCB_CleanDCache_by_Addr((uint32_t*)buff, count * SD_DEFAULT_BLOCK_SIZE);
+    WriteStatus = 0;
+
+    if(BSP_SD_WriteBlocks_DMA(0, (uint32_t*)buff,
+                              (uint32_t)(sector),
+                              count) == BSP_ERROR_NONE)
+    {
+      timeout = HAL_GetTick();
+      while((WriteStatus == 0) && ((HAL_GetTick() - timeout) < SD_TIMEOUT))
+      {
+      }
+      if(WriteStatus != 0)
+      {
+        /* wait until the card has programmed the blocks */
+        while(BSP_SD_GetCardState(0) != BSP_ERROR_NONE)
+        {
+        }
+        res = RES_OK;
+      }
+    }
+    return res;
+  }
 
   if(BSP_SD_WriteBlocks(0, (uint32_t*)buff,
                         (uint32_t)(sector),
@@ -218,5 +285,25 @@ DRESULT SD_ioctl(BYTE lun, BYTE cmd, void *buff)
 }
 #endif /* _USE_IOCTL == 1 */
 
+/**
+  * @brief Rx Transfer completed callback
+  * @param Instance SD Instance
+  * @retval None
+  */
+void BSP_SD_ReadCpltCallback(uint32_t Instance)
+{
+  ReadStatus = 1;
+}
+
+/**
+  * @brief Tx Transfer completed callback
+  * @param Instance SD Instance
+  * @retval None
+  */
+void BSP_SD_WriteCpltCallback(uint32_t Instance)
+{
+  WriteStatus = 1;
+}
+
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
 
@@ -0,0 +1,345 @@
+/**
+ * @file arena.c
+ * @brief buffers and loaded images per memory region
+ * @version 1.0
+ *
+ * one arena per ram, what the libc heap, .data/.bss and .dma_buf
+ * leave free:
+ *
+ *   dtcm:  above the 2KB heap, below the stack, cpu only, no DMA but MDMA
+ *   axi:   after .dma_buf up to the log ring, fastest for DMA and cpu
+ *   d2:    SRAM1-3 after .d2_buf, DMA1/2 and MDMA, not SDMMC1
+ *   d3:    SRAM4, BDMA
+ *   sdram: images and large scratch, below .sdram_bss
+ *
+ * every block lives in one table: allocations are 32B aligned and
+ * rounded to cache lines so invalidating one never hits a neighbour,
+ * placed first fit around whatever is there. reservations pin a range
+ * for an owner (an image loaded at a fixed address) and are refused
+ * when they overlap another block, so kernel updates, the initramfs,
+ * the fdt copy and scratch buffers never land on each other
+ */
+#include <stm32h7xx_hal.h>
+#include <stdio.h>
+#include <string.h>
+#include "bsp.h"
+#include "errno.h"
+#include "cmd.h"
+
+#define ARENA_BLOCKS    32
+#define ARENA_ALIGN(x)  (((x) + 31) & ~31u)
+
+struct arena {
+    const char *name;
+    unsigned int base, end;     // set by arena_init
+    unsigned int peak;          // most bytes in use at once
+};
+
+struct arena_block {
+    const char *owner;
+    unsigned int addr, size;    // size 0: free slot
+    int reserved;
+};
+
+static struct arena arenas[] = {
+    [ARENA_DTCM]  = { "dtcm" },
+    [ARENA_AXI]   = { "axi" },
+    [ARENA_D2]    = { "d2" },
+    [ARENA_D3]    = { "d3" },
+    [ARENA_SDRAM] = { "sdram" },
+};
+
+static struct arena_block blocks[ARENA_BLOCKS];
+
+// ARENA_DMA tries these in turn, what every DMA master incl. SDMMC1 reaches
+static const int dma_arenas[] = { ARENA_AXI, ARENA_SDRAM };
+
+/**
+ * @brief free ram of every region, after sdram_init
+ */
+void arena_init(void)
+{
+    extern char end, _edma_buf, _ed2_buf, _ssdram_bss, _estack,
+    _Min_Heap_Size, _Min_Stack_Size;
+
+    arenas[ARENA_DTCM].base  = ARENA_ALIGN((unsigned int)&end + (unsigned int)&_Min_Heap_Size);
+    arenas[ARENA_DTCM].end   = (unsigned int)&_estack - (unsigned int)&_Min_Stack_Size;
+    arenas[ARENA_AXI].base   = ARENA_ALIGN((unsigned int)&_edma_buf);
+    arenas[ARENA_AXI].end    = LOG_BUF_ADDR;
+    arenas[ARENA_D2].base    = ARENA_ALIGN((unsigned int)&_ed2_buf);
+    arenas[ARENA_D2].end     = 0x30048000;
+    arenas[ARENA_D3].base    = 0x38000000;
+    arenas[ARENA_D3].end     = 0x38010000;
+    arenas[ARENA_SDRAM].base = SDRAM_BASE_ADDR;
+    arenas[ARENA_SDRAM].end  = (unsigned int)&_ssdram_bss;
+
+    // fdt_fixup patches its copy here
+    arena_reserve("fdt", FDT_RAM_ADDR, FDT_RAM_SIZE);
+}
+
+static int arena_of(unsigned int addr)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(arenas); i++)
+        if (addr - arenas[i].base < arenas[i].end - arenas[i].base)
+            return i;
+    return -1;
+}
+
+static int arena_used(int a)
+{
+    int i, used = 0;
+
+    for (i = 0; i < ARENA_BLOCKS; i++)
+        if (blocks[i].size && arena_of(blocks[i].addr) == a)
+            used += blocks[i].size;
+    return used;
+}
+
+static void arena_account(unsigned int addr)
+{
+    int a = arena_of(addr);
+    unsigned int used = arena_used(a);
+
+    if (used > arenas[a].peak)
+        arenas[a].peak = used;
+}
+
+// first block overlapping [addr, addr + size), `skip` owner aside
+static struct arena_block *arena_overlap(unsigned int addr, unsigned int size,
+                                         const char *skip)
+{
+    int i;
+
+    for (i = 0; i < ARENA_BLOCKS; i++) {
+        if (!blocks[i].size || (skip && blocks[i].reserved &&
+            !strcmp(blocks[i].owner, skip)))
+            continue;
+        if (addr < blocks[i].addr + blocks[i].size && blocks[i].addr < addr + size)
+            return &blocks[i];
+    }
+    return NULL;
+}
+
+static struct arena_block *arena_slot(void)
+{
+    int i;
+
+    for (i = 0; i < ARENA_BLOCKS; i++)
+        if (!blocks[i].size)
+            return &blocks[i];
+    return NULL;
+}
+
+// lowest 32B aligned gap of `size` in arena `a`, 0 if none
+static unsigned int arena_fit(int a, unsigned int size)
+{
+    unsigned int addr = arenas[a].base;
+    struct arena_block *b;
+
+    while (addr + size <= arenas[a].end && addr + size > addr) {
+        b = arena_overlap(addr, size, NULL);
+        if (!b)
+            return addr;
+        addr = ARENA_ALIGN(b->addr + b->size);
+    }
+    return 0;
+}
+
+/**
+ * @brief `size` bytes from `region` for `owner`, 32B aligned
+ *        ARENA_DMA: axi, else sdram
+ * @return NULL if no region has room
+ */
+void *arena_alloc(int region, int size, const char *owner)
+{
+    struct arena_block *b = arena_slot();
+    unsigned int addr = 0;
+    int i;
+
+    size = ARENA_ALIGN(size > 0 ? size : 1);
+    if (region == ARENA_DMA) {
+        for (i = 0; i < ARRAY_SIZE(dma_arenas) && !addr; i++)
+            addr = arena_fit(region = dma_arenas[i], size);
+    } else if (region >= 0 && region < ARRAY_SIZE(arenas)) {
+        addr = arena_fit(region, size);
+    }
+    if (!b || !addr) {
+        printk(KERN_ERR "arena: no %dKB for %s", size / 1024, owner);
+        return NULL;
+    }
+
+    if (region == ARENA_D2) {
+        __HAL_RCC_D2SRAM1_CLK_ENABLE();
+        __HAL_RCC_D2SRAM2_CLK_ENABLE();
+        __HAL_RCC_D2SRAM3_CLK_ENABLE();
+    }
+    b->owner = owner;
+    b->addr = addr;
+    b->size = size;
+    b->reserved = 0;
+    arena_account(addr);
+    return (void *)addr;
+}
+
+void arena_free(void *p)
+{
+    int i;
+
+    for (i = 0; p && i < ARENA_BLOCKS; i++) {
+        if (blocks[i].size && !blocks[i].reserved && blocks[i].addr == (unsigned int)p) {
+            blocks[i].size = 0;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief pin [addr, addr + size) for `owner`, an earlier reservation
+ *        of the same owner is moved
+ * @return -EFAULT outside ram, -EBUSY over another block
+ */
+int arena_reserve(const char *owner, unsigned int addr, int size)
+{
+    struct arena_block *b;
+    int a = arena_of(addr), i;
+
+    if (a < 0 || size <= 0 || size > arenas[a].end - addr)
+        return -EFAULT;
+    b = arena_overlap(addr, size, owner);
+    if (b) {
+        printk(KERN_ERR "arena: %s at 0x%08x-0x%08x overlaps %s", owner,
+               addr, addr + size, b->owner);
+        return -EBUSY;
+    }
+
+    for (i = 0, b = NULL; i < ARENA_BLOCKS && !b; i++)
+        if (blocks[i].size && blocks[i].reserved && !strcmp(blocks[i].owner, owner))
+            b = &blocks[i];
+    if (!b)
+        b = arena_slot();
+    if (!b)
+        return -ENOMEM;
+
+    b->owner = owner;
+    b->addr = addr;
+    b->size = size;
+    b->reserved = 1;
+    arena_account(addr);
+    return 0;
+}
+
+void arena_release(const char *owner)
+{
+    int i;
+
+    for (i = 0; i < ARENA_BLOCKS; i++)
+        if (blocks[i].size && blocks[i].reserved && !strcmp(blocks[i].owner, owner))
+            blocks[i].size = 0;
+}
+
+/**
+ * @brief owner of a block overlapping [addr, addr + size), NULL if none
+ */
+const char *arena_owner(unsigned int addr, int size)
+{
+    struct arena_block *b = arena_overlap(addr, size > 0 ? size : 1, NULL);
+
+    return b ? b->owner : NULL;
+}
+
+/**
+ * @brief bytes from `addr` to the next block above, 0 if none
+ * @return -EBUSY inside a block
+ */
+int arena_room(unsigned int addr)
+{
+    unsigned int next = 0;
+    int i;
+
+    if (arena_owner(addr, 1))
+        return -EBUSY;
+    for (i = 0; i < ARENA_BLOCKS; i++)
+        if (blocks[i].size && blocks[i].addr > addr && (!next || blocks[i].addr < next))
+            next = blocks[i].addr;
+    return next ? next - addr : 0;
+}
+
+// widest gap, in bytes
+static int arena_largest(int a)
+{
+    unsigned int addr = arenas[a].base, next, best = 0;
+    struct arena_block *b;
+    int i;
+
+    while (addr < arenas[a].end) {
+        // the lowest block ending above addr
+        for (i = 0, b = NULL; i < ARENA_BLOCKS; i++) {
+            if (!blocks[i].size || blocks[i].addr + blocks[i].size <= addr ||
+                blocks[i].addr >= arenas[a].end)
+                continue;
+            if (!b || blocks[i].addr < b->addr)
+                b = &blocks[i];
+        }
+        next = b ? b->addr : arenas[a].end;
+        if (next > addr && next - addr > best)
+            best = next - addr;
+        if (!b)
+            break;
+        addr = b->addr + b->size;
+    }
+    return best;
+}
+
+static void arena_print(void)
+{
+    int a, i, size, used;
+
+    printk("arena     base        size     used     free     largest  peak");
+    for (a = 0; a < ARRAY_SIZE(arenas); a++) {
+        size = arenas[a].end - arenas[a].base;
+        used = arena_used(a);
+        printk("%-8s  0x%08x  %6dK  %6dK  %6dK  %6dK  %6dK", arenas[a].name,
+               arenas[a].base, size / 1024, used / 1024, (size - used) / 1024,
+               arena_largest(a) / 1024, arenas[a].peak / 1024);
+    }
+
+    printk("");
+    printk("block                 start       end         size");
+    for (i = 0; i < ARENA_BLOCKS; i++) {
+        if (!blocks[i].size)
+            continue;
+        printk("%-20s  0x%08x  0x%08x  %6dK%s", blocks[i].owner, blocks[i].addr,
+               blocks[i].addr + blocks[i].size, (blocks[i].size + 1023) / 1024,
+               blocks[i].reserved ? "  reserved" : "");
+    }
+}
+
+int do_meminfo(const char *buf)
+{
+    int idx = 0;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+
+    if (!strncmp(&buf[idx], "release ", 8)) {
+        idx += 8;
+        while (buf[idx] == ' ') idx++;
+        if (!buf[idx])
+            return -EINVAL;
+        arena_release(&buf[idx]);
+        return 0;
+    }
+    arena_print();
+    return 0;
+}
+
+void help_meminfo(void)
+{
+    printsh("meminfo [release <owner>]");
+    printsh("free, used and peak bytes of each ram arena, allocated and reserved blocks,");
+    printsh("release drops the reservation of an image, e.g. meminfo release initrd");
+}
+SHELL_EXPORT_CMD(meminfo, help_meminfo, do_meminfo);
@@ -7,6 +7,27 @@
 #include "errno.h"
 
 
+/*
+ * placement sections besides .data and .bss, called by Reset_Handler
+ * before main, .sdram_bss waits for sdram_bss_init
+ */
+void section_init(void)
+{
+    extern char _sdtcm_data, _edtcm_data, _sidtcm_data,
+    _sdma_buf, _edma_buf, _sd2_buf, _ed2_buf;
+
+    memcpy(&_sdtcm_data, &_sidtcm_data, &_edtcm_data - &_sdtcm_data);
+    memset(&_sdma_buf, 0, &_edma_buf - &_sdma_buf);
+
+    // SRAM1-3 are clocked off at reset
+    if (&_ed2_buf != &_sd2_buf) {
+        __HAL_RCC_D2SRAM1_CLK_ENABLE();
+        __HAL_RCC_D2SRAM2_CLK_ENABLE();
+        __HAL_RCC_D2SRAM3_CLK_ENABLE();
+        memset(&_sd2_buf, 0, &_ed2_buf - &_sd2_buf);
+    }
+}
+
 /*
  * move vector_table and fast instructions to ITCM
  */
@@ -23,7 +44,130 @@ static void copy_to_tcm(void)
 
     __enable_irq();
     printk(KERN_INFO "tcm: vectors -> 0x%08x, .itcm -> 0x%08x",
-            &_isr_start, &_itcm_start);
+            (int)&_isr_start, (int)&_itcm_start);
+}
+
+
+/*
+ * initramfs range, patched into the fdt copy at kernel entry
+ */
+static int initrd_start, initrd_end;
+
+int boot_load_initrd(const char *file, int addr)
+{
+    int size, ret;
+
+    if (addr < SDRAM_BASE_ADDR || addr >= FDT_RAM_ADDR) {
+        printk(KERN_ERR "initrd: 0x%08x out of initrd region", addr);
+        return -EFAULT;
+    }
+
+    // the whole window until the size is known
+    ret = arena_reserve("initrd", addr, FDT_RAM_ADDR - addr);
+    if (ret)
+        return ret;
+
+    if (warmboot_lookup(file, addr, &size)) {
+        ret = sdmmc_load_file(file, (void *)addr, FDT_RAM_ADDR - addr, &size);
+        if (ret) {
+            arena_release("initrd");
+            return ret;
+        }
+        warmboot_record(file, addr, size);
+    }
+    arena_reserve("initrd", addr, size);
+
+    initrd_start = addr;
+    initrd_end = addr + size;
+    return 0;
+}
+
+/*
+ * replace the rate of "console=ttySTM0,<rate>..." in bootargs and
+ * "serial0:<rate>..." in stdout-path, add the console if missing
+ */
+static int fdt_fixup_baud(void *blob, int baud)
+{
+    char args[256];
+    const char *old, *p;
+    int len, n, ret;
+
+    old = fdt_getprop(blob, "/chosen", "bootargs", &len);
+    if (!old)
+        old = "", len = 1;
+
+    p = strstr(old, "console=ttySTM0");
+    if (p) {
+        p += strlen("console=ttySTM0");
+        n = scnprintf(args, sizeof(args), "%.*s,%d", (int)(p - old), old, baud);
+        if (*p == ',')
+            p += 1 + strspn(p + 1, "0123456789");
+        n += scnprintf(args + n, sizeof(args) - n, "%s", p);
+    } else {
+        n = scnprintf(args, sizeof(args), "%s%sconsole=ttySTM0,%d",
+                      old, old[0] ? " " : "", baud);
+    }
+    if (n >= (int)sizeof(args) - 1)
+        return -ENAMETOOLONG;
+    ret = fdt_setprop(blob, "/chosen", "bootargs", args, n + 1);
+
+    old = fdt_getprop(blob, "/chosen", "stdout-path", &len);
+    if (!ret && old && (p = strchr(old, ':'))) {
+        n = scnprintf(args, sizeof(args), "%.*s:%d%s", (int)(p - old), old, baud,
+                      p + 1 + strspn(p + 1, "0123456789"));
+        ret = fdt_setprop(blob, "/chosen", "stdout-path", args, n + 1);
+    }
+    return ret;
+}
+
+/*
+ * fdt in qspi-flash is read-only, patch a copy in SDRAM
+ * qspi-flash must be memory mapped already
+ */
+static int fdt_fixup(int fdt)
+{
+    void *blob = (void *)FDT_RAM_ADDR;
+    int baud = console_get_baud();
+    int cpu = SystemCoreClock;
+    int ret;
+
+    if (!initrd_end && baud == UART_Baudrate && cpu == SYSCLK_FREQ * 1000000)
+        return fdt;
+
+    ret = fdt_relocate(blob, (void *)fdt, FDT_RAM_SIZE);
+    if (ret) {
+        printk(KERN_ERR "fdt: invalid blob at 0x%08x", fdt);
+        return fdt;
+    }
+
+    if (initrd_end) {
+        ret  = fdt_setprop_u32(blob, "/chosen", "linux,initrd-start", initrd_start);
+        ret |= fdt_setprop_u32(blob, "/chosen", "linux,initrd-end", initrd_end);
+        if (ret) {
+            printk(KERN_ERR "fdt: failed to set initrd properties");
+            return fdt;
+        }
+        printk(KERN_INFO "fdt: initrd 0x%08x - 0x%08x", initrd_start, initrd_end);
+    }
+
+    if (baud != UART_Baudrate) {
+        if (fdt_fixup_baud(blob, baud)) {
+            printk(KERN_ERR "fdt: failed to set console baud");
+            return fdt;
+        }
+        printk(KERN_INFO "fdt: console=ttySTM0,%d", baud);
+    }
+
+    if (cpu != SYSCLK_FREQ * 1000000) {
+        if (fdt_setprop_u32(blob, "/cpus/cpu@0", "clock-frequency", cpu)) {
+            printk(KERN_ERR "fdt: failed to set cpu clock");
+            return fdt;
+        }
+        printk(KERN_INFO "fdt: cpu clock-frequency %d", cpu);
+    }
+
+    printk(KERN_INFO "fdt: patched copy at 0x%08x", FDT_RAM_ADDR);
+    return FDT_RAM_ADDR;
 }
 
 
@@ -42,16 +186,20 @@ static void copy_to_tcm(void)
 void kernel_entry(int kernel, int fdt)
 {
     if(!kernel && !fdt) {
-        kernel = KERNEL_ADDR;
-        fdt  = FDT_ADDR;
+        kernel = env_get_int("kerneladdr", KERNEL_ADDR);
+        fdt  = env_get_int("fdtaddr", FDT_ADDR);
     }
+
+    QSPI_W25Qxx_MMMode();
+    fdt = fdt_fixup(fdt);
+
     printk(KERN_INFO "boot: kernel addr: 0x%x, fdt addr: 0x%x", kernel, fdt);
     printk(KERN_INFO "");
     printk(KERN_INFO "boot: ready to boot kernel ...");
     printk(KERN_INFO "");
+    console_shutdown();
 
     // dcache should be closed before kernel init
-    QSPI_W25Qxx_MMMode();
     SCB_DisableDCache();
 
     asm volatile ( "ldr r0, [%0]\n"
@@ -70,25 +218,43 @@ void kernel_entry(int kernel, int fdt)
 int main(void) {
     // config system clock
     HAL_Init();
-    sysclk_config();
+    log_init();
+    cycle_counter_init();
+    // the printk formatter runs from ITCM, nothing may print before this
     copy_to_tcm();
+    sysclk_config();
+
+    // before anything clears the reset flags
+    warmboot_init();
 
     // mpu setup
     mpu_config();
     SCB_EnableICache();
     SCB_EnableDCache();
 
-    // init console and led
-    console_init();
-    led_init();
-
-    // set nor_flash, sdram and sd
+    // nor_flash first, it holds the env with the console baud
     if (QSPI_W25Qxx_Init())
         printk(KERN_ERR "flash: w25q64 init failed");
     else
         printk(KERN_INFO "flash: w25q64 init success");
+    env_init();
+    mpu_env_load();
+    clk_profile_init();
+    qspi_timing_init();
+
+    // init console and led
+    console_init();
+    led_init();
 
+    // set sdram and sd
     sdram_init();
+#ifdef CONFIG_SDRAM_POST
+    // a warm boot keeps images in SDRAM
+    if (!warmboot_active() && sdram_test(1) && !sdram_fallback())
+        sdram_test(1);
+#endif
+    sdram_bss_init();
+    arena_init();
     sdmmc_mount();
 
     // jump to kernel
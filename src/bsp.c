@@ -1,7 +1,7 @@
 /**
  * @file bsp.c
  * @author Honbo (hehongbo918@gmail.com)
- * @brief mpu and clock config
+ * @brief clock config
  * @version 1.0
  * 
  * @copyright Copyright (c) 2024
@@ -12,64 +12,6 @@
 #include <string.h>
 #include "bsp.h"
 
-/*
- * write back + fetch on write
- */
-void mpu_config(void)
-{
-        MPU_Region_InitTypeDef mpu_init = {0};
-
-        HAL_MPU_Disable();
-/* SRAM_D1 */
-        mpu_init.Enable = MPU_REGION_ENABLE;
-        mpu_init.BaseAddress = 0x24000000;
-        mpu_init.Size = MPU_REGION_SIZE_512KB;
-        mpu_init.SubRegionDisable = 0x0;
-        mpu_init.AccessPermission = MPU_REGION_FULL_ACCESS;
-        mpu_init.IsShareable = MPU_ACCESS_NOT_SHAREABLE;
-        mpu_init.IsBufferable = MPU_ACCESS_BUFFERABLE;
-        mpu_init.IsCacheable = MPU_ACCESS_CACHEABLE;
-        mpu_init.Number = MPU_REGION_NUMBER0;
-        mpu_init.TypeExtField = MPU_TEX_LEVEL1;
-        mpu_init.DisableExec = MPU_INSTRUCTION_ACCESS_ENABLE;
-        HAL_MPU_ConfigRegion(&mpu_init);
-        printk(KERN_INFO "mpu: mem 0x%08x setup, size 512KB", mpu_init.BaseAddress);
-#ifdef USE_SRAM_D2 /* SRAM_D2 */
-        mpu_init.BaseAddress = 0x30000000;
-        mpu_init.Size = MPU_REGION_SIZE_256KB;
-        mpu_init.Number = MPU_REGION_NUMBER1;
-        HAL_MPU_ConfigRegion(&mpu_init);
-        printk(KERN_INFO "mpu: mem 0x%08x setup, size 256KB", mpu_init.BaseAddress);
-#endif
-#ifdef USE_SRAM_D3 /* SRAM_D3 */
-        mpu_init.BaseAddress = 0x38000000;
-        mpu_init.Size = MPU_REGION_SIZE_64KB;
-        mpu_init.Number = MPU_REGION_NUMBER2;
-        HAL_MPU_ConfigRegion(&mpu_init);
-        printk(KERN_INFO "mpu: mem 0x%08x setup, size 64KB", mpu_init.BaseAddress);
-#endif
-/* SDRAM */
-        mpu_init.BaseAddress = SDRAM_BASE_ADDR;
-        mpu_init.Size = MPU_REGION_SIZE_32MB;
-        mpu_init.Number = MPU_REGION_NUMBER3;
-        HAL_MPU_ConfigRegion(&mpu_init);
-        printk(KERN_INFO "mpu: mem 0x%08x setup, size 32MB", mpu_init.BaseAddress);
-/* FLASH */
-        mpu_init.BaseAddress = FLASH_BASE_ADDR;
-        mpu_init.Size = MPU_REGION_SIZE_2MB;
-        mpu_init.Number = MPU_REGION_NUMBER4;
-        HAL_MPU_ConfigRegion(&mpu_init);
-        printk(KERN_INFO "mpu: mem 0x%08x setup, size 2MB", mpu_init.BaseAddress);
-/* QSPI FLASH */
-        mpu_init.BaseAddress = QSPI_FLASH_BASE_ADDR;
-        mpu_init.Size = MPU_REGION_SIZE_8MB;
-        mpu_init.Number = MPU_REGION_NUMBER5;
-        HAL_MPU_ConfigRegion(&mpu_init);
-        HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
-        printk(KERN_INFO "mpu: mem 0x%08x setup, size 8MB", mpu_init.BaseAddress);
-}
-
-
 /**
  * 初始化系统时钟: MHz
  *       PLL_IN  = OSC_IN -> HSE  = 25
@@ -157,10 +99,21 @@ void sysclk_config(void)
 #if defined(USE_SRAM_D2) || defined(USE_SRAM_D3)
         __HAL_RCC_D2SRAM1_CLK_ENABLE();
 #endif
-        fcpu = HSE_FREQUENCY * SYSCLK_PLL_N / SYSCLK_PLL_M / SYSCLK_PLL_P;
+        fcpu = SYSCLK_FREQ;
         printk(KERN_INFO "sysclk: system clock configured, CPU %dMHz", fcpu);
 }
 
+/*
+ * DWT cycle counter for get_cycles()
+ */
+void cycle_counter_init(void)
+{
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->LAR = 0xC5ACCE55; // unlock on cortex-m7
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
 /**
  * @usage __FILE__ __LINE__ : 获取当前文件名称和代码行号
  */
@@ -0,0 +1,447 @@
+/**
+ * @file clock.c
+ * @brief kernel clock profiles for FMC, QSPI and SDMMC
+ * @version 1.0
+ *
+ * sysclk_config leaves FMC and QSPI on HCLK and SDMMC on PLL1Q, the
+ * memories follow whatever the core runs at. a profile gives them
+ * PLL2R instead and starts PLL3Q for the console, see clk_profiles.
+ *
+ * the profile (clkprofile) is applied right after env_init, qspi-flash
+ * is idle and SDRAM / SD aren't set up yet. PLL2 stops while it is
+ * reprogrammed and PLL1 dividers can't change under the core, so there
+ * is no switch at runtime: `clkprofile <name>` then `reset`.
+ *
+ * the core clock (cpufreq) does switch at runtime, `clk <MHz>`: the core
+ * parks on HSE while PLL1 is rebuilt, VOS, flash wait states and SysTick
+ * follow, then whatever still hangs on HCLK / PLL1Q is rebalanced,
+ * console baud, qspi prescaler and SDRAM refresh. a VOS too low for what
+ * the profile runs on PLL2 refuses the switch. linux gets the clock
+ * as clock-frequency of /cpus/cpu@0.
+ */
+#include <stm32h7xx_hal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bsp.h"
+#include "errno.h"
+#include "cmd.h"
+#include "qspi-flash.h"
+
+/*
+ * PLLx VCO = HSE / SYSCLK_PLL_M (5MHz) * n, 0 leaves the PLL off
+ * SDMMC_CK = kernel / (2 * sd_div), above 25MHz the card goes high speed
+ * `overclock` runs a kernel clock above the datasheet rating, it is only
+ * kept as "<name> force" and only applied when saved that way
+ */
+static const struct clk_profile {
+    const char *name;
+    int pll2_n, pll2_r;
+    int pll3_n, pll3_q;
+    int fmc, qspi, sdmmc;
+    int sd_div;
+    int overclock;
+} clk_profiles[] = {
+    // as sysclk_config: SDCLK 120MHz, QSPI 120MHz, SD 20MHz
+    { "legacy",   0,   0, 0,  0,
+      RCC_FMCCLKSOURCE_HCLK, RCC_QSPICLKSOURCE_D1HCLK, RCC_SDMMCCLKSOURCE_PLL,  6, 0 },
+    // PLL2R 200MHz: SDCLK 100MHz, QSPI 100MHz, SD 50MHz, console on PLL3Q 48MHz
+    { "balanced", 80,  2, 96, 10,
+      RCC_FMCCLKSOURCE_PLL2, RCC_QSPICLKSOURCE_PLL2,   RCC_SDMMCCLKSOURCE_PLL2, 2, 0 },
+    // PLL2R 265MHz: SDCLK 132.5MHz (CL2 limit), QSPI 132.5MHz, SD 40MHz on PLL1Q
+    // PLL2R is above its rated maximum, overclocked
+    { "fast",     106, 2, 96, 10,
+      RCC_FMCCLKSOURCE_PLL2, RCC_QSPICLKSOURCE_PLL2,   RCC_SDMMCCLKSOURCE_PLL,  3, 1 },
+};
+
+static const struct clk_profile *clk_cur = &clk_profiles[0];
+
+// "<name>" or "<name> force", NULL for an overclock one without force
+static const struct clk_profile *clk_find(const char *name)
+{
+    int i, len = strcspn(name, " ");
+
+    for (i = 0; i < ARRAY_SIZE(clk_profiles); i++) {
+        if (strncmp(clk_profiles[i].name, name, len) || clk_profiles[i].name[len])
+            continue;
+        if (clk_profiles[i].overclock && strcmp(&name[len], " force")) {
+            printk(KERN_ERR "clock: %s runs above the rated kernel clock, `%s force`",
+                   clk_profiles[i].name, clk_profiles[i].name);
+            return NULL;
+        }
+        return &clk_profiles[i];
+    }
+    return NULL;
+}
+
+int clk_fmc_freq(void)
+{
+    PLL1_ClocksTypeDef pll1;
+    PLL2_ClocksTypeDef pll2;
+
+    switch (__HAL_RCC_GET_FMC_SOURCE()) {
+    case RCC_FMCCLKSOURCE_PLL:
+        HAL_RCCEx_GetPLL1ClockFreq(&pll1);
+        return pll1.PLL1_Q_Frequency;
+    case RCC_FMCCLKSOURCE_PLL2:
+        HAL_RCCEx_GetPLL2ClockFreq(&pll2);
+        return pll2.PLL2_R_Frequency;
+    default:
+        return HAL_RCC_GetHCLKFreq();
+    }
+}
+
+int clk_qspi_freq(void)
+{
+    PLL1_ClocksTypeDef pll1;
+    PLL2_ClocksTypeDef pll2;
+
+    switch (__HAL_RCC_GET_QSPI_SOURCE()) {
+    case RCC_QSPICLKSOURCE_PLL:
+        HAL_RCCEx_GetPLL1ClockFreq(&pll1);
+        return pll1.PLL1_Q_Frequency;
+    case RCC_QSPICLKSOURCE_PLL2:
+        HAL_RCCEx_GetPLL2ClockFreq(&pll2);
+        return pll2.PLL2_R_Frequency;
+    default:
+        return HAL_RCC_GetHCLKFreq();
+    }
+}
+
+int clk_sdmmc_freq(void)
+{
+    return HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_SDMMC);
+}
+
+// SDMMC clock divider of the profile, for MX_SDMMC1_SD_Init
+int clk_sdmmc_div(void)
+{
+    return clk_cur->sd_div;
+}
+
+static int clk_pll3_start(int n, int q)
+{
+    int start = HAL_GetTick();
+
+    __HAL_RCC_PLL3_DISABLE();
+    while (__HAL_RCC_GET_FLAG(RCC_FLAG_PLL3RDY))
+        if (HAL_GetTick() - start > 2)
+            return -ETIMEDOUT;
+
+    __HAL_RCC_PLL3_CONFIG(SYSCLK_PLL_M, n, 2, q, 2);
+    __HAL_RCC_PLL3_VCIRANGE(RCC_PLL3VCIRANGE_2);
+    __HAL_RCC_PLL3_VCORANGE(RCC_PLL3VCOWIDE);
+    __HAL_RCC_PLL3FRACN_DISABLE();
+    __HAL_RCC_PLL3CLKOUT_ENABLE(RCC_PLL3_DIVQ);
+    __HAL_RCC_PLL3_ENABLE();
+
+    start = HAL_GetTick();
+    while (!__HAL_RCC_GET_FLAG(RCC_FLAG_PLL3RDY))
+        if (HAL_GetTick() - start > 2)
+            return -ETIMEDOUT;
+    return 0;
+}
+
+static int clk_apply(const struct clk_profile *p)
+{
+    RCC_PeriphCLKInitTypeDef clk = {0};
+
+    clk.PeriphClockSelection = RCC_PERIPHCLK_FMC | RCC_PERIPHCLK_QSPI | RCC_PERIPHCLK_SDMMC;
+    clk.FmcClockSelection = p->fmc;
+    clk.QspiClockSelection = p->qspi;
+    clk.SdmmcClockSelection = p->sdmmc;
+    if (p->pll2_n) {
+        clk.PLL2.PLL2M = SYSCLK_PLL_M;
+        clk.PLL2.PLL2N = p->pll2_n;
+        clk.PLL2.PLL2P = 2;
+        clk.PLL2.PLL2Q = 2;
+        clk.PLL2.PLL2R = p->pll2_r;
+        clk.PLL2.PLL2RGE = RCC_PLL2VCIRANGE_2;
+        clk.PLL2.PLL2VCOSEL = RCC_PLL2VCOWIDE;
+        clk.PLL2.PLL2FRACN = 0;
+    }
+    if (HAL_RCCEx_PeriphCLKConfig(&clk) != HAL_OK)
+        return -EIO;
+
+    clk_cur = p;
+    if (p->pll3_n)
+        return clk_pll3_start(p->pll3_n, p->pll3_q);
+    return 0;
+}
+
+/*
+ * core clocks, PLL1 VCO = HSE / m * n, P = 2, HCLK = core / 2
+ * wait states from the RM table for HCLK at that VOS, 550MHz as in the
+ * README keeps the 480MHz ones. `ker` is the HCLK maximum of the VOS,
+ * PLL1Q and kernel clocks off PLL2 must stay under it
+ */
+static const struct clk_core {
+    int mhz, pll_m, pll_n, ker;
+    unsigned int vos, latency;
+} clk_cores[] = {
+    { 550, 2,  88, 240, PWR_REGULATOR_VOLTAGE_SCALE0, FLASH_LATENCY_4 },
+    { 480, 5, 192, 240, PWR_REGULATOR_VOLTAGE_SCALE0, FLASH_LATENCY_4 },
+    { 400, 5, 160, 200, PWR_REGULATOR_VOLTAGE_SCALE1, FLASH_LATENCY_3 },
+    { 300, 5, 120, 150, PWR_REGULATOR_VOLTAGE_SCALE2, FLASH_LATENCY_2 },
+    { 200, 5,  80, 100, PWR_REGULATOR_VOLTAGE_SCALE3, FLASH_LATENCY_2 },
+};
+
+static const struct clk_core *clk_core_find(int mhz)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(clk_cores); i++)
+        if (clk_cores[i].mhz == mhz)
+            return &clk_cores[i];
+    return NULL;
+}
+
+static int clk_pll1_switch(const struct clk_core *c)
+{
+    RCC_OscInitTypeDef osc = {0};
+    RCC_ClkInitTypeDef clk;
+    uint32_t latency;
+    int ref = HSE_FREQUENCY * 1000 / c->pll_m;  // kHz
+
+    // park on HSE, PLL1 can't change while it runs the core
+    HAL_RCC_GetClockConfig(&clk, &latency);
+    clk.ClockType = RCC_CLOCKTYPE_SYSCLK;
+    clk.SYSCLKSource = RCC_SYSCLKSOURCE_HSE;
+    if (HAL_RCC_ClockConfig(&clk, latency) != HAL_OK)
+        return -EIO;
+
+    osc.OscillatorType = RCC_OSCILLATORTYPE_NONE;
+    osc.PLL.PLLState = RCC_PLL_ON;
+    osc.PLL.PLLSource = RCC_PLLSOURCE_HSE;
+    osc.PLL.PLLM = c->pll_m;
+    osc.PLL.PLLN = c->pll_n;
+    osc.PLL.PLLP = 2;
+    osc.PLL.PLLQ = (ref * c->pll_n / 1000 + c->ker - 1) / c->ker;
+    osc.PLL.PLLR = 2;
+    osc.PLL.PLLRGE = ref > 8000 ? RCC_PLL1VCIRANGE_3 : RCC_PLL1VCIRANGE_2;
+    osc.PLL.PLLVCOSEL = RCC_PLL1VCOWIDE;
+    osc.PLL.PLLFRACN = 0;
+    // at 25MHz any VOS does
+    if (HAL_PWREx_ControlVoltageScaling(c->vos) != HAL_OK ||
+        HAL_RCC_OscConfig(&osc) != HAL_OK)
+        return -EIO;
+
+    // updates SystemCoreClock and the SysTick reload
+    clk.ClockType = RCC_CLOCKTYPE_SYSCLK | RCC_CLOCKTYPE_HCLK | RCC_CLOCKTYPE_PCLK1 |
+                    RCC_CLOCKTYPE_PCLK2 | RCC_CLOCKTYPE_D3PCLK1 | RCC_CLOCKTYPE_D1PCLK1;
+    clk.SYSCLKSource = RCC_SYSCLKSOURCE_PLLCLK;
+    if (HAL_RCC_ClockConfig(&clk, c->latency) != HAL_OK)
+        return -EIO;
+    return 0;
+}
+
+/*
+ * qspi on HCLK: the smallest prescaler under the flash's limit,
+ * the tuned timing only holds at the kernel clock it was tuned at
+ */
+static void clk_qspi_rebalance(void)
+{
+    int prescaler = (clk_qspi_freq() + QSPI_FLASH_MAX_HZ - 1) / QSPI_FLASH_MAX_HZ - 1;
+
+    if (prescaler < 1)
+        prescaler = 1;  // 0 breaks memory mapped reads
+    QSPI_W25Qxx_SetTiming(prescaler, QSPI_SAMPLE_SHIFTING_HALFCYCLE, 0, 0);
+    QSPI_W25Qxx_Init();
+    qspi_timing_init();
+}
+
+/*
+ * the fastest kernel clock the profile keeps off HCLK and PLL1
+ */
+static int clk_pll2_max(void)
+{
+    int max = 0;
+
+    if (__HAL_RCC_GET_FMC_SOURCE() == RCC_FMCCLKSOURCE_PLL2)
+        max = clk_fmc_freq();
+    if (__HAL_RCC_GET_QSPI_SOURCE() == RCC_QSPICLKSOURCE_PLL2 && clk_qspi_freq() > max)
+        max = clk_qspi_freq();
+    if (__HAL_RCC_GET_SDMMC_SOURCE() == RCC_SDMMCCLKSOURCE_PLL2 && clk_sdmmc_freq() > max)
+        max = clk_sdmmc_freq();
+    return max;
+}
+
+/**
+ * switch the core to `mhz`, `early` before console and SDRAM are up
+ */
+static int clk_core_set(int mhz, int early)
+{
+    extern QSPI_HandleTypeDef hqspi;
+    const struct clk_core *c = clk_core_find(mhz);
+    int fmc_hclk = __HAL_RCC_GET_FMC_SOURCE() == RCC_FMCCLKSOURCE_HCLK;
+    int ret;
+
+    if (!c)
+        return -EINVAL;
+    if (HAL_QSPI_GetState(&hqspi) == HAL_QSPI_STATE_BUSY_MEM_MAPPED)
+        return -EBUSY;
+    if (clk_pll2_max() > c->ker * 1000000) {
+        printk(KERN_ERR "clock: %s runs kernel clocks at %dMHz, %dMHz allows %dMHz",
+               clk_cur->name, clk_pll2_max() / 1000000, mhz, c->ker);
+        return -ERANGE;
+    }
+
+    if (!early) {
+        console_flush();
+        // on HSE in between, HCLK = HSE / HPRE is the slowest of the three
+        if (fmc_hclk)
+            sdram_refresh(HSE_FREQUENCY * 1000000 /
+                          (HAL_RCC_GetSysClockFreq() / HAL_RCC_GetHCLKFreq()));
+    }
+
+    ret = clk_pll1_switch(c);
+
+    if (!early) {
+        sdram_refresh(clk_fmc_freq());
+        console_set_baud(console_get_baud());
+    }
+    if (__HAL_RCC_GET_QSPI_SOURCE() == RCC_QSPICLKSOURCE_D1HCLK)
+        clk_qspi_rebalance();
+
+    if (ret)
+        printk(KERN_ERR "clock: core switch to %dMHz failed", mhz);
+    else
+        printk(KERN_INFO "clock: core %dMHz, hclk %dMHz, fmc %dMHz, qspi %dMHz", mhz,
+               (int)(HAL_RCC_GetHCLKFreq() / 1000000), clk_fmc_freq() / 1000000,
+               clk_qspi_freq() / 1000000);
+    return ret;
+}
+
+/*
+ * profile from the env, after env_init, before sdram_init
+ */
+void clk_profile_init(void)
+{
+    const char *name = env_get("clkprofile");
+    const struct clk_profile *p;
+    int mhz;
+
+    if (!name)
+        name = CONFIG_CLK_PROFILE;
+    p = clk_find(name);
+    if (!p) {
+        printk(KERN_WARNING "clock: no profile %s", name);
+        p = clk_find(CONFIG_CLK_PROFILE);
+    }
+    if (!p || clk_apply(p)) {
+        printk(KERN_ERR "clock: profile %s failed, back to legacy", p ? p->name : name);
+        clk_apply(&clk_profiles[0]);
+    }
+    // qspi-flash was set up on HCLK
+    QSPI_W25Qxx_Init();
+
+    mhz = env_get_int("cpufreq", SYSCLK_FREQ);
+    if (mhz != SYSCLK_FREQ)
+        clk_core_set(mhz, 1);
+
+    printk(KERN_INFO "clock: %s, fmc %dMHz, qspi %dMHz, sdmmc %dMHz", clk_cur->name,
+           clk_fmc_freq() / 1000000, clk_qspi_freq() / 1000000,
+           clk_sdmmc_freq() / 1000000);
+}
+
+/*
+ * SDRAM stress and copy, qspi memory mapped read and SD read at the
+ * running profile, in an SDRAM arena block, loaded images stay
+ */
+#define CLK_BENCH_SIZE  (SDRAM_SIZE_MB * 0x100000 / 4)
+
+static int clk_bench(void)
+{
+    char *buf = arena_alloc(ARENA_SDRAM, CLK_BENCH_SIZE + 1024, "clkbench");
+    unsigned int base;
+    int sd, ret;
+
+    if (!buf)
+        return -ENOMEM;
+    // sdram_stress wants whole rows
+    base = ((unsigned int)buf + 1023) & ~1023u;
+    sd = sdmmc_read_speed((void *)base, CLK_BENCH_SIZE);
+    ret = sdram_stress(base, CLK_BENCH_SIZE) ? -EIO : 0;
+
+    printk("clkprofile: %s, core %dMHz", clk_cur->name, (int)(SystemCoreClock / 1000000));
+    printk("  sdram %3dMHz: %s, copy %dMB/s", sdram_clock() / 1000000,
+           ret ? "FAIL" : "ok", ret ? 0 : sdram_bandwidth((void *)base));
+    printk("  qspi  %3dMHz kernel: %dMB/s", clk_qspi_freq() / 1000000, qspi_read_speed());
+    if (sd < 0)
+        printk("  sd    %3dMHz: no card", clk_sdmmc_freq() / 2000000 / clk_cur->sd_div);
+    else
+        printk("  sd    %3dMHz: %d.%dMB/s", clk_sdmmc_freq() / 2000000 / clk_cur->sd_div,
+               sd / 1000, sd / 100 % 10);
+    arena_free(buf);
+    return ret ? ret : sd < 0 ? sd : 0;
+}
+
+int do_clkprofile(const char *buf)
+{
+    const struct clk_profile *p;
+    char val[16];
+    int idx = 0, i, ret;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+
+    if (!buf[idx]) {
+        for (i = 0; i < ARRAY_SIZE(clk_profiles); i++)
+            printk("%c %s", &clk_profiles[i] == clk_cur ? '*' : ' ', clk_profiles[i].name);
+        return 0;
+    }
+    if (!strcmp(&buf[idx], "bench"))
+        return clk_bench();
+
+    p = clk_find(&buf[idx]);
+    if (!p)
+        return -EINVAL;
+    scnprintf(val, sizeof(val), "%s%s", p->name, p->overclock ? " force" : "");
+    ret = env_set("clkprofile", val);
+    if (!ret)
+        ret = env_save();
+    if (!ret)
+        printk(KERN_INFO "clkprofile: %s from the next reset", p->name);
+    return ret;
+}
+
+void help_clkprofile(void)
+{
+    printsh("clkprofile [name [force] / bench]");
+    printsh("list the kernel clock profiles, keep one in the env for the next reset,");
+    printsh("fast overclocks PLL2R and needs force,");
+    printsh("or benchmark SDRAM, qspi-flash and SD at the running one, in free SDRAM");
+}
+SHELL_EXPORT_CMD(clkprofile, help_clkprofile, do_clkprofile);
+
+int do_clk(const char *buf)
+{
+    char val[8];
+    int idx = 0, i;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+
+    if (!buf[idx]) {
+        for (i = 0; i < ARRAY_SIZE(clk_cores); i++)
+            printk("%c %dMHz", clk_cores[i].mhz * 1000000 == SystemCoreClock ? '*' : ' ',
+                   clk_cores[i].mhz);
+        return 0;
+    }
+    if (!strcmp(&buf[idx], "save")) {
+        scnprintf(val, sizeof(val), "%d", (int)(SystemCoreClock / 1000000));
+        i = env_set("cpufreq", val);
+        return i ? i : env_save();
+    }
+    return clk_core_set(atoi(&buf[idx]), 0);
+}
+
+void help_clk(void)
+{
+    printsh("clk [MHz / save]");
+    printsh("list or switch the core clock, console, qspi and SDRAM refresh follow,");
+    printsh("`save` keeps it in the env for the next boot, linux gets it in the fdt");
+}
+SHELL_EXPORT_CMD(clk, help_clk, do_clk);
@@ -17,7 +17,7 @@
 #include "qspi-flash.h"
 #include "ff.h"
 
-extern struct cmd *head;
+#define MAX_PATH_LENGTH  32
 
 /*
  * parse number of `boot`
@@ -54,12 +54,15 @@ static void __parse_number(const char *buf, int *idx, int *number, int hex)
 }
 
 /**
- * instead of: sscanf(buf, "%s %x - %x", cmd, &kernel, &fdt) != 3
+ * instead of: sscanf(buf, "%s %x %s %x", cmd, &kernel, initrd, &fdt) != 4
+ *
+ * initrd: "-" for none, "<file>" or "<file>@<address>"
  */
-static int parse_address(const char *buf, int *kernel, int *fdt) {
-    int idx = 0;
+static int parse_address(const char *buf, int *kernel, char *initrd, int *fdt) {
+    int idx = 0, len;
     *kernel = 0;
     *fdt = 0;
+    initrd[0] = '\0';
 
     if (strlen(buf) < 9)
         return 0;
@@ -72,9 +75,16 @@ static int parse_address(const char *buf, int *kernel, int *fdt) {
     while (buf[idx] == ' ') idx++; // skip space
     __parse_number(buf, &idx, kernel, 1);
 
-    // no-support rootfs address
+    // initrd file name
     while (buf[idx] == ' ') idx++;
-    __parse_number(buf, &idx, 0, 1);
+    len = strcspn(&buf[idx], " ");
+    if (len >= MAX_PATH_LENGTH)
+        return -ENAMETOOLONG;
+    if (strncmp(&buf[idx], "-", len)) {
+        memcpy(initrd, &buf[idx], len);
+        initrd[len] = '\0';
+    }
+    idx += len;
 
     // parse fdt address
     while (buf[idx] == ' ') idx++;
@@ -92,17 +102,36 @@ static int parse_address(const char *buf, int *kernel, int *fdt) {
 int do_boot(const char *buf)
 {
     int kernel, fdt;
+    int addr = INITRD_ADDR;
+    char initrd[MAX_PATH_LENGTH];
+    char *at;
+    int idx = 0;
 
-    if(parse_address(buf, &kernel, &fdt))
+    if(parse_address(buf, &kernel, initrd, &fdt))
         return -EFAULT;
+#ifdef INITRD_FILE
+    if (!kernel && !fdt)
+        strcpy(initrd, INITRD_FILE);
+#endif
+
+    if (initrd[0]) {
+        at = strchr(initrd, '@');
+        if (at) {
+            *at++ = '\0';
+            __parse_number(at, &idx, &addr, 1);
+        }
+        if (boot_load_initrd(initrd, addr))
+            return -EIO;
+    }
     kernel_entry(kernel, fdt);
     return 0;
 }
 
 void help_boot(void)
 {
-    printsh("boot <kernel address> - <fdt address>");
+    printsh("boot <kernel address> <initrd file[@address] / -> <fdt address>");
     printsh("use default address: boot ");
+    printsh("with initramfs: boot 90010000 rootfs.cpio.gz 90000000");
 }
 SHELL_EXPORT_CMD(boot, help_boot, do_boot);
 
@@ -111,9 +140,9 @@ SHELL_EXPORT_CMD(boot, help_boot, do_boot);
  */
 int do_help(const char *buf)
 {
-    struct cmd *iter;
+    const struct cmd *iter;
     printk("support command:");
-    for (iter = head->next; iter; iter = iter->next) {
+    for_each_cmd(iter) {
         printk("  %s", iter->name);
         if (iter->help)
             iter->help();
@@ -209,15 +238,323 @@ void help_mw(void)
 }
 SHELL_EXPORT_CMD(mw, help_mw, do_mw);
 
+/*
+ * bulk memory: cp, cmp, fill, crc32
+ *
+ * cp / cmp / fill take a ".b" / ".w" / ".l" suffix, the count is in
+ * those units, 32-bit by default, numbers with 0x are hex
+ */
+static int cmd_width(const char *buf)
+{
+    int len = strcspn(buf, " .");
+
+    if (buf[len] != '.')
+        return 4;
+    switch (buf[len + 1]) {
+    case 'b': return 1;
+    case 'w': return 2;
+    case 'l': return 4;
+    default:  return -EINVAL;
+    }
+}
+
+// <hex> <hex / value> <count>
+static int parse_bulk(const char *buf, int *a, int *b, int *count)
+{
+    int idx = 0;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+
+    while (buf[idx] == ' ') idx++;
+    __parse_number(buf, &idx, a, 1);
+    while (buf[idx] == ' ') idx++;
+    __parse_number(buf, &idx, b, 1);
+    while (buf[idx] == ' ') idx++;
+    __parse_number(buf, &idx, count, !strncmp(&buf[idx], "0x", 2));
+
+    if (*count <= 0)
+        return -EINVAL;
+    return 0;
+}
+
+/*
+ * `bytes` done since get_cycles() was `start`
+ */
+static void report_rate(const char *what, int bytes, unsigned int start)
+{
+    unsigned int us = (get_cycles() - start) / (SystemCoreClock / 1000000);
+
+    if (!us)
+        us = 1;
+    printk("%s: %d bytes in %dus, %d.%dMB/s", what, bytes, us,
+           bytes / us, bytes % us * 10 / us);
+}
+
+int do_cp(const char *buf)
+{
+    int src, dst, count, ret;
+    int width = cmd_width(buf);
+    unsigned int start;
+
+    if (width < 0 || parse_bulk(buf, &src, &dst, &count))
+        return -EINVAL;
+
+    start = get_cycles();
+    ret = mem_copy((void *)dst, (void *)src, count * width);
+    if (ret) {
+        printk(KERN_ERR "cp: %d in mdma transfer", ret);
+        return ret;
+    }
+    report_rate("cp", count * width, start);
+    return 0;
+}
+
+void help_cp(void)
+{
+    printsh("cp[.b/.w/.l] <source> <destination> <count>");
+    printsh("copy with mdma, e.g. cp c0000000 c1000000 0x400000");
+}
+SHELL_EXPORT_CMD(cp, help_cp, do_cp);
+
+int do_cmp(const char *buf)
+{
+    int a, b, count, off, bytes;
+    int width = cmd_width(buf);
+    unsigned int start;
+
+    if (width < 0 || parse_bulk(buf, &a, &b, &count))
+        return -EINVAL;
+
+    bytes = count * width;
+    start = get_cycles();
+    off = mem_cmp((void *)a, (void *)b, width, bytes);
+    if (off < bytes) {
+        printk("cmp: differ at 0x%08x (0x%0*x) / 0x%08x (0x%0*x)",
+               a + off, width * 2, width == 1 ? *(unsigned char *)(a + off) :
+               width == 2 ? *(unsigned short *)(a + off) : *(unsigned int *)(a + off),
+               b + off, width * 2, width == 1 ? *(unsigned char *)(b + off) :
+               width == 2 ? *(unsigned short *)(b + off) : *(unsigned int *)(b + off));
+        return -EFAULT;
+    }
+    report_rate("cmp", bytes, start);
+    return 0;
+}
+
+void help_cmp(void)
+{
+    printsh("cmp[.b/.w/.l] <address> <address> <count>");
+    printsh("compare, stop at the first difference");
+}
+SHELL_EXPORT_CMD(cmp, help_cmp, do_cmp);
+
+int do_fill(const char *buf)
+{
+    int addr, value, count, ret;
+    int width = cmd_width(buf);
+    unsigned int start;
+
+    if (width < 0 || parse_bulk(buf, &addr, &value, &count))
+        return -EINVAL;
+
+    start = get_cycles();
+    ret = mem_fill((void *)addr, value, width, count * width);
+    if (ret) {
+        printk(KERN_ERR "fill: %d in dma2d transfer", ret);
+        return ret;
+    }
+    report_rate("fill", count * width, start);
+    return 0;
+}
+
+void help_fill(void)
+{
+    printsh("fill[.b/.w/.l] <address> <value> <count>");
+    printsh("fill with dma2d, e.g. fill c0000000 0 0x800000: whole sdram");
+}
+SHELL_EXPORT_CMD(fill, help_fill, do_fill);
+
+int do_crc32(const char *buf)
+{
+    int addr, len, idx = 0;
+    unsigned int start, crc;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+    __parse_number(buf, &idx, &addr, 1);
+    while (buf[idx] == ' ') idx++;
+    __parse_number(buf, &idx, &len, !strncmp(&buf[idx], "0x", 2));
+    if (len <= 0)
+        return -EINVAL;
+
+    start = get_cycles();
+    crc = mem_crc32((void *)addr, len);
+    report_rate("crc32", len, start);
+    printk("crc32 0x%08x ... 0x%08x: %08x", addr, addr + len - 1, crc);
+    return 0;
+}
+
+void help_crc32(void)
+{
+    printsh("crc32 <address> <bytes>");
+    printsh("zlib crc32 on the CRC unit fed by mdma");
+}
+SHELL_EXPORT_CMD(crc32, help_crc32, do_crc32);
+
+/*
+ * load / save: sdcard files <-> memory
+ */
+static const struct {
+    unsigned int base, size;
+} ram_regions[] = {
+    { 0x20000000, 0x20000 },                        // DTCM
+    { 0x24000000, 0x80000 },                        // AXI-SRAM
+    { 0x30000000, 0x48000 },                        // SRAM1-3
+    { 0x38000000, 0x10000 },                        // SRAM4
+    { SDRAM_BASE_ADDR, SDRAM_SIZE_MB * 0x100000 },
+};
+
+// bytes from `addr` to the end of its ram, -EFAULT outside ram
+int mem_room(unsigned int addr)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(ram_regions); i++)
+        if (addr - ram_regions[i].base < ram_regions[i].size)
+            return ram_regions[i].base + ram_regions[i].size - addr;
+    return -EFAULT;
+}
+
+// <file> <hex address> [<length>]
+static int parse_load(const char *buf, char *file, int *addr, int *len)
+{
+    int idx = 0, n;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+
+    n = strcspn(&buf[idx], " ");
+    if (!n)
+        return -EINVAL;
+    if (n >= MAX_PATH_LENGTH)
+        return -ENAMETOOLONG;
+    memcpy(file, &buf[idx], n);
+    file[n] = '\0';
+    idx += n;
+
+    while (buf[idx] == ' ') idx++;
+    __parse_number(buf, &idx, addr, 1);
+    while (buf[idx] == ' ') idx++;
+    __parse_number(buf, &idx, len, !strncmp(&buf[idx], "0x", 2));
+    return 0;
+}
+
+int do_load(const char *buf)
+{
+    char file[MAX_PATH_LENGTH];
+    int addr, len, room, gap, size, ret;
+
+    ret = parse_load(buf, file, &addr, &len);
+    if (ret)
+        return ret;
+    room = mem_room(addr);
+    if (room < 0)
+        return room;
+    // up to the next loaded image or buffer
+    gap = arena_room(addr);
+    if (gap < 0) {
+        printk(KERN_ERR "load: 0x%08x is in use by %s", addr, arena_owner(addr, 1));
+        return gap;
+    }
+    if (gap > 0 && gap < room)
+        room = gap;
+    if (len > 0 && len < room)
+        room = len;
+
+    ret = sdmmc_load_file(file, (void *)addr, room, &size);
+    if (ret)
+        return ret;
+    printk("load: %d bytes at 0x%08x", size, addr);
+    return 0;
+}
+
+void help_load(void)
+{
+    printsh("load <file> <address> [max bytes]");
+    printsh("e.g. load 0:test.bin 24000000, 32B aligned AXI SRAM and SDRAM addresses use DMA");
+}
+SHELL_EXPORT_CMD(load, help_load, do_load);
+
+int do_save(const char *buf)
+{
+    char file[MAX_PATH_LENGTH];
+    int addr, len, room, idx = 0, n;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+    __parse_number(buf, &idx, &addr, 1);
+    while (buf[idx] == ' ') idx++;
+    __parse_number(buf, &idx, &len, !strncmp(&buf[idx], "0x", 2));
+    while (buf[idx] == ' ') idx++;
+
+    n = strcspn(&buf[idx], " ");
+    if (!n)
+        return -EINVAL;
+    if (n >= MAX_PATH_LENGTH)
+        return -ENAMETOOLONG;
+    memcpy(file, &buf[idx], n);
+    file[n] = '\0';
+
+    room = mem_room(addr);
+    if (room < 0 || len <= 0 || len > room)
+        return -EFAULT;
+
+    return sdmmc_save_file(file, (void *)addr, len);
+}
+
+void help_save(void)
+{
+    printsh("save <address> <bytes> <file>");
+    printsh("e.g. save c0000000 0x2000000 0:sdram.bin, dump the whole sdram");
+}
+SHELL_EXPORT_CMD(save, help_save, do_save);
+
 /*
  * mtest
  */
 int do_mtest(const char *buf)
 {
-    memory_speed_test();
+    int idx = 0, stride = 0;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+
+    if (!strncmp(&buf[idx], "printk", 6))
+        printk_speed_test();
+    else if (!strncmp(&buf[idx], "stream", 6))
+        memory_stream_test();
+    else if (!strncmp(&buf[idx], "chase", 5)) {
+        idx += 5;
+        while (buf[idx] == ' ') idx++;
+        __parse_number(buf, &idx, &stride, 0);
+        memory_latency_test(stride);
+    } else
+        memory_speed_test();
     return 0;
 }
-SHELL_EXPORT_CMD(mtest, NULL, do_mtest);
+
+void help_mtest(void)
+{
+    printsh("mtest [printk / stream / chase [stride]]");
+    printsh("sdram / qspi-flash speed, or cycles per printk line");
+    printsh("stream: copy/scale/add/triad/ldrd/ldm MB/s of every ram, dcache on/off, CSV");
+    printsh("chase: ns per dependent load over 1KB.. working sets, stride 64 by default");
+}
+SHELL_EXPORT_CMD(mtest, help_mtest, do_mtest);
 
 /*
  * cache control
@@ -287,6 +624,196 @@ void help_cache(void)
 }
 SHELL_EXPORT_CMD(cache, help_cache, do_cache);
 
+/*
+ * baud: switch console rate, keep it only if the host answers
+ */
+#define BAUD_CONFIRM_MS  10000
+
+static int baud_switch(int baud)
+{
+    int old = console_get_baud();
+    int c, ret;
+
+    printk("switching to %d baud, press ENTER within %ds to keep it",
+            baud, BAUD_CONFIRM_MS / 1000);
+    ret = console_set_baud(baud);
+    if (ret) {
+        printk(KERN_ERR "baud: %d not reachable", baud);
+        return ret;
+    }
+
+    // drop anything sent while the rate was changing
+    while (console_tstc())
+        console_getc(0);
+    printk("press ENTER to confirm %d baud", baud);
+    do {
+        c = console_getc(BAUD_CONFIRM_MS);
+    } while (c >= 0 && c != '\r' && c != '\n');
+
+    if (c < 0) {
+        console_set_baud(old);
+        printk(KERN_WARNING "baud: no answer, back to %d", old);
+        return -ETIMEDOUT;
+    }
+    printk("baud: %d", baud);
+    return 0;
+}
+
+int do_baud(const char *buf)
+{
+    int idx = 0, baud;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+
+    if (buf[idx] == '\0') {
+        printk("baud: %d", console_get_baud());
+        return 0;
+    }
+    if (!strncmp(&buf[idx], "save", 4)) {
+        if (console_baud_save()) {
+            printk(KERN_ERR "baud: failed to save");
+            return -EIO;
+        }
+        printk("baud: %d saved", console_get_baud());
+        return 0;
+    }
+
+    __parse_number(buf, &idx, &baud, 0);
+    if (baud <= 0)
+        return -EINVAL;
+    return baud_switch(baud);
+}
+
+void help_baud(void)
+{
+    printsh("baud [rate / save]");
+    printsh("switch console baud, ENTER at the new rate to keep it");
+    printsh("save: use it from next boot, linux gets it via bootargs");
+}
+SHELL_EXPORT_CMD(baud, help_baud, do_baud);
+
+/*
+ * env: persistent variables
+ */
+int do_env(const char *buf)
+{
+    char key[32], val[200];
+    const char *arg, *v;
+    int idx = 0, len, ret;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+    arg = &buf[idx];
+
+    // sub command
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+
+    // key
+    len = strcspn(&buf[idx], " ");
+    if (len >= (int)sizeof(key))
+        return -ENAMETOOLONG;
+    memcpy(key, &buf[idx], len);
+    key[len] = '\0';
+    idx += len;
+    while (buf[idx] == ' ') idx++;
+
+    // value: rest of the line, quotes stripped
+    len = strlen(&buf[idx]);
+    if (len >= 2 && (buf[idx] == '\'' || buf[idx] == '"') && buf[idx + len - 1] == buf[idx]) {
+        idx++;
+        len -= 2;
+    }
+    if (len >= (int)sizeof(val))
+        return -E2BIG;
+    memcpy(val, &buf[idx], len);
+    val[len] = '\0';
+
+    switch (arg[0]) {
+    case '\0':
+    case 'p':
+        env_print();
+        return 0;
+    case 'g':
+        if (!key[0])
+            return -EINVAL;
+        v = env_get(key);
+        if (!v)
+            return -ENOENT;
+        printk("%s", v);
+        return 0;
+    case 's':
+        if (arg[1] == 'a') {
+            ret = env_save();
+            if (ret)
+                printk(KERN_ERR "env: failed to save");
+            return ret;
+        }
+        ret = env_set(key, val);
+        if (ret)
+            printk(KERN_ERR "env: %d in setting %s", ret, key);
+        return ret;
+    default:
+        return -EINVAL;
+    }
+}
+
+void help_env(void)
+{
+    printsh("env [print / get <key> / set <key> [value] / save]");
+    printsh("set without value deletes, quote a value holding ; && ||");
+    printsh("used: bootcmd bootdelay baudrate kerneladdr fdtaddr blinktime");
+}
+SHELL_EXPORT_CMD(env, help_env, do_env);
+
+/*
+ * dmesg: print the log ring
+ */
+int do_dmesg(const char *buf)
+{
+    int idx = 0;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+
+    if (buf[idx] != '-') {
+        log_dump();
+        return 0;
+    }
+
+    switch (buf[idx + 1]) {
+    case 'c':
+        log_dump();
+        log_clear();
+        break;
+    case 'C':
+        log_clear();
+        break;
+    case 'D':
+        console_enable(0);
+        break;
+    case 'E':
+        console_enable(1);
+        break;
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+void help_dmesg(void)
+{
+    printsh("dmesg [-c/-C/-D/-E]");
+    printsh("print the log, -c print and clear, -C clear");
+    printsh("-D/-E disable/enable printk on the console");
+}
+SHELL_EXPORT_CMD(dmesg, help_dmesg, do_dmesg);
+
 /*
  * version
  */
@@ -302,7 +829,7 @@ SHELL_EXPORT_CMD(version, NULL, do_version);
  */
 int do_reset(const char *buf)
 {
-    NVIC_SystemReset();
+    warmboot_reset();
     return 0;
 }
 SHELL_EXPORT_CMD(reset, NULL, do_reset);
@@ -391,17 +918,18 @@ int update_fdt(void)
 
     if (ret == FR_OK) {
         // write into qspi-flash
-        printk("image size: %3.2fKB, erasing flash ...", (float)size/1024);
+        printk("image size: %d.%02dKB, erasing flash ...", size / 1024, size % 1024 * 100 / 1024);
         QSPI_W25Qxx_BlockErase_64K(FDT_ADDR-QSPI_FLASH_BASE_ADDR);
         printk("writing dtb ...");
         ret = QSPI_W25Qxx_WriteBuffer(fdt, FDT_ADDR-QSPI_FLASH_BASE_ADDR, size);
+        arena_free(fdt);
         if (ret) {
             printk(KERN_ERR "%d in writing qspi-flash", ret);
             return -EIO;
         }
         printk("update fdt success");
     }
-    return 0;
+    return ret;
 }
 
 int update_kernel(void)
@@ -443,7 +971,8 @@ int update_kernel(void)
     ret = sdmmc_read_file("0:kernel", &image_buffer, &size);
 
     if (ret == FR_OK) {
-        printk("image size: %3.2fMB, ready to erase flash:", (float)size/1024/1024);
+        printk("image size: %d.%02dMB, ready to erase flash:",
+                size >> 20, (size & 0xfffff) * 100 >> 20);
 
         while (eaddr < size) {
             i = (eaddr >> 16) - 1;
@@ -457,6 +986,7 @@ int update_kernel(void)
             ret = QSPI_W25Qxx_WriteBuffer(image_buffer + i * 0x10000, eaddr, 0x10000);
             if (ret) {
                 printk(KERN_ERR "\r\n%d in writing qspi-flash", ret);
+                arena_free(image_buffer);
                 return -EIO;
             }
 
@@ -466,6 +996,7 @@ int update_kernel(void)
 
             eaddr += 0x10000;
         }
+        arena_free(image_buffer);
 
         ret = QSPI_W25Qxx_WritePage(&(uint8_t){0x00}, BITMAP_SECTOR+BITMAP_SIZE, 1);
         if (ret) {
@@ -474,7 +1005,7 @@ int update_kernel(void)
         }
         printk("\r\nupdate kernel success");
     }
-    return 0;
+    return ret;
 }
 
 int do_update(const char *buf)
@@ -491,15 +1022,12 @@ int do_update(const char *buf)
     
     switch (arg[0]) {
     case 'f':
-        update_fdt();
-        break;
+        return update_fdt();
     case 'k':
-        update_kernel();
-        break;
+        return update_kernel();
     default:
         return -EINVAL;
     }
-    return 0;
 }
 
 void help_update(void)
@@ -0,0 +1,30 @@
+/**
+ * @file crc32.c
+ * @brief crc-32 (ieee 802.3, same as zlib), nibble table
+ * @version 1.0
+ *
+ */
+#include "bsp.h"
+
+static const unsigned int crc_table[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+/**
+ * crc = crc32(0, buf, len) for a new sum, pass the last one to continue
+ */
+unsigned int crc32(unsigned int crc, const void *buf, int len)
+{
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ crc_table[crc & 0xf];
+        crc = (crc >> 4) ^ crc_table[crc & 0xf];
+    }
+    return ~crc;
+}
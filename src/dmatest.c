@@ -0,0 +1,468 @@
+/**
+ * @file dmatest.c
+ * @brief which engine moves memory fastest between which rams
+ * @version 1.0
+ *
+ * every engine that can reach both ends copies between every region
+ * pair, at a few sizes and burst settings, best of DMATEST_RUNS:
+ *
+ *   cpu:   memcpy
+ *   mdma:  D1, reaches everything incl. the TCMs (AHBS)
+ *   dma2:  D2, stream 0, FIFO on, no TCM (DMA1 0/1 are the console)
+ *   bdma:  D3, SRAM4 only
+ *   dma2d: D1, memory to memory ARGB8888, no TCM
+ *
+ * `setup` is the cpu time to program and start an engine, the cpu is
+ * free for the rest, the dcache is cleaned and invalidated before
+ * each run, outside the timing
+ *
+ * `dmatest contention` runs an engine and memcpy on the same rams at
+ * once and compares both with running alone
+ */
+#include <stm32h7xx_hal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bsp.h"
+#include "errno.h"
+#include "cmd.h"
+#include "qspi-flash.h"
+
+#define DMATEST_RUNS    3
+#define DMATEST_MAX     0x8000      // largest size, a region holds two
+#define DMATEST_CHUNK   1024        // memcpy step while an engine runs
+#define DMATEST_TIMEOUT 100         // ms
+
+enum {
+    R_DTCM  = 1 << 0,
+    R_AXI   = 1 << 1,
+    R_D2    = 1 << 2,
+    R_D3    = 1 << 3,
+    R_SDRAM = 1 << 4,
+    R_QSPI  = 1 << 5,
+};
+#define R_ALL   (R_DTCM | R_AXI | R_D2 | R_D3 | R_SDRAM | R_QSPI)
+
+struct dt_region {
+    const char *name;
+    unsigned int mask;
+    int arena;          // -1: fixed base
+    unsigned int base;  // else 0 if the arena had no room
+    int writable;
+};
+
+static struct dt_region regions[] = {
+    { "dtcm",    R_DTCM,  ARENA_DTCM,  0,                    1 },
+    { "axi",     R_AXI,   ARENA_AXI,   0,                    1 },
+    { "sram1-3", R_D2,    ARENA_D2,    0,                    1 },
+    { "sram4",   R_D3,    ARENA_D3,    0,                    1 },
+    { "sdram",   R_SDRAM, ARENA_SDRAM, 0,                    1 },
+    { "qspi",    R_QSPI,  -1,          QSPI_FLASH_BASE_ADDR, 0 },
+};
+
+static MDMA_HandleTypeDef hmdma;
+static DMA_HandleTypeDef hdma;
+
+/*
+ * engines: start a copy of `len` bytes, word aligned, then poll
+ * `done` (1 done, <0 failed) and `finish` it
+ */
+struct engine {
+    const char *name;
+    const char *burst;
+    unsigned int reach;
+    int (*start)(unsigned int, unsigned int, int, int);
+    int (*done)(void);
+    int (*finish)(void);
+    int arg;
+};
+
+static int cpu_start(unsigned int dst, unsigned int src, int len, int arg)
+{
+    memcpy((void *)dst, (void *)src, len);
+    return 0;
+}
+
+static int cpu_done(void)
+{
+    return 1;
+}
+
+static int cpu_finish(void)
+{
+    return 0;
+}
+
+// `burst`: 0 single, 1 4 beats, 2 16 beats
+static int mdma_start(unsigned int dst, unsigned int src, int len, int burst)
+{
+    static const unsigned int src_burst[] = {
+        MDMA_SOURCE_BURST_SINGLE, MDMA_SOURCE_BURST_4BEATS, MDMA_SOURCE_BURST_16BEATS };
+    static const unsigned int dst_burst[] = {
+        MDMA_DEST_BURST_SINGLE, MDMA_DEST_BURST_4BEATS, MDMA_DEST_BURST_16BEATS };
+
+    __HAL_RCC_MDMA_CLK_ENABLE();
+
+    hmdma.Instance = MDMA_Channel0;
+    hmdma.Init.Request = MDMA_REQUEST_SW;
+    hmdma.Init.TransferTriggerMode = MDMA_BLOCK_TRANSFER;
+    hmdma.Init.Priority = MDMA_PRIORITY_VERY_HIGH;
+    hmdma.Init.Endianness = MDMA_LITTLE_ENDIANNESS_PRESERVE;
+    hmdma.Init.SourceInc = MDMA_SRC_INC_WORD;
+    hmdma.Init.DestinationInc = MDMA_DEST_INC_WORD;
+    hmdma.Init.SourceDataSize = MDMA_SRC_DATASIZE_WORD;
+    hmdma.Init.DestDataSize = MDMA_DEST_DATASIZE_WORD;
+    hmdma.Init.DataAlignment = MDMA_DATAALIGN_PACKENABLE;
+    hmdma.Init.BufferTransferLength = 128;
+    hmdma.Init.SourceBurst = src_burst[burst];
+    hmdma.Init.DestBurst = dst_burst[burst];
+    hmdma.Init.SourceBlockAddressOffset = 0;
+    hmdma.Init.DestBlockAddressOffset = 0;
+
+    if (HAL_MDMA_Init(&hmdma) != HAL_OK ||
+        HAL_MDMA_Start(&hmdma, src, dst, len, 1) != HAL_OK)
+        return -EIO;
+    return 0;
+}
+
+static int mdma_done(void)
+{
+    unsigned int isr = MDMA_Channel0->CISR;
+
+    if (isr & MDMA_CISR_TEIF)
+        return -EIO;
+    return !!(isr & MDMA_CISR_CTCIF);
+}
+
+static int mdma_finish(void)
+{
+    int ret = 0;
+
+    if (HAL_MDMA_PollForTransfer(&hmdma, HAL_MDMA_FULL_TRANSFER, DMATEST_TIMEOUT) != HAL_OK) {
+        HAL_MDMA_Abort(&hmdma);
+        ret = -EIO;
+    }
+    HAL_MDMA_DeInit(&hmdma);
+    return ret;
+}
+
+/*
+ * DMA2 stream 0 or BDMA channel 0, memory to memory
+ * words: the FIFO holds 16 bytes, one INC4 burst
+ */
+static int dma_start(unsigned int dst, unsigned int src, int len, int burst)
+{
+    if (burst < 0) {
+        __HAL_RCC_BDMA_CLK_ENABLE();
+        hdma.Instance = BDMA_Channel0;
+        hdma.Init.Request = BDMA_REQUEST_MEM2MEM;
+        burst = DMA_MBURST_SINGLE;
+    } else {
+        __HAL_RCC_DMA2_CLK_ENABLE();
+        hdma.Instance = DMA2_Stream0;
+        hdma.Init.Request = DMA_REQUEST_MEM2MEM;
+    }
+    hdma.Init.Direction = DMA_MEMORY_TO_MEMORY;
+    hdma.Init.PeriphInc = DMA_PINC_ENABLE;
+    hdma.Init.MemInc = DMA_MINC_ENABLE;
+    hdma.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    hdma.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+    hdma.Init.Mode = DMA_NORMAL;
+    hdma.Init.Priority = DMA_PRIORITY_VERY_HIGH;
+    hdma.Init.FIFOMode = DMA_FIFOMODE_ENABLE;
+    hdma.Init.FIFOThreshold = DMA_FIFO_THRESHOLD_FULL;
+    hdma.Init.MemBurst = burst;
+    hdma.Init.PeriphBurst = burst == DMA_MBURST_INC4 ? DMA_PBURST_INC4 : DMA_PBURST_SINGLE;
+
+    if (HAL_DMA_Init(&hdma) != HAL_OK ||
+        HAL_DMA_Start(&hdma, src, dst, len / 4) != HAL_OK)
+        return -EIO;
+    return 0;
+}
+
+static int dma_done(void)
+{
+    unsigned int isr;
+
+    if (hdma.Instance == (void *)BDMA_Channel0) {
+        isr = BDMA->ISR;
+        if (isr & BDMA_ISR_TEIF0)
+            return -EIO;
+        return !!(isr & BDMA_ISR_TCIF0);
+    }
+    isr = DMA2->LISR;
+    if (isr & DMA_LISR_TEIF0)
+        return -EIO;
+    return !!(isr & DMA_LISR_TCIF0);
+}
+
+static int dma_finish(void)
+{
+    int ret = 0;
+
+    if (HAL_DMA_PollForTransfer(&hdma, HAL_DMA_FULL_TRANSFER, DMATEST_TIMEOUT) != HAL_OK) {
+        HAL_DMA_Abort(&hdma);
+        ret = -EIO;
+    }
+    HAL_DMA_DeInit(&hdma);
+    return ret;
+}
+
+// DMA2D memory to memory, one line of ARGB8888 pixels
+static int dma2d_start(unsigned int dst, unsigned int src, int len, int arg)
+{
+    __HAL_RCC_DMA2D_CLK_ENABLE();
+
+    DMA2D->CR = 0;              // memory to memory
+    DMA2D->FGPFCCR = 0;         // ARGB8888
+    DMA2D->FGMAR = src;
+    DMA2D->FGOR = 0;
+    DMA2D->OMAR = dst;
+    DMA2D->OOR = 0;
+    DMA2D->NLR = (len / 4) << DMA2D_NLR_PL_Pos | 1;
+    DMA2D->IFCR = DMA2D_IFCR_CTCIF | DMA2D_IFCR_CTEIF | DMA2D_IFCR_CCEIF;
+    DMA2D->CR |= DMA2D_CR_START;
+    return 0;
+}
+
+static int dma2d_done(void)
+{
+    if (DMA2D->ISR & (DMA2D_ISR_TEIF | DMA2D_ISR_CEIF))
+        return -EIO;
+    return !(DMA2D->CR & DMA2D_CR_START);
+}
+
+static int dma2d_finish(void)
+{
+    return DMA2D->ISR & (DMA2D_ISR_TEIF | DMA2D_ISR_CEIF) ? -EIO : 0;
+}
+
+#define R_BUS   (R_AXI | R_D2 | R_D3 | R_SDRAM | R_QSPI)
+
+static const struct engine engines[] = {
+    { "cpu",   "-",      R_ALL, cpu_start,   cpu_done,   cpu_finish,   0 },
+    { "mdma",  "single", R_ALL, mdma_start,  mdma_done,  mdma_finish,  0 },
+    { "mdma",  "4",      R_ALL, mdma_start,  mdma_done,  mdma_finish,  1 },
+    { "mdma",  "16",     R_ALL, mdma_start,  mdma_done,  mdma_finish,  2 },
+    { "dma2",  "single", R_BUS, dma_start,   dma_done,   dma_finish,   DMA_MBURST_SINGLE },
+    { "dma2",  "4",      R_BUS, dma_start,   dma_done,   dma_finish,   DMA_MBURST_INC4 },
+    { "bdma",  "single", R_D3,  dma_start,   dma_done,   dma_finish,   -1 },
+    { "dma2d", "-",      R_BUS, dma2d_start, dma2d_done, dma2d_finish, 0 },
+};
+
+/*
+ * one copy, cycles in total and to start it, 0 on failure
+ * `cpu_len`: memcpy as much in `cpu_dst` meanwhile, `cpu_cycles`
+ * the time it took
+ */
+static unsigned int dt_run(const struct engine *e, unsigned int dst, unsigned int src,
+                           int len, unsigned int *setup, unsigned int cpu_dst,
+                           unsigned int cpu_src, int cpu_len, unsigned int *cpu_cycles)
+{
+    unsigned int start, total = 0, limit = SystemCoreClock / 1000 * DMATEST_TIMEOUT;
+    int done = 0, off = 0, ret;
+
+    SCB_CleanInvalidateDCache();
+    start = get_cycles();
+    ret = e->start(dst, src, len, e->arg);
+    *setup = get_cycles() - start;
+    if (ret)
+        return 0;
+
+    while (off < cpu_len || !done) {
+        if (off < cpu_len) {
+            memcpy((void *)(cpu_dst + off), (void *)(cpu_src + off), DMATEST_CHUNK);
+            off += DMATEST_CHUNK;
+            if (off >= cpu_len)
+                *cpu_cycles = get_cycles() - start;
+        }
+        if (!done) {
+            done = e->done();
+            if (done)
+                total = get_cycles() - start;
+            else if (get_cycles() - start > limit)
+                done = -ETIMEDOUT;
+        }
+    }
+    ret = e->finish();
+    return done < 0 || ret ? 0 : total;
+}
+
+static unsigned int dt_best(const struct engine *e, unsigned int dst, unsigned int src,
+                            int len, unsigned int *setup)
+{
+    unsigned int best = 0, cycles, s;
+    int i;
+
+    for (i = 0; i < DMATEST_RUNS; i++) {
+        cycles = dt_run(e, dst, src, len, &s, 0, 0, 0, NULL);
+        if (!cycles)
+            return 0;
+        if (!best || cycles < best) {
+            best = cycles;
+            *setup = s;
+        }
+    }
+    return best;
+}
+
+static int dt_mbps(int len, unsigned int cycles)
+{
+    return cycles ? (int)((unsigned int)len * (SystemCoreClock / 1000000) / cycles) : 0;
+}
+
+/*
+ * buffers of all regions, the source half at base, destination at
+ * base + DMATEST_MAX, all but qspi from their arenas
+ */
+static void dt_prepare(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(regions); i++)
+        if (regions[i].arena >= 0)
+            regions[i].base = (unsigned int)arena_alloc(regions[i].arena,
+                                                        2 * DMATEST_MAX, "dmatest");
+
+    __HAL_RCC_D2SRAM1_CLK_ENABLE();
+    __HAL_RCC_D2SRAM2_CLK_ENABLE();
+    __HAL_RCC_D2SRAM3_CLK_ENABLE();
+    QSPI_W25Qxx_MMMode();
+}
+
+static void dt_release(void)
+{
+    extern QSPI_HandleTypeDef hqspi;
+    int i;
+
+    HAL_QSPI_Abort(&hqspi);
+    QSPI_W25Qxx_Init();
+    for (i = 0; i < ARRAY_SIZE(regions); i++)
+        if (regions[i].arena >= 0)
+            arena_free((void *)regions[i].base);
+}
+
+/**
+ * @brief copy matrix: engine x burst x source x destination x size, CSV
+ *        plus the fastest engine of each pair at the largest size
+ */
+static void dma_bench(int only_len)
+{
+    int sizes[] = { 1024, 8192, DMATEST_MAX }, nsizes = ARRAY_SIZE(sizes);
+    const struct dt_region *s, *d;
+    const struct engine *e, *best_e;
+    unsigned int cycles, setup;
+    int si, di, ei, zi, len, mbps, best;
+
+    dt_prepare();
+    if (only_len) {
+        sizes[0] = only_len;
+        nsizes = 1;
+    }
+
+    printk("engine,burst,src,dst,bytes,MB/s,setup_cycles");
+    for (si = 0; si < ARRAY_SIZE(regions); si++) {
+        s = &regions[si];
+        for (di = 0; di < ARRAY_SIZE(regions); di++) {
+            d = &regions[di];
+            if (!s->base || !d->base || !d->writable)
+                continue;
+
+            best = 0;
+            best_e = NULL;
+            for (ei = 0; ei < ARRAY_SIZE(engines); ei++) {
+                e = &engines[ei];
+                if (!(e->reach & s->mask) || !(e->reach & d->mask))
+                    continue;
+                for (zi = 0; zi < nsizes; zi++) {
+                    len = sizes[zi];
+                    console_flush();
+                    cycles = dt_best(e, d->base + DMATEST_MAX, s->base, len, &setup);
+                    if (!cycles) {
+                        printk("%s,%s,%s,%s,%d,err,", e->name, e->burst, s->name, d->name, len);
+                        continue;
+                    }
+                    mbps = dt_mbps(len, cycles);
+                    printk("%s,%s,%s,%s,%d,%d,%d", e->name, e->burst, s->name, d->name,
+                           len, mbps, setup);
+                    if (zi == nsizes - 1 && mbps > best) {
+                        best = mbps;
+                        best_e = e;
+                    }
+                }
+            }
+            if (best_e)
+                printk("# best %s -> %s: %s burst %s, %dMB/s", s->name, d->name,
+                       best_e->name, best_e->burst, best);
+        }
+    }
+    dt_release();
+}
+
+/**
+ * @brief an engine and memcpy on the same rams, alone and at once
+ */
+static void dma_contention(void)
+{
+    static const int pairs[][2] = {   // source, destination region
+        { 1, 1 }, { 4, 4 }, { 1, 4 }, { 5, 1 },
+    };
+    static const int picks[] = { 3, 5, 7 };  // mdma 16, dma2 4, dma2d
+    const struct dt_region *s, *d;
+    const struct engine *e;
+    unsigned int alone, cpu_alone, both, cpu_both = 0, setup;
+    unsigned int cpu_src, cpu_dst;
+    int pi, ei, len = DMATEST_MAX / 2;
+
+    dt_prepare();
+    printk("engine,src,dst,bytes,dma_MB/s,dma_MB/s_shared,cpu_MB/s,cpu_MB/s_shared");
+    for (pi = 0; pi < ARRAY_SIZE(pairs); pi++) {
+        s = &regions[pairs[pi][0]];
+        d = &regions[pairs[pi][1]];
+        if (!s->base || !d->base)
+            continue;
+        // the cpu copies the other halves of the same buffers
+        cpu_src = s->base + len;
+        cpu_dst = d->base + DMATEST_MAX + len;
+        cpu_alone = dt_best(&engines[0], cpu_dst, cpu_src, len, &setup);
+
+        for (ei = 0; ei < ARRAY_SIZE(picks); ei++) {
+            e = &engines[picks[ei]];
+            console_flush();
+            alone = dt_best(e, d->base + DMATEST_MAX, s->base, len, &setup);
+            both = dt_run(e, d->base + DMATEST_MAX, s->base, len, &setup,
+                          cpu_dst, cpu_src, len, &cpu_both);
+            printk("%s,%s,%s,%d,%d,%d,%d,%d", e->name, s->name, d->name, len,
+                   dt_mbps(len, alone), dt_mbps(len, both),
+                   dt_mbps(len, cpu_alone), dt_mbps(len, cpu_both));
+        }
+    }
+    dt_release();
+}
+
+int do_dmatest(const char *buf)
+{
+    int idx = 0, len = 0;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+
+    if (!strncmp(&buf[idx], "contention", 10)) {
+        dma_contention();
+        return 0;
+    }
+    len = strtoul(&buf[idx], NULL, 0);
+    if (len && (len & 3 || len > DMATEST_MAX))
+        return -EINVAL;
+    dma_bench(len);
+    return 0;
+}
+
+void help_dmatest(void)
+{
+    printsh("dmatest [bytes / contention]");
+    printsh("MB/s of cpu, mdma, dma2, bdma and dma2d between all rams, CSV");
+    printsh("bytes: one size, up to 32768, contention: engine and cpu at once");
+}
+SHELL_EXPORT_CMD(dmatest, help_dmatest, do_dmatest);
@@ -0,0 +1,360 @@
+/**
+ * @file env.c
+ * @brief key/value environment, an append-only log in qspi-flash
+ * @version 1.0
+ *
+ * two sectors at ENV_ADDR take turns, the valid one with the higher
+ * sequence number is active:
+ *
+ *   u32 magic, u32 seq
+ *   records: u16 len, u16 crc, "key\0value\0", padded to 4
+ *
+ * the last record of a key wins, an empty value deletes it. a record
+ * never crosses a flash page, so saving one is a single page program,
+ * the rest of a page too short for it stays erased. a damaged record
+ * is skipped, or the rest of its page if the length is garbage.
+ *
+ * the active sector is mirrored in AXI-SRAM, `env_set` appends to the
+ * mirror and `env_save` programs what is new. when the sector is full,
+ * live records are packed into the other mirror, `env_save` then
+ * erases the other sector and writes its header last.
+ *
+ * a hash of key -> record offset is built at boot, values are read
+ * from the mirror, a pointer from env_get is valid until the next set
+ */
+#include <stm32h7xx_hal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bsp.h"
+#include "errno.h"
+#include "qspi-flash.h"
+
+#define ENV_MAGIC       0x30766e65  // "env0"
+#define ENV_PAGE_SIZE   256
+#define ENV_HASH_SIZE   128         // power of 2
+#define ENV_ERASED      0xffff
+
+#define REC_SIZE(len)   ((int)(sizeof(struct env_rec) + (len) + 3) & ~3)
+
+struct env_hdr {
+    unsigned int magic;
+    unsigned int seq;
+};
+
+struct env_rec {
+    unsigned short len;  // of data
+    unsigned short crc;  // low half of crc32(data)
+    char data[];
+};
+
+static char env_img[2][ENV_SECTOR_SIZE] __dma_buf __attribute__((aligned(32)));
+
+static struct {
+    char *img;      // mirror of the active sector
+    int sector;     // 0 / 1
+    int end;        // append offset
+    int saved;      // img[saved, end) not in flash yet
+    int fresh;      // sector must be erased and written whole
+    int count;      // live keys
+    short index[ENV_HASH_SIZE];
+} env;
+
+#define env_hdr()   ((struct env_hdr *)env.img)
+#define env_rec(o)  ((struct env_rec *)&env.img[o])
+
+static unsigned int env_hash(const char *key)
+{
+    unsigned int h = 2166136261u;  // fnv-1a
+
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 16777619u;
+    return h;
+}
+
+// slot of `key`, or the empty slot it would go in, -1 when full
+static int env_slot(const char *key)
+{
+    unsigned int h = env_hash(key);
+    int i, slot;
+
+    for (i = 0; i < ENV_HASH_SIZE; i++) {
+        slot = (h + i) & (ENV_HASH_SIZE - 1);
+        if (!env.index[slot] || !strcmp(env_rec(env.index[slot])->data, key))
+            return slot;
+    }
+    return -1;
+}
+
+static int env_rec_live(int off)
+{
+    struct env_rec *rec = env_rec(off);
+
+    return rec->data[strlen(rec->data) + 1] != '\0';
+}
+
+static int env_index(int off)
+{
+    int slot = env_slot(env_rec(off)->data);
+
+    if (slot < 0)
+        return -ENOSPC;
+    if (env.index[slot] && env_rec_live(env.index[slot]))
+        env.count--;
+    env.index[slot] = off;
+    if (env_rec_live(off))
+        env.count++;
+    return 0;
+}
+
+static int env_rec_valid(int off)
+{
+    struct env_rec *rec = env_rec(off);
+    int klen;
+
+    if (rec->crc != (crc32(0, rec->data, rec->len) & 0xffff))
+        return 0;
+    klen = strnlen(rec->data, rec->len);
+    return klen && klen < rec->len - 1 && !rec->data[rec->len - 1];
+}
+
+/*
+ * where a record of `size` goes, at `end` or the next page
+ */
+static int env_place(int end, int size)
+{
+    if (end / ENV_PAGE_SIZE != (end + size - 1) / ENV_PAGE_SIZE)
+        end = (end + ENV_PAGE_SIZE - 1) & ~(ENV_PAGE_SIZE - 1);
+    return end + size <= ENV_SECTOR_SIZE ? end : -ENOSPC;
+}
+
+/*
+ * walk the mirror, index all records, find the end
+ */
+static void env_scan(void)
+{
+    int pos = sizeof(struct env_hdr), next, size;
+    struct env_rec *rec;
+
+    memset(env.index, 0, sizeof(env.index));
+    env.count = 0;
+
+    while (pos + (int)sizeof(*rec) <= ENV_SECTOR_SIZE) {
+        rec = env_rec(pos);
+        next = (pos | (ENV_PAGE_SIZE - 1)) + 1;
+
+        if (rec->len == ENV_ERASED) {
+            // end, unless just the tail of a page left free
+            if (!(pos % ENV_PAGE_SIZE) || next >= ENV_SECTOR_SIZE ||
+                env_rec(next)->len == ENV_ERASED)
+                break;
+            pos = next;
+            continue;
+        }
+
+        size = REC_SIZE(rec->len);
+        if (rec->len < 3 || pos + size > next) {
+            printk(KERN_WARNING "env: bad record at 0x%03x", pos);
+            pos = next;
+            continue;
+        }
+        if (env_rec_valid(pos))
+            env_index(pos);
+        else
+            printk(KERN_WARNING "env: bad record at 0x%03x", pos);
+        pos += size;
+    }
+    env.end = pos < ENV_SECTOR_SIZE ? pos : ENV_SECTOR_SIZE;
+}
+
+static void env_format(int sector, unsigned int seq)
+{
+    env.sector = sector;
+    env.img = env_img[sector];
+    memset(env.img, 0xff, ENV_SECTOR_SIZE);
+    env_hdr()->magic = ENV_MAGIC;
+    env_hdr()->seq = seq;
+    env.fresh = 1;
+    env.saved = sizeof(struct env_hdr);
+}
+
+/**
+ * load the active sector, qspi-flash must be in indirect mode
+ */
+void env_init(void)
+{
+    struct env_hdr hdr[2];
+    unsigned int t = get_cycles();
+    int i, active = -1;
+
+    for (i = 0; i < 2; i++) {
+        if (QSPI_W25Qxx_ReadBuffer((uint8_t *)&hdr[i], ENV_ADDR + i * ENV_SECTOR_SIZE,
+                                   sizeof(hdr[i])) || hdr[i].magic != ENV_MAGIC)
+            continue;
+        if (active < 0 || (int)(hdr[i].seq - hdr[active].seq) > 0)
+            active = i;
+    }
+
+    if (active < 0 || QSPI_W25Qxx_ReadBuffer((uint8_t *)env_img[active],
+                           ENV_ADDR + active * ENV_SECTOR_SIZE, ENV_SECTOR_SIZE)) {
+        env_format(0, 0);
+        env.end = env.saved;
+        printk(KERN_INFO "env: empty, using defaults");
+        return;
+    }
+
+    env.sector = active;
+    env.img = env_img[active];
+    env.fresh = 0;
+    env_scan();
+    env.saved = env.end;
+
+    printk(KERN_INFO "env: %d vars, %d/%d bytes in sector %d, %dus", env.count,
+            env.end, ENV_SECTOR_SIZE, active,
+            (int)((get_cycles() - t) / (SystemCoreClock / 1000000)));
+}
+
+/**
+ * value of `key`, NULL if not set
+ */
+const char *env_get(const char *key)
+{
+    int slot = env_slot(key);
+    struct env_rec *rec;
+    const char *val;
+
+    if (slot < 0 || !env.index[slot])
+        return NULL;
+    rec = env_rec(env.index[slot]);
+    val = rec->data + strlen(rec->data) + 1;
+    return *val ? val : NULL;
+}
+
+/**
+ * number in `key`, decimal or 0x hex, `def` if not set
+ */
+int env_get_int(const char *key, int def)
+{
+    const char *val = env_get(key);
+
+    return val ? (int)strtoul(val, NULL, 0) : def;
+}
+
+/*
+ * pack live records into the other mirror
+ */
+static int env_gc(int need)
+{
+    char *old = env.img;
+    int old_sector = env.sector, old_saved = env.saved, old_fresh = env.fresh;
+    unsigned int seq = env_hdr()->seq;
+    int i, pos = sizeof(struct env_hdr), size;
+    struct env_rec *rec;
+
+    env_format(!env.sector, seq + 1);
+    for (i = 0; i < ENV_HASH_SIZE; i++) {
+        if (!env.index[i])
+            continue;
+        rec = (struct env_rec *)&old[env.index[i]];
+        if (!rec->data[strlen(rec->data) + 1])
+            continue;
+        size = REC_SIZE(rec->len);
+        pos = env_place(pos, size);
+        if (pos < 0)
+            break;
+        memcpy(&env.img[pos], rec, size);
+        pos += size;
+    }
+
+    if (pos < 0 || env_place(pos, need) < 0) {
+        env.sector = old_sector;
+        env.img = old;
+        env.saved = old_saved;
+        env.fresh = old_fresh;
+        return -ENOSPC;
+    }
+    env_scan();
+    return 0;
+}
+
+/**
+ * set `key` in RAM, NULL or "" deletes it, `env_save` keeps it
+ */
+int env_set(const char *key, const char *val)
+{
+    const char *cur = env_get(key);
+    int klen = strlen(key), vlen = val ? strlen(val) : 0;
+    int len = klen + vlen + 2, size = REC_SIZE(len);
+    int pos, slot;
+    struct env_rec *rec;
+
+    if (!klen || strchr(key, ' '))
+        return -EINVAL;
+    if (size > ENV_PAGE_SIZE)
+        return -E2BIG;
+    if ((!cur && !vlen) || (cur && val && !strcmp(cur, val)))
+        return 0;
+
+    // a new key needs a free slot
+    slot = env_slot(key);
+    if (slot < 0)
+        return -ENOSPC;
+
+    pos = env_place(env.end, size);
+    if (pos < 0) {
+        if (env_gc(size))
+            return -ENOSPC;
+        pos = env_place(env.end, size);
+    }
+
+    rec = env_rec(pos);
+    rec->len = len;
+    memcpy(rec->data, key, klen + 1);
+    memcpy(rec->data + klen + 1, vlen ? val : "", vlen + 1);
+    memset(rec->data + len, 0xff, size - sizeof(*rec) - len);
+    rec->crc = crc32(0, rec->data, len) & 0xffff;
+
+    if (env.saved == env.end)
+        env.saved = pos;
+    env.end = pos + size;
+    return env_index(pos);
+}
+
+/**
+ * program the records set since the last save
+ */
+int env_save(void)
+{
+    int addr = ENV_ADDR + env.sector * ENV_SECTOR_SIZE;
+    int hdr = sizeof(struct env_hdr);
+
+    if (env.fresh) {
+        if (QSPI_W25Qxx_SectorErase(addr) ||
+            (env.end > hdr && QSPI_W25Qxx_WriteBuffer((uint8_t *)env.img + hdr,
+                                                      addr + hdr, env.end - hdr)) ||
+            QSPI_W25Qxx_WritePage((uint8_t *)env.img, addr, hdr))
+            return -EIO;
+        env.fresh = 0;
+    } else if (env.saved < env.end) {
+        if (QSPI_W25Qxx_WriteBuffer((uint8_t *)env.img + env.saved, addr + env.saved,
+                                    env.end - env.saved))
+            return -EIO;
+    }
+    env.saved = env.end;
+    return 0;
+}
+
+void env_print(void)
+{
+    struct env_rec *rec;
+    int i;
+
+    for (i = 0; i < ENV_HASH_SIZE; i++) {
+        if (!env.index[i] || !env_rec_live(env.index[i]))
+            continue;
+        rec = env_rec(env.index[i]);
+        printk("%s=%s", rec->data, rec->data + strlen(rec->data) + 1);
+    }
+    printk("%d vars, %d/%d bytes%s", env.count, env.end, ENV_SECTOR_SIZE,
+           env.fresh || env.saved < env.end ? ", not saved" : "");
+}
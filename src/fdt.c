@@ -0,0 +1,251 @@
+/**
+ * @file fdt.c
+ * @brief minimal flattened device tree editor, enough to patch
+ *        properties of an existing node before handing off to linux
+ * @version 1.0
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+#include "bsp.h"
+#include "errno.h"
+
+#define FDT_MAGIC       0xd00dfeed
+#define FDT_BEGIN_NODE  0x1
+#define FDT_END_NODE    0x2
+#define FDT_PROP        0x3
+#define FDT_NOP         0x4
+#define FDT_END         0x9
+
+#define fdt32(x)        __builtin_bswap32(x)
+#define FDT_ALIGN(x)    (((x) + 3) & ~3)
+
+struct fdt_header {
+    uint32_t magic;
+    uint32_t totalsize;
+    uint32_t off_dt_struct;
+    uint32_t off_dt_strings;
+    uint32_t off_mem_rsvmap;
+    uint32_t version;
+    uint32_t last_comp_version;
+    uint32_t boot_cpuid_phys;
+    uint32_t size_dt_strings;
+    uint32_t size_dt_struct;
+};
+
+#define hdr(fdt, field)     fdt32(((struct fdt_header *)(fdt))->field)
+#define set_hdr(fdt, field, val) \
+    (((struct fdt_header *)(fdt))->field = fdt32(val))
+
+static inline uint32_t tag_at(const char *p)
+{
+    return fdt32(*(const uint32_t *)p);
+}
+
+/*
+ * jump over the token at `p`, return the next one
+ */
+static char *next_tag(char *p)
+{
+    switch (tag_at(p)) {
+    case FDT_BEGIN_NODE:
+        return p + 4 + FDT_ALIGN(strlen(p + 4) + 1);
+    case FDT_PROP:
+        return p + 12 + FDT_ALIGN(tag_at(p + 4));
+    default:
+        return p + 4;
+    }
+}
+
+/*
+ * "cpu" matches node "cpu@0", "cpu@0" matches only itself
+ */
+static int name_match(const char *node, const char *comp, int len)
+{
+    if (strncmp(node, comp, len))
+        return 0;
+    return node[len] == '\0' || (node[len] == '@' && !memchr(comp, '@', len));
+}
+
+/*
+ * find the BEGIN_NODE token of an absolute path like "/chosen"
+ */
+static char *find_node(void *fdt, const char *path)
+{
+    char *p = (char *)fdt + hdr(fdt, off_dt_struct);
+    const char *comp = path;
+    int depth = 0, matched = 0, len;
+
+    while (*comp == '/') comp++;
+
+    for (;; p = next_tag(p)) {
+        switch (tag_at(p)) {
+        case FDT_BEGIN_NODE:
+            depth++;
+            if (depth == 1) { // root
+                matched = 1;
+            } else if (depth == matched + 1) {
+                len = strcspn(comp, "/");
+                if (name_match(p + 4, comp, len)) {
+                    matched++;
+                    comp += len;
+                    while (*comp == '/') comp++;
+                }
+            }
+            if (depth == matched && *comp == '\0')
+                return p;
+            break;
+        case FDT_END_NODE:
+            if (depth == matched)
+                return NULL; // parent closed without finding child
+            depth--;
+            break;
+        case FDT_END:
+            return NULL;
+        }
+    }
+}
+
+/*
+ * locate property `name` directly under node token `node`
+ * return NULL but set *insert to the first non-property token
+ */
+static char *find_prop(void *fdt, char *node, const char *name, char **insert)
+{
+    const char *strings = (char *)fdt + hdr(fdt, off_dt_strings);
+    char *p = next_tag(node);
+
+    for (;; p = next_tag(p)) {
+        switch (tag_at(p)) {
+        case FDT_PROP:
+            if (!strcmp(strings + tag_at(p + 8), name))
+                return p;
+            /* fall through */
+        case FDT_NOP:
+            continue;
+        }
+        *insert = p;
+        return NULL;
+    }
+}
+
+/*
+ * resize the region [p, p + oldlen) inside the struct block to newlen,
+ * moving the tail of struct and the whole strings block along
+ */
+static int fdt_splice(void *fdt, char *p, int oldlen, int newlen)
+{
+    char *end = (char *)fdt + hdr(fdt, off_dt_strings) + hdr(fdt, size_dt_strings);
+    int delta = newlen - oldlen;
+
+    if (end + delta > (char *)fdt + hdr(fdt, totalsize))
+        return -ENOSPC;
+
+    memmove(p + newlen, p + oldlen, end - (p + oldlen));
+    set_hdr(fdt, size_dt_struct, hdr(fdt, size_dt_struct) + delta);
+    set_hdr(fdt, off_dt_strings, hdr(fdt, off_dt_strings) + delta);
+    return 0;
+}
+
+/*
+ * return offset of `name` in the strings block, append it if missing
+ */
+static int fdt_string(void *fdt, const char *name)
+{
+    char *strings = (char *)fdt + hdr(fdt, off_dt_strings);
+    int size = hdr(fdt, size_dt_strings);
+    int len = strlen(name) + 1;
+    int i;
+
+    for (i = 0; i < size; i += strlen(strings + i) + 1)
+        if (!strcmp(strings + i, name))
+            return i;
+
+    if (strings + size + len > (char *)fdt + hdr(fdt, totalsize))
+        return -ENOSPC;
+
+    memcpy(strings + size, name, len);
+    set_hdr(fdt, size_dt_strings, size + len);
+    return size;
+}
+
+/**
+ * copy the blob at `src` into `dst` and grow it to `bufsize`,
+ * the extra room is used by fdt_setprop
+ */
+int fdt_relocate(void *dst, const void *src, int bufsize)
+{
+    int size;
+
+    if (hdr(src, magic) != FDT_MAGIC)
+        return -EINVAL;
+
+    size = hdr(src, totalsize);
+    if (size > bufsize)
+        return -ENOSPC;
+    // strings block must be the last one for fdt_splice
+    if (hdr(src, off_dt_strings) < hdr(src, off_dt_struct))
+        return -EINVAL;
+
+    memmove(dst, src, size);
+    set_hdr(dst, totalsize, bufsize);
+    return 0;
+}
+
+const void *fdt_getprop(void *fdt, const char *path, const char *name, int *len)
+{
+    char *node, *prop, *insert;
+
+    node = find_node(fdt, path);
+    if (!node)
+        return NULL;
+    prop = find_prop(fdt, node, name, &insert);
+    if (!prop)
+        return NULL;
+    if (len)
+        *len = tag_at(prop + 4);
+    return prop + 12;
+}
+
+/**
+ * create or replace property `name` of node `path`
+ */
+int fdt_setprop(void *fdt, const char *path, const char *name,
+                const void *val, int len)
+{
+    char *node, *prop, *insert;
+    int nameoff, ret;
+
+    node = find_node(fdt, path);
+    if (!node)
+        return -ENOENT;
+
+    prop = find_prop(fdt, node, name, &insert);
+    if (prop) {
+        ret = fdt_splice(fdt, prop + 12, FDT_ALIGN(tag_at(prop + 4)), FDT_ALIGN(len));
+        if (ret)
+            return ret;
+    } else {
+        // string goes first: it lives behind the struct block
+        nameoff = fdt_string(fdt, name);
+        if (nameoff < 0)
+            return nameoff;
+        ret = fdt_splice(fdt, insert, 0, 12 + FDT_ALIGN(len));
+        if (ret)
+            return ret;
+        prop = insert;
+        *(uint32_t *)prop = fdt32(FDT_PROP);
+        *(uint32_t *)(prop + 8) = fdt32(nameoff);
+    }
+
+    *(uint32_t *)(prop + 4) = fdt32(len);
+    memset(prop + 12, 0, FDT_ALIGN(len));
+    memcpy(prop + 12, val, len);
+    return 0;
+}
+
+int fdt_setprop_u32(void *fdt, const char *path, const char *name, unsigned int val)
+{
+    val = fdt32(val);
+    return fdt_setprop(fdt, path, name, &val, sizeof(val));
+}
@@ -1,21 +1,26 @@
 #ifndef BSP_EASYCONFIG_H
 #define BSP_EASYCONFIG_H
 
+#include <stdarg.h>
+
 #define STBOOT_VERSION         "2.5.3 (stable)"
 
 #define HSE_FREQUENCY          25
 
 /*
- * CPU frequency
+ * CPU frequency at boot, `clk <MHz>` switches at runtime (cpufreq)
  */
 #define SYSCLK_PLL_N           192
 #define SYSCLK_PLL_M           5
 #define SYSCLK_PLL_P           2
+#define SYSCLK_FREQ            (HSE_FREQUENCY * SYSCLK_PLL_N / SYSCLK_PLL_M / SYSCLK_PLL_P)
 
 /*
- * early print buffer config
+ * printk log ring, the top 16KB of AXI-SRAM, keep in sync with linker.ld
+ * and the ramoops node in the dts
  */
-#define EPB_BUF_SIZE           512
+#define LOG_BUF_ADDR            0x2407C000
+#define LOG_BUF_SIZE            0x4000
 
 /*
  * hardware configs
@@ -24,36 +29,112 @@
 // USE_SRAM_D3 is not set
 #define SDRAM_BASE_ADDR         0xC0000000
 #define SDRAM_SIZE_MB           32
+#define CONFIG_SDRAM_POST       // quick sdramtest at cold boot, < 1s
+// SDRAM timing is built in or what `sdramtune` found (sdramtiming)
+
+/*
+ * kernel clocks of FMC, QSPI and SDMMC (clkprofile), see clock.c
+ * "legacy": on HCLK / PLL1Q like the core, "balanced": PLL2R 200MHz,
+ * "fast": PLL2R 265MHz, above its rating, only with `clkprofile fast force`,
+ * `clkprofile bench` checks the running one
+ */
+#define CONFIG_CLK_PROFILE      "legacy"
 #define FLASH_BASE_ADDR         0x08000000
 #define QSPI_FLASH_BASE_ADDR    0x90000000
 #define QSPI_FLASH_SIZE_MB      8
+#define QSPI_FLASH_MAX_HZ       133000000  // W25Q64JV fast read
 
 /*
  * FDT address:     0x9000_0000 - 0x9001_0000 : 64KB, start of qspi-flash
  * Kernel address:  0x9001_0000 -
  */
-#define FDT_ADDR                QSPI_FLASH_BASE_ADDR
+#define FDT_ADDR                QSPI_FLASH_BASE_ADDR  // (fdtaddr)
 #define FDT_SIZE                0x10000
-#define KERNEL_ADDR            (QSPI_FLASH_BASE_ADDR + FDT_SIZE)
+#define KERNEL_ADDR            (QSPI_FLASH_BASE_ADDR + FDT_SIZE)  // (kerneladdr)
+
+/*
+ * initramfs loaded from sdcard, linux reserves both regions itself
+ *
+ * initrd address:  0xC100_0000 - 0xC1E0_0000 : 14MB max
+ * FDT copy:        0xC1E0_0000 - 0xC1E1_0000 : patched with initrd range
+ *
+ * boot with initrd by default: #define INITRD_FILE "0:rootfs.cpio.gz"
+ */
+// INITRD_FILE is not set
+#define INITRD_ADDR            (SDRAM_BASE_ADDR + 0x01000000)
+#define INITRD_MAX_SIZE         0x00E00000
+#define FDT_RAM_ADDR           (INITRD_ADDR + INITRD_MAX_SIZE)
+#define FDT_RAM_SIZE            FDT_SIZE
+
+/*
+ * environment: the last two sectors of qspi-flash, `env set` / `env save`
+ * the defaults below are overridden by env variables in (brackets)
+ */
+#define ENV_SECTOR_SIZE         0x1000
+#define ENV_ADDR               (QSPI_FLASH_SIZE_MB * 0x100000 - 2 * ENV_SECTOR_SIZE)
+
+/*
+ * `qspitune` reads a known pattern in the sector below the env,
+ * qspi clock and sampling point are built in or what it found (qspitiming)
+ */
+#define QSPI_TUNE_ADDR         (ENV_ADDR - 0x1000)
 
+/*
+ * console default baud (baudrate), `baud <rate>` changes it at runtime,
+ * `baud save` keeps it in the env
+ */
 #define UART_Baudrate           115200
+// CONSOLE_XONXOFF is not set, without it an rx overrun drops the unread input with a warning
 #define CONSOLE_CMD
-#define LED_BLINK_TIME          82
+#define LED_BLINK_TIME          82  // (blinktime)
+
+/*
+ * autoboot: (bootcmd) runs after (bootdelay) seconds unless a key
+ * is hit, commands chain with ; && ||, a negative delay waits in the shell
+ */
+#define CONFIG_BOOTDELAY        3
+#define CONFIG_BOOTCMD          "boot"
 
 
 
 
 #define __itcm      __attribute__((section(".itcm")))
+#define __noinit    __attribute__((section(".noinit")))
+#define __dma_buf   __attribute__((section(".dma_buf")))     // AXI, zeroed
+#define __d2_buf    __attribute__((section(".d2_buf")))      // SRAM1-3, zeroed, DMA1/2 and MDMA, not SDMMC1
+#define __dtcm_data __attribute__((section(".dtcm_data")))   // DTCM, initialized
+#define __sdram_bss __attribute__((section(".sdram_bss")))   // SDRAM, zeroed after sdram_init
 #define noinline    __attribute__((noinline))
 #define likely(x)   __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
+#define ARRAY_SIZE(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+// DWT->CYCCNT, running after cycle_counter_init()
+#define get_cycles() (*(volatile unsigned int *)0xe0001004)
 
 void sysclk_config(void);
 void mpu_config(void);
+void mpu_env_load(void);
 void sdram_init(void);
+void sdram_self_refresh(void);
+void sdram_bss_init(void);
+int  sdram_fallback(void);
+int  sdram_clock(void);
+void sdram_refresh(int);
+int  sdram_bandwidth(void *);
+int  sdram_test(int);
+int  sdram_stress(unsigned int, int);
 void memory_speed_test(void);
+void memory_stream_test(void);
+void memory_latency_test(int);
+void printk_speed_test(void);
+void cycle_counter_init(void);
 void sdmmc_mount(void);
 int  sdmmc_read_file(const char *, unsigned char **, int *);
+int  sdmmc_load_file(const char *, void *, int, int *);
+int  sdmmc_read_speed(void *, int);
+int  sdmmc_file_stamp(const char *, int *, unsigned int *);
+int  sdmmc_save_file(const char *, const void *, int);
 
 void led_init(void);
 void led_timer_handler(void);
@@ -64,14 +145,95 @@ void led_timer_handler(void);
 #define KERN_INFO    "<6>"    /* info      */
 #define KERN_DEBUG   "<7>"    /* debug     */
 
+/*
+ * printk above this level is compiled out, 6 drops KERN_DEBUG
+ * CONFIG_PRINTK_BINARY: store records instead of text, see printk.h,
+ * a record takes 8 arguments, longer messages (up to 16) stay text
+ */
+#define CONFIG_LOGLEVEL         7
+// CONFIG_PRINTK_BINARY is not set
+#include "printk.h"
+
 void Error_Handler(char *, int);
 void console_init(void);
+void console_enable(int);
+int  console_get_baud(void);
+int  console_set_baud(int);
+int  console_baud_save(void);
+void console_baud_load(void);
+void console_flush(void);
+void console_shutdown(void);
+void console_irq_handler(void);
+void console_tx_dma_irq_handler(void);
+void console_rx_dma_irq_handler(void);
+int  console_tstc(void);
+int  console_getc(int);
+int  console_ctrlc(void);
 void error_print(void);
-void printk(const char *, ...);
+int  scnprintf(char *, int, const char *, ...);
+int  vscnprintf(char *, int, const char *, va_list);
+int  _write(int, char *, int);
+
+void log_init(void);
+void log_time(unsigned int *, unsigned int *);
+void log_write(const char *, int);
+int  log_offset(void);
+void log_replay(int);
+void log_dump(void);
+void log_clear(void);
 void console_cmd(void);
+void autoboot(void);
+int  run_command(const char *);
+int  run_command_list(const char *, int);
+const char *script_getvar(const char *, int);
 
 
 void kernel_entry(int, int);
+int  boot_load_initrd(const char *, int);
+
+int  fdt_relocate(void *, const void *, int);
+const void *fdt_getprop(void *, const char *, const char *, int *);
+int  fdt_setprop(void *, const char *, const char *, const void *, int);
+int  fdt_setprop_u32(void *, const char *, const char *, unsigned int);
+
+unsigned int crc32(unsigned int, const void *, int);
+
+int  mem_copy(void *, const void *, int);
+int  mem_fill(void *, unsigned int, int, int);
+int  mem_cmp(const void *, const void *, int, int);
+unsigned int mem_crc32(const void *, int);
+int  mem_room(unsigned int);
+
+// arena_alloc regions, ARENA_DMA: axi, else sdram
+enum { ARENA_DTCM, ARENA_AXI, ARENA_D2, ARENA_D3, ARENA_SDRAM, ARENA_DMA };
+void arena_init(void);
+void *arena_alloc(int, int, const char *);
+void arena_free(void *);
+int  arena_reserve(const char *, unsigned int, int);
+void arena_release(const char *);
+int  arena_room(unsigned int);
+const char *arena_owner(unsigned int, int);
+
+void env_init(void);
+const char *env_get(const char *);
+int  env_get_int(const char *, int);
+int  env_set(const char *, const char *);
+int  env_save(void);
+void env_print(void);
+void qspi_timing_init(void);
+int  qspi_read_speed(void);
+
+void clk_profile_init(void);
+int  clk_fmc_freq(void);
+int  clk_qspi_freq(void);
+int  clk_sdmmc_freq(void);
+int  clk_sdmmc_div(void);
+
+void warmboot_init(void);
+int  warmboot_active(void);
+int  warmboot_lookup(const char *, int, int *);
+void warmboot_record(const char *, int, int);
+void warmboot_reset(void);
 
 
 #endif
@@ -3,21 +3,30 @@
 
 
 struct cmd {
-    char *name;
+    const char *name;
     void (*help)(void);
     int (*exec)(const char *buf);
-    struct cmd *next;
 };
 
-// export command
+/*
+ * export command, one section per command: the linker sorts them
+ * by name into a const table in flash, see linker.ld
+ */
 #define SHELL_EXPORT_CMD(cmd_name, help_func, exec_func) \
-    __attribute__((used, section(".shell_cmd"))) \
-    static struct cmd __cmd_##cmd_name = { \
+    __attribute__((used, section(".shell_cmd." #cmd_name))) \
+    static const struct cmd __cmd_##cmd_name = { \
         .name = #cmd_name, \
         .help = help_func, \
         .exec = exec_func \
     }
 
+extern const struct cmd _shell_cmd_start[], _shell_cmd_end[];
+
+#define for_each_cmd(c) \
+    for (c = _shell_cmd_start; c < _shell_cmd_end; c++)
+
+const struct cmd *find_cmd(const char *name, int len);
+
 // command help printsh
 #define printsh(fmt) printf("        %s\r\n",fmt)
 
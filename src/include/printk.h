@@ -0,0 +1,116 @@
+#ifndef STBOOT_PRINTK_H
+#define STBOOT_PRINTK_H
+
+/*
+ * printk is a macro so that:
+ *   - messages above CONFIG_LOGLEVEL are compiled out, the level
+ *     prefix of a literal format folds to a constant
+ *   - with CONFIG_PRINTK_BINARY, leveled messages store only a
+ *     record into the log ring, the format string itself goes to
+ *     the non-loaded .logstr section, tools/logdecode.py prints it
+ *
+ * messages without a level are command output, always text
+ *
+ * binary record, little endian, 4-byte aligned:
+ *   u32  0xB << 28 | nargs << 24 | string arg mask << 16 | offset of fmt in .logstr
+ *   u32  timestamp, us
+ *   args u32 each, char * inline with '\0', padded to 4
+ */
+#define __printk_level(fmt)  ((fmt)[0] == '<' ? (fmt)[1] - '0' : 0)
+
+void _printk(const char *, ...);
+
+#ifndef CONFIG_PRINTK_BINARY
+
+#define printk(fmt, ...) do {                                   \
+        if (__printk_level(fmt) <= CONFIG_LOGLEVEL)             \
+            _printk(fmt, ##__VA_ARGS__);                        \
+    } while (0)
+
+#else
+
+#define LOG_REC_MAGIC   0xB
+#define LOG_REC_MAX     128
+
+struct log_rec {
+    char *p, *end;
+};
+
+void log_rec_begin(struct log_rec *, char *, const char *, int, int);
+void log_rec_u32(struct log_rec *, unsigned int);
+void log_rec_str(struct log_rec *, unsigned int);
+void log_rec_end(struct log_rec *, char *);
+
+#define __NARG(...)  __NARG_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define __NARG_(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define __CAT(a, b)  __CAT_(a, b)
+#define __CAT_(a, b) a##b
+
+#define __LOG_ARG(r, x) _Generic((x),                           \
+        char *: log_rec_str, const char *: log_rec_str,         \
+        default: log_rec_u32)(r, (unsigned int)(x))
+
+#define __IS_STR(x) _Generic((x), char *: 1, const char *: 1, default: 0)
+
+#define __STRMASK_0(i)
+#define __STRMASK_1(i, a)      | __IS_STR(a) << (i)
+#define __STRMASK_2(i, a, ...) | __IS_STR(a) << (i) __STRMASK_1(i + 1, __VA_ARGS__)
+#define __STRMASK_3(i, a, ...) | __IS_STR(a) << (i) __STRMASK_2(i + 1, __VA_ARGS__)
+#define __STRMASK_4(i, a, ...) | __IS_STR(a) << (i) __STRMASK_3(i + 1, __VA_ARGS__)
+#define __STRMASK_5(i, a, ...) | __IS_STR(a) << (i) __STRMASK_4(i + 1, __VA_ARGS__)
+#define __STRMASK_6(i, a, ...) | __IS_STR(a) << (i) __STRMASK_5(i + 1, __VA_ARGS__)
+#define __STRMASK_7(i, a, ...) | __IS_STR(a) << (i) __STRMASK_6(i + 1, __VA_ARGS__)
+#define __STRMASK_8(i, a, ...) | __IS_STR(a) << (i) __STRMASK_7(i + 1, __VA_ARGS__)
+#define __STRMASK(...) \
+        (0 __CAT(__STRMASK_, __NARG(__VA_ARGS__))(0, ##__VA_ARGS__))
+
+#define __LOG_ARGS_0(r)
+#define __LOG_ARGS_1(r, a)      __LOG_ARG(r, a)
+#define __LOG_ARGS_2(r, a, ...) __LOG_ARG(r, a); __LOG_ARGS_1(r, __VA_ARGS__)
+#define __LOG_ARGS_3(r, a, ...) __LOG_ARG(r, a); __LOG_ARGS_2(r, __VA_ARGS__)
+#define __LOG_ARGS_4(r, a, ...) __LOG_ARG(r, a); __LOG_ARGS_3(r, __VA_ARGS__)
+#define __LOG_ARGS_5(r, a, ...) __LOG_ARG(r, a); __LOG_ARGS_4(r, __VA_ARGS__)
+#define __LOG_ARGS_6(r, a, ...) __LOG_ARG(r, a); __LOG_ARGS_5(r, __VA_ARGS__)
+#define __LOG_ARGS_7(r, a, ...) __LOG_ARG(r, a); __LOG_ARGS_6(r, __VA_ARGS__)
+#define __LOG_ARGS_8(r, a, ...) __LOG_ARG(r, a); __LOG_ARGS_7(r, __VA_ARGS__)
+#define __LOG_ARGS(r, ...) \
+        __CAT(__LOG_ARGS_, __NARG(__VA_ARGS__))(r, ##__VA_ARGS__)
+
+/*
+ * a record holds 8 arguments, a message with 9 to 16 is kept as text
+ * even with a level, more than 16 doesn't compile
+ */
+#define __PRINTK_MODE(...) __PRINTK_MODE_(0, ##__VA_ARGS__,    \
+        text, text, text, text, text, text, text, text,         \
+        bin, bin, bin, bin, bin, bin, bin, bin, bin)
+#define __PRINTK_MODE_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9,  \
+        _10, _11, _12, _13, _14, _15, _16, m, ...) m
+
+#define printk(fmt, ...) \
+        __CAT(__printk_, __PRINTK_MODE(__VA_ARGS__))(fmt, ##__VA_ARGS__)
+
+#define __printk_text(fmt, ...) do {                            \
+        if (__printk_level(fmt) <= CONFIG_LOGLEVEL)             \
+            _printk(fmt, ##__VA_ARGS__);                        \
+    } while (0)
+
+#define __printk_bin(fmt, ...) do {                             \
+        if (__printk_level(fmt) > CONFIG_LOGLEVEL)              \
+            break;                                              \
+        if (!__printk_level(fmt)) {                             \
+            _printk(fmt, ##__VA_ARGS__);                        \
+        } else {                                                \
+            static const char __fmt[]                           \
+                __attribute__((section(".logstr"))) = fmt;      \
+            struct log_rec __r;                                 \
+            char __buf[LOG_REC_MAX] __attribute__((aligned(4))); \
+            log_rec_begin(&__r, __buf, __fmt, __NARG(__VA_ARGS__), \
+                          __STRMASK(__VA_ARGS__));              \
+            __LOG_ARGS(&__r, ##__VA_ARGS__);                    \
+            log_rec_end(&__r, __buf);                           \
+        }                                                       \
+    } while (0)
+
+#endif /* CONFIG_PRINTK_BINARY */
+
+#endif
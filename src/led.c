@@ -1,7 +1,7 @@
 /**
  * @file led.c
  * @author Honbo (hehongbo918@gmail.com)
- * @brief LED_BLINK_TIME: led blink period when stboot start
+ * @brief LED_BLINK_TIME: led blink period when stboot start, env "blinktime"
  * @version 1.0
  * 
  * @copyright Copyright (c) 2024
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include "bsp.h"
 
+static int blink_time = LED_BLINK_TIME;
 
 void led_init(void)
 {
@@ -24,6 +25,7 @@ void led_init(void)
     gpio.Speed = GPIO_SPEED_FREQ_LOW;
     HAL_GPIO_Init(GPIOC, &gpio);
     HAL_GPIO_WritePin(GPIOC, GPIO_PIN_13, 0);
+    blink_time = env_get_int("blinktime", LED_BLINK_TIME);
 
     printk(KERN_INFO "led: gpioc-13 as triggered led");
 }
@@ -32,7 +34,7 @@ void led_timer_handler(void)
 {
     static int stick;
 
-    if (HAL_GetTick() - stick > LED_BLINK_TIME) {
+    if (HAL_GetTick() - stick > blink_time) {
         HAL_GPIO_TogglePin(GPIOC, GPIO_PIN_13);
         stick = HAL_GetTick();
     }
@@ -37,6 +37,12 @@
 
 QSPI_HandleTypeDef hqspi;	// 定义QSPI句柄，这里保留使用cubeMX生成的变量命名，方便用户参考和移植
 
+/* 时序参数，默认值对所有板子都可用，qspitune 按板子调出更快的 */
+static uint32_t qspi_prescaler    = 1;					// 时钟分频值
+static uint32_t qspi_sample_shift = QSPI_SAMPLE_SHIFTING_HALFCYCLE;	// 采样移位
+static uint32_t qspi_dlyb_phase   = 0;					// 延迟块相位，0为关闭
+static uint32_t qspi_dlyb_unit    = 0;					// 延迟块单元延时
+
 /*************************************************************************************************
 *	函 数 名: HAL_QSPI_MspInit
 *	入口参数: hqspi - QSPI_HandleTypeDef定义的变量，即表示定义的QSPI句柄
@@ -127,9 +133,9 @@ void MX_QUADSPI_Init(void)
 	/*本例程选择 HCLK 作为QSPI的内核时钟，速度为240M，再经过2分频得到120M驱动时钟，
 	  关于 QSPI内核时钟 的设置，请参考 main.c文件里的 sysclk_config 函数*/
 	// 需要注意的是，当使用内存映射模式时，这里的分频系数不能设置为0！！否则会读取错误
-	hqspi.Init.ClockPrescaler 	= 1;					// 时钟分频值，将QSPI内核时钟进行 1+1 分频得到QSPI通信驱动时钟
+	hqspi.Init.ClockPrescaler 	= qspi_prescaler;			// 时钟分频值，默认将QSPI内核时钟进行 1+1 分频得到QSPI通信驱动时钟
 	hqspi.Init.FifoThreshold 	= 32;					// FIFO阈值
-	hqspi.Init.SampleShifting	= QSPI_SAMPLE_SHIFTING_HALFCYCLE;	// 半个CLK周期之后进行采样
+	hqspi.Init.SampleShifting	= qspi_sample_shift;			// 默认半个CLK周期之后进行采样
 	hqspi.Init.FlashSize 		= 22;					// flash大小，FLASH 中的字节数 = 2^[FSIZE+1]，核心板采用是8M字节的W25Q64，这里设置为22
 	hqspi.Init.ChipSelectHighTime   = QSPI_CS_HIGH_TIME_1_CYCLE;		// 片选保持高电平的时间
 	hqspi.Init.ClockMode 		= QSPI_CLOCK_MODE_3;			// 模式3
@@ -137,6 +143,29 @@ void MX_QUADSPI_Init(void)
 	hqspi.Init.DualFlash 		= QSPI_DUALFLASH_DISABLE;		// 禁止双闪存模式
 
 	HAL_QSPI_Init(&hqspi); // 初始化配置
+
+	// 延迟块再推迟采样时钟，相位 x 单元延时
+	if (qspi_dlyb_phase)
+		DelayBlock_Configure(DLYB_QUADSPI, qspi_dlyb_phase, qspi_dlyb_unit);
+	else
+		DelayBlock_Disable(DLYB_QUADSPI);
+}
+
+/*************************************************************************************************
+*	函 数 名: QSPI_W25Qxx_SetTiming
+*	入口参数: Prescaler - 时钟分频值，Shift - QSPI_SAMPLE_SHIFTING_xxx，
+*	          Phase - 延迟块相位 0~11，0为关闭，Unit - 延迟块单元延时 0~127
+*	返 回 值: 无
+*	函数功能: 设置时序参数
+*	说    明: 下一次 QSPI_W25Qxx_Init 时生效
+*************************************************************************************************/
+
+void QSPI_W25Qxx_SetTiming(uint32_t Prescaler, uint32_t Shift, uint32_t Phase, uint32_t Unit)
+{
+	qspi_prescaler    = Prescaler;
+	qspi_sample_shift = Shift;
+	qspi_dlyb_phase   = Phase;
+	qspi_dlyb_unit    = Unit;
 }
  
 /*************************************************************************************************
@@ -75,6 +75,7 @@ int8_t	QSPI_W25Qxx_Init(void);			 // W25Qxx初始化
 int8_t 	QSPI_W25Qxx_Reset(void);		 // 复位器件
 uint32_t QSPI_W25Qxx_ReadID(void);		 // 读取器件ID
 int8_t 	QSPI_W25Qxx_MMMode(void);	 // 进入内存映射模式
+void	QSPI_W25Qxx_SetTiming(uint32_t Prescaler, uint32_t Shift, uint32_t Phase, uint32_t Unit); // 设置时钟分频、采样移位和延迟块，下次初始化生效
 
 int8_t 	QSPI_W25Qxx_SectorErase(uint32_t SectorAddress);	// 扇区擦除，4K字节， 参考擦除时间 45ms
 int8_t 	QSPI_W25Qxx_BlockErase_32K (uint32_t SectorAddress);	// 块擦除，  32K字节，参考擦除时间 120ms
@@ -62,6 +62,7 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "sdmmc_sd.h"
+#include "bsp.h"
 
 
 /** @addtogroup BSP
@@ -331,6 +332,13 @@ __weak HAL_StatusTypeDef MX_SDMMC1_SD_Init(SD_HandleTypeDef *hsd)
   {
     ret = HAL_ERROR;
   }
+  /* clock profile above 25MHz: high speed mode first, then the divider */
+  else if((uint32_t)clk_sdmmc_div() < hsd->Init.ClockDiv &&
+          HAL_SD_ConfigSpeedBusOperation(hsd, SDMMC_SPEED_MODE_HIGH) == HAL_OK)
+  {
+    hsd->Init.ClockDiv = clk_sdmmc_div();
+    MODIFY_REG(hsd->Instance->CLKCR, SDMMC_CLKCR_CLKDIV, hsd->Init.ClockDiv);
+  }
 
   return ret;
 }
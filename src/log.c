@@ -0,0 +1,204 @@
+/**
+ * @file log.c
+ * @brief printk log ring, laid out as a linux pstore/ramoops zone
+ * @version 1.0
+ *
+ * the ring sits in a NOLOAD section at LOG_BUF_ADDR, reserved in the
+ * device tree as a ramoops region with all its space given to the
+ * console zone. linux picks it up as /sys/fs/pstore/console-ramoops-0,
+ * it also survives soft resets, so `dmesg` shows the last linux log too.
+ *
+ * writers reserve space with a cas on `start`, so printk may run from
+ * interrupts, oldest data is overwritten.
+ */
+#include <stm32h7xx_hal.h>
+#include <stdio.h>
+#include <string.h>
+#include "bsp.h"
+
+#define RAMOOPS_SIG     0x43474244  // "DBGC"
+#define LOG_DATA_SIZE   ((int)(LOG_BUF_SIZE - sizeof(struct ramoops_buf)))
+
+/* struct persistent_ram_buffer in linux fs/pstore/ram_core.c */
+struct ramoops_buf {
+    unsigned int sig;
+    int start;  // next write offset
+    int size;   // valid bytes
+    char data[];
+};
+
+static char log_mem[LOG_BUF_SIZE] __attribute__((section(".log_buf"), aligned(8)));
+static struct ramoops_buf *const rb = (struct ramoops_buf *)log_mem;
+
+// where this boot's messages start, for the console replay
+static int boot_start;
+
+void log_init(void)
+{
+    if (rb->sig != RAMOOPS_SIG || rb->start < 0 || rb->start >= LOG_DATA_SIZE ||
+        rb->size < 0 || rb->size > LOG_DATA_SIZE) {
+        rb->sig = RAMOOPS_SIG;
+        rb->start = 0;
+        rb->size = 0;
+    }
+    boot_start = rb->start;
+}
+
+/*
+ * append, lock-free
+ */
+void log_write(const char *buf, int len)
+{
+    int old, new, size, nsize, n;
+
+    if (len > LOG_DATA_SIZE) {
+        buf += len - LOG_DATA_SIZE;
+        len = LOG_DATA_SIZE;
+    }
+
+    old = __atomic_load_n(&rb->start, __ATOMIC_RELAXED);
+    do {
+        new = (old + len) % LOG_DATA_SIZE;
+    } while (!__atomic_compare_exchange_n(&rb->start, &old, new, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    size = __atomic_load_n(&rb->size, __ATOMIC_RELAXED);
+    do {
+        nsize = size + len;
+        if (nsize > LOG_DATA_SIZE)
+            nsize = LOG_DATA_SIZE;
+    } while (!__atomic_compare_exchange_n(&rb->size, &size, nsize, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    n = LOG_DATA_SIZE - old;
+    if (n > len)
+        n = len;
+    memcpy(&rb->data[old], buf, n);
+    memcpy(rb->data, buf + n, len - n);
+}
+
+/*
+ * `size` bytes ending at offset `end`, '\n' -> "\r\n"
+ */
+static void log_print(int end, int size)
+{
+    int pos = (end - size + LOG_DATA_SIZE) % LOG_DATA_SIZE;
+    int i, n;
+    char *p;
+
+    while (size) {
+        p = &rb->data[pos];
+        n = LOG_DATA_SIZE - pos;
+        if (n > size)
+            n = size;
+        for (i = 0; i < n && p[i] != '\n'; i++)
+            ;
+        _write(1, p, i);
+        if (i < n) {
+            _write(1, "\r\n", 2);
+            i++;
+        }
+        size -= i;
+        pos = (pos + i) % LOG_DATA_SIZE;
+    }
+}
+
+int log_offset(void)
+{
+    return rb->start;
+}
+
+/**
+ * print this boot's messages up to offset `end`,
+ * used once the console is up
+ */
+void log_replay(int end)
+{
+    log_print(end, (end - boot_start + LOG_DATA_SIZE) % LOG_DATA_SIZE);
+}
+
+/*
+ * [sec.usec] from the 1ms tick plus the systick fraction, no float
+ */
+void log_time(unsigned int *sec, unsigned int *usec)
+{
+    unsigned int load, val, ms;
+
+    load = SysTick->LOAD;
+    val  = SysTick->VAL;
+    ms   = HAL_GetTick();
+
+    *sec  = ms / 1000;
+    *usec = ms % 1000 * 1000 + (load - val) * 1000 / (load + 1);
+}
+
+#ifndef CONFIG_PRINTK_BINARY
+void log_dump(void)
+{
+    log_print(rb->start, rb->size);
+}
+#else
+/*
+ * records can't be printed here, the formats aren't loaded,
+ * hex dump oldest first for tools/logdecode.py
+ */
+void log_dump(void)
+{
+    int pos = (rb->start - rb->size + LOG_DATA_SIZE) % LOG_DATA_SIZE;
+    int i;
+
+    for (i = 0; i < rb->size; i++) {
+        printf("%02x", rb->data[pos] & 0xff);
+        if (i % 32 == 31 || i == rb->size - 1)
+            printf("\r\n");
+        pos = (pos + 1) % LOG_DATA_SIZE;
+    }
+}
+
+void log_rec_begin(struct log_rec *r, char *buf, const char *fmt, int nargs, int strmask)
+{
+    unsigned int sec, usec;
+    unsigned int *w = (unsigned int *)buf;
+
+    log_time(&sec, &usec);
+    w[0] = (unsigned int)LOG_REC_MAGIC << 28 | nargs << 24 | strmask << 16 |
+           ((unsigned int)fmt & 0xffff);
+    w[1] = sec * 1000000 + usec;
+    r->p = buf + 8;
+    r->end = buf + LOG_REC_MAX;
+}
+
+void log_rec_u32(struct log_rec *r, unsigned int val)
+{
+    if (r->p + 4 > r->end)
+        return;
+    memcpy(r->p, &val, 4);
+    r->p += 4;
+}
+
+void log_rec_str(struct log_rec *r, unsigned int val)
+{
+    const char *s = (const char *)val;
+    int len = s ? strlen(s) : 0;
+
+    // keep room for '\0' and the padding
+    if (len > r->end - r->p - 4)
+        len = r->end - r->p - 4;
+    if (len < 0)
+        return;
+    memcpy(r->p, s, len);
+    memset(r->p + len, 0, 4 - (len & 3));
+    r->p += (len + 4) & ~3;
+}
+
+void log_rec_end(struct log_rec *r, char *buf)
+{
+    log_write(buf, r->p - buf);
+}
+#endif
+
+void log_clear(void)
+{
+    rb->start = 0;
+    rb->size = 0;
+}
@@ -0,0 +1,290 @@
+/**
+ * @file memops.c
+ * @brief bulk memory operations for the shell, on the dma engines
+ * @version 1.0
+ *
+ * copy:  MDMA, memory to memory, any address incl. the TCMs
+ * fill:  DMA2D register-to-memory, the 32-bit pattern is written as
+ *        ARGB8888 pixels, unaligned ends and TCM go through the cpu
+ * crc32: MDMA feeds the CRC unit, same result as crc32()
+ * cmp:   cpu, no engine compares
+ *
+ * all are polled, dcache lines of the range are cleaned before and
+ * invalidated after, a range larger than the dcache does it whole
+ */
+#include <stm32h7xx_hal.h>
+#include <string.h>
+#include "bsp.h"
+#include "errno.h"
+
+#define DCACHE_SIZE         0x4000
+#define MDMA_BLOCK_MAX      0x10000     // bytes per block, BNDT
+#define MDMA_BLOCK_COUNT    4096        // blocks per request, BRC + 1
+#define DMA2D_PL_MAX        0x3fff      // pixels per line
+#define DMA2D_LINE          4096        // pixels per line for long fills
+#define DMA2D_MIN_ADDR      0x24000000  // no access to the TCMs
+#define MEMOPS_TIMEOUT      10000       // ms
+
+static MDMA_HandleTypeDef hmdma;
+
+static void dcache_flush(const void *addr, int len)
+{
+    int head = (int)addr & 31;
+
+    if (len > DCACHE_SIZE)
+        SCB_CleanInvalidateDCache();
+    else
+        SCB_CleanInvalidateDCache_by_Addr((uint32_t *)((int)addr - head), len + head);
+}
+
+/*
+ * one MDMA run of `count` blocks of `block` bytes, `dst_inc` 0 for a register
+ */
+static int mdma_run(int dst, int src, int block, int count, int size, int dst_inc)
+{
+    static const unsigned int src_size[] = {
+        MDMA_SRC_DATASIZE_BYTE, MDMA_SRC_DATASIZE_HALFWORD, 0, MDMA_SRC_DATASIZE_WORD };
+    static const unsigned int dst_size[] = {
+        MDMA_DEST_DATASIZE_BYTE, MDMA_DEST_DATASIZE_HALFWORD, 0, MDMA_DEST_DATASIZE_WORD };
+    static const unsigned int src_inc[] = {
+        MDMA_SRC_INC_BYTE, MDMA_SRC_INC_HALFWORD, 0, MDMA_SRC_INC_WORD };
+    static const unsigned int dst_inc_tab[] = {
+        MDMA_DEST_INC_BYTE, MDMA_DEST_INC_HALFWORD, 0, MDMA_DEST_INC_WORD };
+
+    __HAL_RCC_MDMA_CLK_ENABLE();
+
+    hmdma.Instance = MDMA_Channel0;
+    hmdma.Init.Request = MDMA_REQUEST_SW;
+    hmdma.Init.TransferTriggerMode = MDMA_REPEAT_BLOCK_TRANSFER;
+    hmdma.Init.Priority = MDMA_PRIORITY_VERY_HIGH;
+    hmdma.Init.Endianness = MDMA_LITTLE_ENDIANNESS_PRESERVE;
+    hmdma.Init.SourceInc = src_inc[size - 1];
+    hmdma.Init.DestinationInc = dst_inc ? dst_inc_tab[size - 1] : MDMA_DEST_INC_DISABLE;
+    hmdma.Init.SourceDataSize = src_size[size - 1];
+    hmdma.Init.DestDataSize = dst_size[size - 1];
+    hmdma.Init.DataAlignment = MDMA_DATAALIGN_PACKENABLE;
+    hmdma.Init.BufferTransferLength = 128;
+    hmdma.Init.SourceBurst = MDMA_SOURCE_BURST_16BEATS;
+    hmdma.Init.DestBurst = dst_inc ? MDMA_DEST_BURST_16BEATS : MDMA_DEST_BURST_SINGLE;
+    hmdma.Init.SourceBlockAddressOffset = 0;
+    hmdma.Init.DestBlockAddressOffset = 0;
+
+    if (HAL_MDMA_Init(&hmdma) != HAL_OK ||
+        HAL_MDMA_Start(&hmdma, src, dst, block, count) != HAL_OK ||
+        HAL_MDMA_PollForTransfer(&hmdma, HAL_MDMA_FULL_TRANSFER, MEMOPS_TIMEOUT) != HAL_OK) {
+        HAL_MDMA_Abort(&hmdma);
+        HAL_MDMA_DeInit(&hmdma);
+        return -EIO;
+    }
+    HAL_MDMA_DeInit(&hmdma);
+    return 0;
+}
+
+/*
+ * `len` bytes, split into runs of full blocks and a short one
+ */
+static int mdma_xfer(int dst, int src, int len, int size, int dst_inc)
+{
+    int count, ret;
+
+    while (len) {
+        if (len >= MDMA_BLOCK_MAX) {
+            count = len / MDMA_BLOCK_MAX;
+            if (count > MDMA_BLOCK_COUNT)
+                count = MDMA_BLOCK_COUNT;
+            ret = mdma_run(dst, src, MDMA_BLOCK_MAX, count, size, dst_inc);
+            count *= MDMA_BLOCK_MAX;
+        } else {
+            count = len;
+            ret = mdma_run(dst, src, len, 1, size, dst_inc);
+        }
+        if (ret)
+            return ret;
+        src += count;
+        if (dst_inc)
+            dst += count;
+        len -= count;
+    }
+    return 0;
+}
+
+// widest access all of them allow
+static int mem_width(int a, int b, int len)
+{
+    int x = a | b | len;
+
+    return (x & 3) == 0 ? 4 : (x & 1) == 0 ? 2 : 1;
+}
+
+int mem_copy(void *dst, const void *src, int len)
+{
+    int ret;
+
+    if (len <= 0)
+        return 0;
+    dcache_flush(src, len);
+    dcache_flush(dst, len);
+    ret = mdma_xfer((int)dst, (int)src, len, mem_width((int)dst, (int)src, len), 1);
+    dcache_flush(dst, len);
+    return ret;
+}
+
+/*
+ * DMA2D R2M of `words` words at 4-byte aligned `dst`
+ */
+static int dma2d_fill(unsigned int dst, unsigned int pattern, int words)
+{
+    int pl, nl, ret = 0;
+
+    __HAL_RCC_DMA2D_CLK_ENABLE();
+
+    while (words && !ret) {
+        // a rectangle of full lines, then the rest as one line
+        if (words > DMA2D_PL_MAX) {
+            pl = DMA2D_LINE;
+            nl = words / DMA2D_LINE;
+            if (nl > 0xffff)
+                nl = 0xffff;
+        } else {
+            pl = words;
+            nl = 1;
+        }
+
+        DMA2D->CR = 3 << DMA2D_CR_MODE_Pos;  // register to memory
+        DMA2D->OPFCCR = 0;                   // ARGB8888
+        DMA2D->OCOLR = pattern;
+        DMA2D->OMAR = dst;
+        DMA2D->OOR = 0;
+        DMA2D->NLR = pl << DMA2D_NLR_PL_Pos | nl;
+        DMA2D->IFCR = DMA2D_IFCR_CTEIF | DMA2D_IFCR_CCEIF;
+        DMA2D->CR |= DMA2D_CR_START;
+
+        while (DMA2D->CR & DMA2D_CR_START)
+            ;
+        if (DMA2D->ISR & (DMA2D_ISR_TEIF | DMA2D_ISR_CEIF))
+            ret = -EIO;
+
+        dst += pl * nl * 4;
+        words -= pl * nl;
+    }
+    return ret;
+}
+
+/**
+ * fill `len` bytes with `value` of `width` bytes
+ */
+int mem_fill(void *dst, unsigned int value, int width, int len)
+{
+    unsigned char *p = dst, *end = p + len;
+    unsigned int pattern;
+    int ret = 0, words;
+
+    if (len <= 0)
+        return 0;
+
+    // whole 32-bit pattern, as the bytes lie in memory from `dst`
+    pattern = width == 1 ? (value & 0xff) * 0x01010101 :
+              width == 2 ? (value & 0xffff) * 0x00010001 : value;
+    if ((int)p & 3)
+        pattern = pattern << ((int)p & 3) * 8 | pattern >> (4 - ((int)p & 3)) * 8;
+
+    if ((unsigned int)p < DMA2D_MIN_ADDR) {
+        for (; p < end; p++)
+            *p = pattern >> ((int)p & 3) * 8;
+        return 0;
+    }
+
+    dcache_flush(dst, len);
+    while (((int)p & 3) && p < end) {
+        *p = pattern >> ((int)p & 3) * 8;
+        p++;
+    }
+    words = (end - p) / 4;
+    if (words) {
+        // cpu stores of the head must be out before the engine writes
+        SCB_CleanDCache_by_Addr((uint32_t *)((int)dst & ~31), 32);
+        ret = dma2d_fill((unsigned int)p, pattern, words);
+        p += words * 4;
+    }
+    for (; p < end; p++)
+        *p = pattern >> ((int)p & 3) * 8;
+    dcache_flush(dst, len);
+    return ret;
+}
+
+/**
+ * compare `len` bytes by `width`, returns the offset of
+ * the first difference, `len` if equal
+ */
+int mem_cmp(const void *a, const void *b, int width, int len)
+{
+    const unsigned int *wa = a, *wb = b;
+    int i = 0;
+
+    if (!(((int)a | (int)b) & 3)) {
+        for (; i + 16 <= len; i += 16, wa += 4, wb += 4)
+            if (wa[0] != wb[0] || wa[1] != wb[1] || wa[2] != wb[2] || wa[3] != wb[3])
+                break;
+    }
+
+    for (; i < len; i += width) {
+        switch (width) {
+        case 1:
+            if (*((const unsigned char *)a + i) != *((const unsigned char *)b + i))
+                return i;
+            break;
+        case 2:
+            if (*(const unsigned short *)((const char *)a + i) !=
+                *(const unsigned short *)((const char *)b + i))
+                return i;
+            break;
+        default:
+            if (*(const unsigned int *)((const char *)a + i) !=
+                *(const unsigned int *)((const char *)b + i))
+                return i;
+        }
+    }
+    return len;
+}
+
+/*
+ * CRC unit as zlib crc32: reflected in and out, ~ at the end
+ * 32-bit little-endian words need the word-wise bit reversal,
+ * single bytes the byte-wise one
+ */
+static void crc_bytes(const unsigned char *p, int n)
+{
+    MODIFY_REG(CRC->CR, CRC_CR_REV_IN, CRC_CR_REV_IN_0);
+    while (n--)
+        *(volatile unsigned char *)&CRC->DR = *p++;
+}
+
+unsigned int mem_crc32(const void *buf, int len)
+{
+    const unsigned char *p = buf;
+    int head = -(int)p & 3, words, ret = 0;
+
+    if (head > len)
+        head = len;
+    words = (len - head) / 4;
+
+    __HAL_RCC_CRC_CLK_ENABLE();
+    CRC->POL = 0x04c11db7;
+    CRC->INIT = 0xffffffff;
+    CRC->CR = CRC_CR_REV_OUT | CRC_CR_RESET;
+
+    crc_bytes(p, head);
+    p += head;
+
+    if (words) {
+        MODIFY_REG(CRC->CR, CRC_CR_REV_IN, CRC_CR_REV_IN);
+        dcache_flush(p, words * 4);
+        ret = mdma_xfer((int)&CRC->DR, (int)p, words * 4, 4, 0);
+        p += words * 4;
+    }
+    crc_bytes(p, len - head - words * 4);
+
+    if (ret)  // engine failed, the cpu does it
+        return crc32(0, buf, len);
+    return ~CRC->DR;
+}
@@ -0,0 +1,442 @@
+/**
+ * @file mpu.c
+ * @brief MPU region table, cache policies and their benchmark
+ * @version 1.0
+ *
+ * one table entry per region, a higher number wins where they overlap,
+ * `off` leaves the range to the default map: write-through for flash
+ * and qspi, write-back for the srams. SDRAM at 0xC0000000 is device
+ * memory, execute never there, so sdram can't be `off`:
+ *
+ *   wbwa: write-back, write-allocate   TEX 1 C B
+ *   wb:   write-back, no write-allocate TEX 0 C B
+ *   wt:   write-through                TEX 0 C
+ *   nc:   normal, not cacheable        TEX 1
+ *
+ * `mpu <region> <policy> [xn] [share]` changes a region at runtime,
+ * `mpu save` keeps the changes in the env (mpu), applied after
+ * env_init. linux is started with the table as it is then, a kernel
+ * without its own MPU setup keeps it.
+ *
+ * `mpu bench` times reads, writes, memcpy and memcpy plus the dcache
+ * maintenance a dma handoff needs, per region and policy. the dma
+ * buffers live in AXI-SRAM, the axi numbers hold for them.
+ */
+#include <stm32h7xx_hal.h>
+#include <stdio.h>
+#include <string.h>
+#include "bsp.h"
+#include "errno.h"
+#include "cmd.h"
+#include "qspi-flash.h"
+
+enum { MPU_WBWA, MPU_WB, MPU_WT, MPU_NC, MPU_OFF };
+
+static const struct {
+    const char *name;
+    unsigned char tex, c, b;
+} mpu_policies[] = {
+    [MPU_WBWA] = { "wbwa", MPU_TEX_LEVEL1, MPU_ACCESS_CACHEABLE,     MPU_ACCESS_BUFFERABLE },
+    [MPU_WB]   = { "wb",   MPU_TEX_LEVEL0, MPU_ACCESS_CACHEABLE,     MPU_ACCESS_BUFFERABLE },
+    [MPU_WT]   = { "wt",   MPU_TEX_LEVEL0, MPU_ACCESS_CACHEABLE,     MPU_ACCESS_NOT_BUFFERABLE },
+    [MPU_NC]   = { "nc",   MPU_TEX_LEVEL1, MPU_ACCESS_NOT_CACHEABLE, MPU_ACCESS_NOT_BUFFERABLE },
+    [MPU_OFF]  = { "off" },
+};
+
+#ifdef USE_SRAM_D2
+#define MPU_D2_POLICY   MPU_WBWA
+#else
+#define MPU_D2_POLICY   MPU_OFF
+#endif
+#ifdef USE_SRAM_D3
+#define MPU_D3_POLICY   MPU_WBWA
+#else
+#define MPU_D3_POLICY   MPU_OFF
+#endif
+
+// the MPU region number, dma last as it overrides axi
+enum { MPU_AXI, MPU_D2, MPU_D3, MPU_SDRAM, MPU_FLASH, MPU_QSPI, MPU_DMA };
+
+/*
+ * `srd`: disabled 1/8 subregions, SRAM1-3 are 288KB of a 512KB region
+ * `size` of dma is set from the linker at mpu_config
+ */
+static struct mpu_region {
+    const char *name;
+    unsigned int base, size;
+    unsigned char srd, policy, xn, share;
+} mpu_regions[] = {
+    [MPU_AXI]   = { "axi",   0x24000000,           0x80000,   0x00, MPU_WBWA,      0, 0 },
+    [MPU_D2]    = { "d2",    0x30000000,           0x80000,   0xe0, MPU_D2_POLICY, 0, 0 },
+    [MPU_D3]    = { "d3",    0x38000000,           0x10000,   0x00, MPU_D3_POLICY, 0, 0 },
+    [MPU_SDRAM] = { "sdram", SDRAM_BASE_ADDR,      SDRAM_SIZE_MB * 0x100000, 0x00, MPU_WBWA, 0, 0 },
+    [MPU_FLASH] = { "flash", FLASH_BASE_ADDR,      0x200000,  0x00, MPU_WBWA,      0, 0 },
+    [MPU_QSPI]  = { "qspi",  QSPI_FLASH_BASE_ADDR, QSPI_FLASH_SIZE_MB * 0x100000, 0x00, MPU_WBWA, 0, 0 },
+    [MPU_DMA]   = { "dma",   0x24000000,           0,         0x00, MPU_WBWA,      0, 0 },
+};
+
+static void mpu_size_str(char *s, int len, unsigned int size)
+{
+    if (size >= 0x100000)
+        scnprintf(s, len, "%dMB", size >> 20);
+    else
+        scnprintf(s, len, "%dKB", size >> 10);
+}
+
+static void mpu_region_set(int n)
+{
+    const struct mpu_region *r = &mpu_regions[n];
+    MPU_Region_InitTypeDef init = {0};
+
+    init.Number = MPU_REGION_NUMBER0 + n;
+    if (r->policy == MPU_OFF) {
+        init.Enable = MPU_REGION_DISABLE;
+        HAL_MPU_ConfigRegion(&init);
+        return;
+    }
+    init.Enable = MPU_REGION_ENABLE;
+    init.BaseAddress = r->base;
+    init.Size = __builtin_ctz(r->size) - 1;  // MPU_REGION_SIZE_32B is 4
+    init.SubRegionDisable = r->srd;
+    init.AccessPermission = MPU_REGION_FULL_ACCESS;
+    init.TypeExtField = mpu_policies[r->policy].tex;
+    init.IsCacheable = mpu_policies[r->policy].c;
+    init.IsBufferable = mpu_policies[r->policy].b;
+    init.IsShareable = r->share ? MPU_ACCESS_SHAREABLE : MPU_ACCESS_NOT_SHAREABLE;
+    init.DisableExec = r->xn ? MPU_INSTRUCTION_ACCESS_DISABLE : MPU_INSTRUCTION_ACCESS_ENABLE;
+    HAL_MPU_ConfigRegion(&init);
+}
+
+/*
+ * dirty lines must be out before a region stops being write-back
+ */
+static void mpu_update(int n)
+{
+    if (SCB->CCR & SCB_CCR_DC_Msk)
+        SCB_CleanInvalidateDCache();
+    HAL_MPU_Disable();
+    mpu_region_set(n);
+    HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
+    if (SCB->CCR & SCB_CCR_IC_Msk)
+        SCB_InvalidateICache();
+
+    if (n == MPU_D2 && mpu_regions[n].policy != MPU_OFF) {
+        __HAL_RCC_D2SRAM1_CLK_ENABLE();
+        __HAL_RCC_D2SRAM2_CLK_ENABLE();
+        __HAL_RCC_D2SRAM3_CLK_ENABLE();
+    }
+}
+
+void mpu_config(void)
+{
+    extern char _edma_buf;
+    unsigned int dma = (unsigned int)&_edma_buf - mpu_regions[MPU_DMA].base;
+    char size[8];
+    int i;
+
+    // the smallest power of two holding .dma_buf
+    for (mpu_regions[MPU_DMA].size = 32; mpu_regions[MPU_DMA].size < dma;
+         mpu_regions[MPU_DMA].size <<= 1)
+        ;
+
+    HAL_MPU_Disable();
+    for (i = 0; i < ARRAY_SIZE(mpu_regions); i++) {
+        mpu_region_set(i);
+        if (mpu_regions[i].policy == MPU_OFF)
+            continue;
+        mpu_size_str(size, sizeof(size), mpu_regions[i].size);
+        printk(KERN_INFO "mpu: mem 0x%08x setup, size %s, %s", mpu_regions[i].base, size,
+               mpu_policies[mpu_regions[i].policy].name);
+    }
+    HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
+}
+
+static int mpu_find(const char *name, int len)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(mpu_regions); i++)
+        if (!strncmp(mpu_regions[i].name, name, len) && !mpu_regions[i].name[len])
+            return i;
+    return -ENOENT;
+}
+
+static int mpu_policy(const char *name, int len)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(mpu_policies); i++)
+        if (!strncmp(mpu_policies[i].name, name, len) && !mpu_policies[i].name[len])
+            return i;
+    return -EINVAL;
+}
+
+/*
+ * "<region> <policy> [xn] [share]" or "<region>=<policy>[+xn][+share]"
+ */
+static int mpu_parse(const char *s, int len)
+{
+    int n, p, xn = 0, share = 0, l = strcspn(s, " =");
+
+    if (l >= len || (n = mpu_find(s, l)) < 0)
+        return -ENOENT;
+    s += l + 1;
+    len -= l + 1;
+    while (len && *s == ' ') {
+        s++;
+        len--;
+    }
+
+    l = strcspn(s, " +");
+    if (l > len)
+        l = len;
+    p = mpu_policy(s, l);
+    if (p < 0)
+        return p;
+    if (p == MPU_OFF && n == MPU_SDRAM) {
+        printk(KERN_ERR "mpu: sdram would be device memory, not off");
+        return -EINVAL;
+    }
+    for (s += l, len -= l; len > 0; s += l, len -= l) {
+        s++;
+        len--;
+        l = strcspn(s, " +");
+        if (l > len)
+            l = len;
+        if (l == 2 && !strncmp(s, "xn", 2))
+            xn = 1;
+        else if (l == 5 && !strncmp(s, "share", 5))
+            share = 1;
+        else if (l)
+            return -EINVAL;
+    }
+
+    mpu_regions[n].policy = p;
+    mpu_regions[n].xn = xn;
+    mpu_regions[n].share = share;
+    mpu_update(n);
+    return 0;
+}
+
+/*
+ * overrides from the env, "sdram=wt,qspi=wb+xn"
+ */
+void mpu_env_load(void)
+{
+    const char *s = env_get("mpu");
+    int len;
+
+    while (s && *s) {
+        len = strcspn(s, ",");
+        if (mpu_parse(s, len))
+            printk(KERN_WARNING "mpu: bad entry %.*s", len, s);
+        s += len;
+        if (*s)
+            s++;
+    }
+}
+
+static int mpu_save(void)
+{
+    char val[128];
+    int i, n = 0, ret;
+
+    for (i = 0; i < ARRAY_SIZE(mpu_regions); i++)
+        n += scnprintf(val + n, sizeof(val) - n, "%s%s=%s%s%s", n ? "," : "",
+                       mpu_regions[i].name, mpu_policies[mpu_regions[i].policy].name,
+                       mpu_regions[i].xn ? "+xn" : "", mpu_regions[i].share ? "+share" : "");
+    ret = env_set("mpu", val);
+    return ret ? ret : env_save();
+}
+
+static void mpu_list(void)
+{
+    const struct mpu_region *r;
+    char size[8];
+    int i;
+
+    printk("n region base       size   srd  policy");
+    for (i = 0; i < ARRAY_SIZE(mpu_regions); i++) {
+        r = &mpu_regions[i];
+        mpu_size_str(size, sizeof(size), r->size);
+        printk("%d %-6s 0x%08x %-6s 0x%02x %s%s%s", i, r->name, r->base, size, r->srd,
+               mpu_policies[r->policy].name, r->xn ? " xn" : "", r->share ? " share" : "");
+    }
+}
+
+
+/*
+ * benchmark, the kernels run from ITCM so flash and qspi policies
+ * don't slow the loop itself
+ */
+#define MB_RUNS     3
+
+static __itcm unsigned int mb_read(const unsigned int *p, int words)
+{
+    unsigned int sum = 0;
+    int i;
+
+    for (i = 0; i < words; i += 8)
+        sum += p[i] + p[i+1] + p[i+2] + p[i+3] + p[i+4] + p[i+5] + p[i+6] + p[i+7];
+    return sum;
+}
+
+static __itcm void mb_write(unsigned int *p, int words)
+{
+    int i;
+
+    for (i = 0; i < words; i += 8) {
+        p[i] = i;   p[i+1] = i; p[i+2] = i; p[i+3] = i;
+        p[i+4] = i; p[i+5] = i; p[i+6] = i; p[i+7] = i;
+    }
+}
+
+enum { MB_READ, MB_WRITE, MB_COPY, MB_FLUSH };
+
+static volatile unsigned int mb_sink;
+
+// best of MB_RUNS in MB/s
+static int mb_time(int what, void *base, int len)
+{
+    unsigned int t, best = ~0u;
+    int i;
+
+    SCB_CleanInvalidateDCache();
+    for (i = 0; i < MB_RUNS; i++) {
+        t = get_cycles();
+        switch (what) {
+        case MB_READ:
+            mb_sink = mb_read(base, len / 4);
+            break;
+        case MB_WRITE:
+            mb_write(base, len / 4);
+            break;
+        case MB_COPY:
+            memcpy(base, (char *)base + len / 2, len / 2);
+            break;
+        default:
+            // as before a dma engine reads the copy
+            memcpy(base, (char *)base + len / 2, len / 2);
+            SCB_CleanInvalidateDCache_by_Addr((uint32_t *)base, len / 2);
+            break;
+        }
+        t = get_cycles() - t;
+        if (t < best)
+            best = t;
+    }
+    return (unsigned int)len * (SystemCoreClock / 1000000) / best;
+}
+
+// the writable ones from their arenas, read-only ones in place
+static const struct {
+    const char *region;
+    int arena;
+    unsigned int base;
+    int len, rw;
+} mb_areas[] = {
+    { "axi",   ARENA_AXI,   0,                    0x10000,  1 },
+    { "d2",    ARENA_D2,    0,                    0x10000,  1 },
+    { "d3",    ARENA_D3,    0,                    0x8000,   1 },
+    { "sdram", ARENA_SDRAM, 0,                    0x100000, 1 },
+    { "flash", -1,          FLASH_BASE_ADDR,      0x80000,  0 },
+    { "qspi",  -1,          QSPI_FLASH_BASE_ADDR, 0x100000, 0 },
+};
+
+static int mpu_bench(const char *only)
+{
+    extern QSPI_HandleTypeDef hqspi;
+    const struct mpu_region *dma = &mpu_regions[MPU_DMA];
+    struct mpu_region save;
+    void *base, *buf;
+    int i, n, p, mapped, v[4], best, best_p;
+
+    mapped = HAL_QSPI_GetState(&hqspi) == HAL_QSPI_STATE_BUSY_MEM_MAPPED;
+    if (!mapped && QSPI_W25Qxx_MMMode())
+        return -EIO;
+
+    printf("region,policy,read,write,copy,copy+flush (MB/s)\r\n");
+    for (i = 0; i < ARRAY_SIZE(mb_areas); i++) {
+        if (only[0] && strcmp(only, mb_areas[i].region))
+            continue;
+        buf = NULL;
+        base = (void *)mb_areas[i].base;
+        if (mb_areas[i].arena >= 0) {
+            base = buf = arena_alloc(mb_areas[i].arena, mb_areas[i].len, "mpubench");
+            if (!buf) {
+                printf("# %s: no buffer\r\n", mb_areas[i].region);
+                continue;
+            }
+        }
+        n = mpu_find(mb_areas[i].region, strlen(mb_areas[i].region));
+        if (n == MPU_AXI && dma->policy != MPU_OFF && dma->base + dma->size > (unsigned int)base) {
+            printf("# axi: the dma region covers the scratch area\r\n");
+            arena_free(buf);
+            continue;
+        }
+        save = mpu_regions[n];
+        best = best_p = 0;
+
+        for (p = MPU_WBWA; p <= MPU_NC; p++) {
+            mpu_regions[n].policy = p;
+            mpu_update(n);
+            v[MB_READ] = mb_time(MB_READ, base, mb_areas[i].len);
+            if (mb_areas[i].rw) {
+                v[MB_WRITE] = mb_time(MB_WRITE, base, mb_areas[i].len);
+                v[MB_COPY] = mb_time(MB_COPY, base, mb_areas[i].len);
+                v[MB_FLUSH] = mb_time(MB_FLUSH, base, mb_areas[i].len);
+                printf("%s,%s,%d,%d,%d,%d\r\n", mb_areas[i].region, mpu_policies[p].name,
+                       v[MB_READ], v[MB_WRITE], v[MB_COPY], v[MB_FLUSH]);
+            } else {
+                v[MB_FLUSH] = v[MB_READ];
+                printf("%s,%s,%d,-,-,-\r\n", mb_areas[i].region, mpu_policies[p].name,
+                       v[MB_READ]);
+            }
+            if (v[MB_FLUSH] > best) {
+                best = v[MB_FLUSH];
+                best_p = p;
+            }
+            if (console_ctrlc())
+                break;
+        }
+        mpu_regions[n] = save;
+        mpu_update(n);
+        arena_free(buf);
+        printf("# best %s: %s\r\n", mb_areas[i].region, mpu_policies[best_p].name);
+    }
+
+    if (!mapped) {
+        HAL_QSPI_Abort(&hqspi);
+        QSPI_W25Qxx_Init();
+    }
+    return 0;
+}
+
+int do_mpu(const char *buf)
+{
+    int idx = 0;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+
+    if (!buf[idx]) {
+        mpu_list();
+        return 0;
+    }
+    if (!strcmp(&buf[idx], "save"))
+        return mpu_save();
+    if (!strncmp(&buf[idx], "bench", 5)) {
+        idx += 5;
+        while (buf[idx] == ' ') idx++;
+        return mpu_bench(&buf[idx]);
+    }
+    return mpu_parse(&buf[idx], strlen(&buf[idx]));
+}
+
+void help_mpu(void)
+{
+    printsh("mpu [<region> <wbwa / wb / wt / nc / off> [xn] [share] / save / bench [region]]");
+    printsh("list or change the MPU regions, save keeps the changes for the next boot,");
+    printsh("bench times every policy per region in free arena blocks, sdram can't be off");
+}
+SHELL_EXPORT_CMD(mpu, help_mpu, do_mpu);
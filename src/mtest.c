@@ -10,12 +10,14 @@
 
 #include <stm32h7xx_hal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <memory.h>
 #include <cmsis_gcc.h>
 #include "bsp.h"
 #include "qspi-flash.h"
 
-#define RW_SIZE      (SDRAM_SIZE_MB * 1024 * 1024)
+// a quarter of SDRAM, from its arena, loaded images stay
+#define RW_SIZE      (SDRAM_SIZE_MB / 4 * 1024 * 1024)
 // winbond: cannot read the last bit at XIP mode
 #define RD_SIZE      (QSPI_FLASH_SIZE_MB * 1024 * 1024 - 1)
 #define SPEED(size)  (size / 1000 / (end_time - start_time))
@@ -69,45 +71,45 @@ static inline void memory_write(__IO int *addr, int size)
 
 static inline void memory_read(__IO int *addr, int size)
 {
-    int i, tmp;
+    int i;
     int _SIZE = size / sizeof(int) / 32;
     start_time = HAL_GetTick();
     for (i = 0; i < _SIZE; i++) {
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
-        tmp = *addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
+        (void)*addr++;
     }
     end_time = HAL_GetTick();
 }
@@ -118,13 +120,17 @@ static inline void memory_read(__IO int *addr, int size)
 __itcm void memory_speed_test(void)
 {
     extern QSPI_HandleTypeDef hqspi;
+    int *buf = arena_alloc(ARENA_SDRAM, RW_SIZE, "mtest");
 
 /* SDRAM */
-    memory_write((int *)SDRAM_BASE_ADDR, RW_SIZE);
-    printk("sdram write: %d MB/s", SPEED(RW_SIZE));
+    if (buf) {
+        memory_write(buf, RW_SIZE);
+        printk("sdram write: %d MB/s", SPEED(RW_SIZE));
 
-    memory_read((int *)SDRAM_BASE_ADDR, RW_SIZE);
-    printk("sdram  read: %d MB/s", SPEED(RW_SIZE));
+        memory_read(buf, RW_SIZE);
+        printk("sdram  read: %d MB/s", SPEED(RW_SIZE));
+        arena_free(buf);
+    }
 
 /* QSPI Flash */
     QSPI_W25Qxx_MMMode();
@@ -134,4 +140,465 @@ __itcm void memory_speed_test(void)
     QSPI_W25Qxx_Init();
 
     printk("");
-}
\ No newline at end of file
+}
+
+/**
+ * @brief cycles per printk line: formatting only, then the whole
+ *        printk into the console ring (few enough lines to fit)
+ */
+void printk_speed_test(void)
+{
+    char line[128];
+    int i, start, fmt, full;
+
+    start = get_cycles();
+    for (i = 0; i < 16; i++)
+        scnprintf(line, sizeof(line), "[%5u.%06u] %s: 0x%08x, %dKB",
+                  i, 123456, "sdmmc", 0xc1000000, 4096);
+    fmt = (get_cycles() - start) / 16;
+
+    start = get_cycles();
+    for (i = 0; i < 16; i++)
+        printk(KERN_INFO "sdmmc: 0x%08x, %dKB", 0xc1000000, i);
+    full = (get_cycles() - start) / 16;
+
+    console_flush();
+    printk("printk format: %d cycles/line, printk: %d cycles/line (%dus @ %dMHz)",
+            fmt, full, full / (SystemCoreClock / 1000000), SystemCoreClock / 1000000);
+    printk("");
+}
+
+/*
+ * STREAM-style bandwidth suite
+ *
+ * copy / scale / add / triad on 32-bit ints as in STREAM, bytes counted
+ * the same way (every word read or written), plus a copy by LDRD/STRD
+ * and one by LDM/STM of 8 registers, and plain and LDM reads for
+ * read-only qspi-flash
+ *
+ * each kernel runs STREAM_RUNS times per region and dcache mode,
+ * timed by the cycle counter, CSV: median, min and max MB/s
+ */
+#define STREAM_RUNS     7
+#define STREAM_SCALAR   3
+
+struct stream_region {
+    const char *name;
+    int arena;          // -1: fixed base
+    unsigned int base;  // else 0 if the arena had no room
+    int words;          // per array, a b c follow each other
+    int writable;
+};
+
+static struct stream_region stream_regions[] = {
+    { "dtcm",    ARENA_DTCM,  0,            1024,   1 },
+    { "axi",     ARENA_AXI,   0,            16384,  1 },
+    { "sram1-3", ARENA_D2,    0,            16384,  1 },
+    { "sram4",   ARENA_D3,    0,            4096,   1 },
+    { "sdram",   ARENA_SDRAM, 0,            262144, 1 },
+    { "qspi",    -1,          KERNEL_ADDR,  262144, 0 },
+};
+
+static volatile unsigned int stream_sink;
+
+static __itcm void k_copy(unsigned int *a, unsigned int *b, unsigned int *c, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        c[i] = a[i];
+}
+
+static __itcm void k_scale(unsigned int *a, unsigned int *b, unsigned int *c, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        b[i] = STREAM_SCALAR * c[i];
+}
+
+static __itcm void k_add(unsigned int *a, unsigned int *b, unsigned int *c, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        c[i] = a[i] + b[i];
+}
+
+static __itcm void k_triad(unsigned int *a, unsigned int *b, unsigned int *c, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        a[i] = b[i] + STREAM_SCALAR * c[i];
+}
+
+// r7 is the thumb frame pointer, left out
+static __itcm void k_copy_ldrd(unsigned int *a, unsigned int *b, unsigned int *c, int n)
+{
+    asm volatile(
+        "1: ldrd r4, r5, [%1], #8\n"
+        "   ldrd r6, r8, [%1], #8\n"
+        "   strd r4, r5, [%0], #8\n"
+        "   strd r6, r8, [%0], #8\n"
+        "   subs %2, %2, #4\n"
+        "   bne 1b\n"
+        : "+r"(c), "+r"(a), "+r"(n)
+        :: "r4", "r5", "r6", "r8", "memory", "cc");
+}
+
+static __itcm void k_copy_ldm(unsigned int *a, unsigned int *b, unsigned int *c, int n)
+{
+    asm volatile(
+        "1: ldmia %1!, {r3-r6, r8-r10, r12}\n"
+        "   stmia %0!, {r3-r6, r8-r10, r12}\n"
+        "   subs %2, %2, #8\n"
+        "   bne 1b\n"
+        : "+r"(c), "+r"(a), "+r"(n)
+        :: "r3", "r4", "r5", "r6", "r8", "r9", "r10", "r12", "memory", "cc");
+}
+
+static __itcm void k_read(unsigned int *a, unsigned int *b, unsigned int *c, int n)
+{
+    unsigned int sum = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        sum += a[i];
+    stream_sink = sum;
+}
+
+static __itcm void k_read_ldm(unsigned int *a, unsigned int *b, unsigned int *c, int n)
+{
+    asm volatile(
+        "1: ldmia %0!, {r3-r6, r8-r10, r12}\n"
+        "   subs %1, %1, #8\n"
+        "   bne 1b\n"
+        : "+r"(a), "+r"(n)
+        :: "r3", "r4", "r5", "r6", "r8", "r9", "r10", "r12", "memory", "cc");
+}
+
+static const struct {
+    const char *name;
+    int words;   // moved per element
+    int writes;
+    void (*fn)(unsigned int *, unsigned int *, unsigned int *, int);
+} stream_kernels[] = {
+    { "copy",      2, 1, k_copy },
+    { "scale",     2, 1, k_scale },
+    { "add",       3, 1, k_add },
+    { "triad",     3, 1, k_triad },
+    { "copy_ldrd", 2, 1, k_copy_ldrd },
+    { "copy_ldm",  2, 1, k_copy_ldm },
+    { "read",      1, 0, k_read },
+    { "read_ldm",  1, 0, k_read_ldm },
+};
+
+static void sort(unsigned int *v, int n)
+{
+    unsigned int t;
+    int i, j;
+
+    for (i = 1; i < n; i++)
+        for (j = i; j > 0 && v[j - 1] > v[j]; j--)
+            t = v[j], v[j] = v[j - 1], v[j - 1] = t;
+}
+
+// MB/s * 10
+static unsigned int stream_rate(int bytes, unsigned int cycles)
+{
+    unsigned int us = cycles / (SystemCoreClock / 1000000);
+
+    return us ? bytes * 10 / us : 0;
+}
+
+static void stream_region(struct stream_region *r, int dcache)
+{
+    unsigned int rate[STREAM_RUNS], start;
+    unsigned int *a = (unsigned int *)r->base, *b, *c;
+    int i, k, n = r->words, bytes;
+    char stat[48];
+
+    b = a + n;
+    c = b + n;
+    if (r->writable) {
+        for (i = 0; i < n; i++) {
+            a[i] = 1;
+            b[i] = 2;
+            c[i] = 0;
+        }
+    }
+
+    for (k = 0; k < ARRAY_SIZE(stream_kernels); k++) {
+        if (stream_kernels[k].writes && !r->writable)
+            continue;
+        bytes = stream_kernels[k].words * n * 4;
+        for (i = 0; i < STREAM_RUNS; i++) {
+            start = get_cycles();
+            stream_kernels[k].fn(a, b, c, n);
+            rate[i] = stream_rate(bytes, get_cycles() - start);
+        }
+        sort(rate, STREAM_RUNS);
+        // printk takes 8 arguments at most
+        scnprintf(stat, sizeof(stat), "%d.%d,%d.%d,%d.%d,%d",
+                  rate[STREAM_RUNS / 2] / 10, rate[STREAM_RUNS / 2] % 10,
+                  rate[0] / 10, rate[0] % 10,
+                  rate[STREAM_RUNS - 1] / 10, rate[STREAM_RUNS - 1] % 10,
+                  rate[STREAM_RUNS / 2] ?
+                  (rate[STREAM_RUNS - 1] - rate[0]) * 100 / rate[STREAM_RUNS / 2] : 0);
+        printk("%s,%s,%s,%d,%s", r->name, dcache ? "on" : "off",
+               stream_kernels[k].name, bytes, stat);
+    }
+}
+
+/**
+ * @brief bandwidth of every memory region, dcache on and off, as CSV
+ */
+void memory_stream_test(void)
+{
+    extern QSPI_HandleTypeDef hqspi;
+    int dcache_was_on = SCB->CCR & SCB_CCR_DC_Msk;
+    struct stream_region *r;
+    int i, dcache;
+
+    for (i = 0; i < ARRAY_SIZE(stream_regions); i++) {
+        r = &stream_regions[i];
+        if (r->arena >= 0)
+            r->base = (unsigned int)arena_alloc(r->arena, 3 * r->words * 4, "mtest");
+    }
+
+    __HAL_RCC_D2SRAM1_CLK_ENABLE();
+    __HAL_RCC_D2SRAM2_CLK_ENABLE();
+    __HAL_RCC_D2SRAM3_CLK_ENABLE();
+    QSPI_W25Qxx_MMMode();
+
+    printk("region,dcache,kernel,bytes,median_MBps,min_MBps,max_MBps,spread_%%");
+    for (dcache = 1; dcache >= 0; dcache--) {
+        if (dcache)
+            SCB_EnableDCache();
+        else
+            SCB_DisableDCache();
+        for (i = 0; i < ARRAY_SIZE(stream_regions); i++) {
+            if (!stream_regions[i].base) {
+                printk("# %s: no buffer", stream_regions[i].name);
+                continue;
+            }
+            stream_region(&stream_regions[i], dcache);
+        }
+    }
+
+    if (dcache_was_on)
+        SCB_EnableDCache();
+    HAL_QSPI_Abort(&hqspi);
+    QSPI_W25Qxx_Init();
+    for (i = 0; i < ARRAY_SIZE(stream_regions); i++)
+        if (stream_regions[i].arena >= 0)
+            arena_free((void *)stream_regions[i].base);
+    printk("");
+}
+
+/*
+ * pointer chase latency
+ *
+ * nodes `stride` bytes apart fill the working set, each holds the
+ * address of the next, the order is one random cycle (sattolo), so
+ * every load waits for the one before and no access is predictable
+ *
+ * read-only qspi-flash can't hold a chain: the same kind of cycle of
+ * node indices lives in a ram table, each step loads the node, then
+ * the next index, which the loaded word feeds into. the same walk with
+ * every node on one DTCM word, a 1 cycle load, is subtracted
+ */
+#define CHASE_MIN_WS    1024
+#define CHASE_MIN_LOADS 8192
+
+struct chase_region {
+    const char *name;
+    int arena;          // -1: fixed base
+    unsigned int base;  // else 0 if the arena had no room
+    int max;            // largest working set, power of 2
+    int writable;
+};
+
+static struct chase_region chase_regions[] = {
+    { "dtcm",    ARENA_DTCM,  0,                    0x2000,    1 },
+    { "axi",     ARENA_AXI,   0,                    0x40000,   1 },
+    { "sram1-3", ARENA_D2,    0,                    0x40000,   1 },
+    { "sram4",   ARENA_D3,    0,                    0x10000,   1 },
+    { "sdram",   ARENA_SDRAM, 0,                    0x1000000, 1 },
+    { "qspi",    -1,          QSPI_FLASH_BASE_ADDR, 0x400000,  0 },
+};
+
+static volatile unsigned int chase_zero;
+
+static unsigned int xorshift32(unsigned int *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+static void chase_build(unsigned int base, int count, int stride)
+{
+    unsigned int seed = 0x2545f491, t;
+    unsigned int *node;
+    int i, j;
+
+    for (i = 0; i < count; i++)
+        *(unsigned int *)(base + i * stride) = i;
+
+    // sattolo: a random permutation that is a single cycle
+    for (i = count - 1; i > 0; i--) {
+        j = xorshift32(&seed) % i;
+        node = (unsigned int *)(base + i * stride);
+        t = *node;
+        *node = *(unsigned int *)(base + j * stride);
+        *(unsigned int *)(base + j * stride) = t;
+    }
+
+    for (i = 0; i < count; i++) {
+        node = (unsigned int *)(base + i * stride);
+        *node = base + *node * stride;
+    }
+}
+
+static __itcm unsigned int *chase(unsigned int *p, int n)
+{
+    for (; n > 0; n -= 8) {
+        p = (unsigned int *)*p;
+        p = (unsigned int *)*p;
+        p = (unsigned int *)*p;
+        p = (unsigned int *)*p;
+        p = (unsigned int *)*p;
+        p = (unsigned int *)*p;
+        p = (unsigned int *)*p;
+        p = (unsigned int *)*p;
+    }
+    return p;
+}
+
+// perm[i]: the node after i, one cycle (sattolo) over `count`
+static void chase_perm(unsigned int *perm, int count)
+{
+    unsigned int seed = 0x2545f491, t;
+    int i, j;
+
+    for (i = 0; i < count; i++)
+        perm[i] = i;
+    for (i = count - 1; i > 0; i--) {
+        j = xorshift32(&seed) % i;
+        t = perm[i];
+        perm[i] = perm[j];
+        perm[j] = t;
+    }
+}
+
+// the next index waits for the node, `zero` is 0 but not to the compiler
+static __itcm unsigned int perm_walk(unsigned int base, const unsigned int *perm,
+                                     int stride, int n)
+{
+    unsigned int idx = 0, v, zero = chase_zero;
+
+    while (n--) {
+        v = *(volatile unsigned int *)(base + idx * stride);
+        idx = perm[idx + (v & zero)];
+    }
+    return idx;
+}
+
+// cycles per load * 10 of one working set, `perm` for read-only ones
+static unsigned int chase_point(struct chase_region *r, int ws, int stride,
+                                unsigned int *perm)
+{
+    int count = ws / stride, n = count;
+    unsigned int start, cycles, idle, word = 0;
+
+    if (n < CHASE_MIN_LOADS)
+        n = CHASE_MIN_LOADS;
+
+    if (r->writable) {
+        chase_build(r->base, count, stride);
+        stream_sink = (unsigned int)chase((unsigned int *)r->base, count); // warm up
+        start = get_cycles();
+        stream_sink = (unsigned int)chase((unsigned int *)r->base, n);
+        cycles = get_cycles() - start;
+    } else {
+        chase_perm(perm, count);
+        stream_sink = perm_walk(r->base, perm, stride, count); // warm up
+        start = get_cycles();
+        stream_sink = perm_walk(r->base, perm, stride, n);
+        cycles = get_cycles() - start;
+
+        // word is on the stack, in DTCM
+        start = get_cycles();
+        stream_sink = perm_walk((unsigned int)&word, perm, 0, n);
+        idle = get_cycles() - start;
+        cycles = cycles > idle ? cycles - idle + n : n;
+    }
+    return cycles / n * 10 + cycles % n * 10 / n;
+}
+
+/**
+ * @brief load latency over working sets from 1KB up, per region,
+ *        dcache on and off, as CSV
+ */
+void memory_latency_test(int stride)
+{
+    extern QSPI_HandleTypeDef hqspi;
+    int dcache_was_on = SCB->CCR & SCB_CCR_DC_Msk;
+    int mhz = SystemCoreClock / 1000000;
+    unsigned int cpl, ns, *perm = NULL;
+    struct chase_region *r;
+    int i, ws, dcache;
+
+    if (stride < 4 || (stride & (stride - 1)))
+        stride = 64;
+
+    for (i = 0; i < ARRAY_SIZE(chase_regions); i++) {
+        r = &chase_regions[i];
+        if (r->arena >= 0)
+            r->base = (unsigned int)arena_alloc(r->arena, r->max, "mtest");
+        // the index table of qspi, the only read-only one
+        if (!r->writable && !perm)
+            perm = arena_alloc(ARENA_SDRAM, r->max / stride * 4, "mtest");
+    }
+
+    __HAL_RCC_D2SRAM1_CLK_ENABLE();
+    __HAL_RCC_D2SRAM2_CLK_ENABLE();
+    __HAL_RCC_D2SRAM3_CLK_ENABLE();
+    QSPI_W25Qxx_MMMode();
+
+    printk("region,dcache,stride,ws_bytes,cycles,ns");
+    for (dcache = 1; dcache >= 0; dcache--) {
+        if (dcache)
+            SCB_EnableDCache();
+        else
+            SCB_DisableDCache();
+
+        for (i = 0; i < ARRAY_SIZE(chase_regions); i++) {
+            if (!chase_regions[i].base || (!chase_regions[i].writable && !perm)) {
+                printk("# %s: no buffer", chase_regions[i].name);
+                continue;
+            }
+            for (ws = CHASE_MIN_WS; ws <= chase_regions[i].max; ws *= 2) {
+                if (ws / stride < 2)
+                    continue;
+                cpl = chase_point(&chase_regions[i], ws, stride, perm);
+                ns = cpl * 1000 / mhz;  // * 10
+                printk("%s,%s,%d,%d,%d.%d,%d.%d", chase_regions[i].name,
+                       dcache ? "on" : "off", stride, ws, cpl / 10, cpl % 10, ns / 10, ns % 10);
+            }
+        }
+    }
+
+    if (dcache_was_on)
+        SCB_EnableDCache();
+    HAL_QSPI_Abort(&hqspi);
+    QSPI_W25Qxx_Init();
+    for (i = 0; i < ARRAY_SIZE(chase_regions); i++)
+        if (chase_regions[i].arena >= 0)
+            arena_free((void *)chase_regions[i].base);
+    arena_free(perm);
+    printk("");
+}
@@ -0,0 +1,293 @@
+/**
+ * @file qspitune.c
+ * @brief qspi-flash clock and sampling point tuning
+ * @version 1.0
+ *
+ * a sector below the env holds a known pattern, nibble toggles on all
+ * four lines, walking bits and noise. each candidate reads it back
+ * QT_ROUNDS times indirect and memory mapped.
+ *
+ * the prescaler goes from the fastest the W25Q64 allows (133MHz) down,
+ * at each the sampling point moves in 1/12 clock steps, shift none or
+ * half a cycle plus a delay block phase. the first prescaler with a
+ * passing window of 2 * QT_MARGIN + 1 points wins, its center is kept
+ * in the env (qspitiming) and applied at boot, checked against the
+ * pattern, the built-in timing if that fails.
+ *
+ * the 0xEB read needs 2 mode and 4 dummy clocks at any clock, dummy
+ * cycles are the chip's, not tuned
+ */
+#include <stm32h7xx_hal.h>
+#include <stdio.h>
+#include <string.h>
+#include "bsp.h"
+#include "errno.h"
+#include "cmd.h"
+#include "qspi-flash.h"
+
+#define QT_SIZE         0x1000
+#define QT_ROUNDS       8
+#define QT_MARGIN       1           // passing points each side
+#define QT_POINTS       18          // 1/12 clock, 0..5 no shift, 6..17 half
+#define QT_DEFAULT      1, QSPI_SAMPLE_SHIFTING_HALFCYCLE, 0, 0
+
+extern QSPI_HandleTypeDef hqspi;
+
+static unsigned char qt_buf[QT_SIZE] __dma_buf __attribute__((aligned(32)));
+static unsigned char qt_expect[QT_SIZE] __dma_buf __attribute__((aligned(32)));
+
+static void qt_pattern(void)
+{
+    unsigned int seed = 0x1d872b41;
+    int i;
+
+    for (i = 0; i < QT_SIZE; i++) {
+        switch (i / (QT_SIZE / 4)) {
+        case 0:  // every line toggles every clock
+            qt_expect[i] = i & 1 ? 0x0f : 0xf0;
+            break;
+        case 1:  // neighbour lines opposite
+            qt_expect[i] = i & 1 ? 0x5a : 0xa5;
+            break;
+        case 2:  // one line against the others
+            qt_expect[i] = 0x11 << (i & 3) ^ (i & 4 ? 0xff : 0);
+            break;
+        default:
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            qt_expect[i] = seed;
+        }
+    }
+}
+
+/*
+ * sampling point `t` to shift and phase
+ */
+static void qt_point(int t, unsigned int *shift, unsigned int *phase)
+{
+    *shift = t < 6 ? QSPI_SAMPLE_SHIFTING_NONE : QSPI_SAMPLE_SHIFTING_HALFCYCLE;
+    *phase = t < 6 ? t : t - 6;
+}
+
+// delay block unit for a 12 phase period at the current clock
+static int qt_calibrate(void)
+{
+    if (DelayBlock_Enable(DLYB_QUADSPI) != HAL_OK)
+        return -ETIMEDOUT;
+    return (DLYB_QUADSPI->CFGR & DLYB_CFGR_UNIT) >> DLYB_CFGR_UNIT_Pos;
+}
+
+/*
+ * pattern reads at a timing, indirect and memory mapped
+ */
+static int qt_check(int rounds)
+{
+    const void *mapped = (void *)(QSPI_FLASH_BASE_ADDR + QSPI_TUNE_ADDR);
+    int i, ret = 0;
+
+    for (i = 0; i < rounds && !ret; i++) {
+        if (QSPI_W25Qxx_ReadBuffer(qt_buf, QSPI_TUNE_ADDR, QT_SIZE) ||
+            memcmp(qt_buf, qt_expect, QT_SIZE))
+            ret = -EIO;
+    }
+    if (ret || QSPI_W25Qxx_MMMode())
+        return -EIO;
+
+    for (i = 0; i < rounds && !ret; i++) {
+        SCB_InvalidateDCache_by_Addr((uint32_t *)mapped, QT_SIZE);
+        if (memcmp(mapped, qt_expect, QT_SIZE))
+            ret = -EIO;
+    }
+    HAL_QSPI_Abort(&hqspi);
+    return ret;
+}
+
+static int qt_try(int prescaler, unsigned int shift, unsigned int phase, int unit)
+{
+    QSPI_W25Qxx_SetTiming(prescaler, shift, phase, unit);
+    if (QSPI_W25Qxx_Init())
+        return -EIO;
+    return qt_check(QT_ROUNDS);
+}
+
+// memory mapped MB/s over the first 64KB
+int qspi_read_speed(void)
+{
+    const volatile unsigned int *p = (void *)QSPI_FLASH_BASE_ADDR;
+    unsigned int t;
+    int i;
+
+    if (QSPI_W25Qxx_MMMode())
+        return 0;
+    SCB_InvalidateDCache_by_Addr((uint32_t *)p, 0x10000);
+    t = get_cycles();
+    for (i = 0; i < 0x10000 / 4; i += 8)
+        (void)p[i];  // a load per line
+    t = get_cycles() - t;
+    HAL_QSPI_Abort(&hqspi);
+    QSPI_W25Qxx_Init();
+    return (int)(0x10000u * (SystemCoreClock / 1000000) / t);
+}
+
+/*
+ * write the pattern if it isn't there, at the built-in timing
+ */
+static int qt_prepare(void)
+{
+    qt_pattern();
+    QSPI_W25Qxx_SetTiming(QT_DEFAULT);
+    if (QSPI_W25Qxx_Init())
+        return -EIO;
+    if (!QSPI_W25Qxx_ReadBuffer(qt_buf, QSPI_TUNE_ADDR, QT_SIZE) &&
+        !memcmp(qt_buf, qt_expect, QT_SIZE))
+        return 0;
+
+    printk(KERN_INFO "qspitune: writing the pattern at 0x%06x", QSPI_TUNE_ADDR);
+    if (QSPI_W25Qxx_SectorErase(QSPI_TUNE_ADDR) ||
+        QSPI_W25Qxx_WriteBuffer(qt_expect, QSPI_TUNE_ADDR, QT_SIZE) ||
+        QSPI_W25Qxx_ReadBuffer(qt_buf, QSPI_TUNE_ADDR, QT_SIZE) ||
+        memcmp(qt_buf, qt_expect, QT_SIZE))
+        return -EIO;
+    return 0;
+}
+
+/*
+ * timing from the env, after env_init and after every kernel clock
+ * change, only at the kernel clock it was tuned at
+ */
+void qspi_timing_init(void)
+{
+    const char *s = env_get("qspitiming");
+    unsigned int prescaler, shift, phase, mhz;
+    int kernel = clk_qspi_freq() / 1000000;
+    int unit = 0, n;
+
+    if (!s)
+        return;
+    n = sscanf(s, "%u,%u,%u,%u", &prescaler, &shift, &phase, &mhz);
+    if (n < 3 || prescaler > 255 ||
+        (shift != QSPI_SAMPLE_SHIFTING_NONE && shift != QSPI_SAMPLE_SHIFTING_HALFCYCLE) ||
+        phase > 11) {
+        printk(KERN_WARNING "flash: bad qspitiming %s", s);
+        return;
+    }
+    // without the kernel clock it was tuned on HCLK at the boot clock
+    if (n < 4)
+        mhz = __HAL_RCC_GET_QSPI_SOURCE() != RCC_QSPICLKSOURCE_D1HCLK ||
+              SystemCoreClock == SYSCLK_FREQ * 1000000 ? kernel : 0;
+    if (mhz != kernel) {
+        printk(KERN_WARNING "flash: qspitiming is for a %uMHz kernel clock, not %dMHz",
+               mhz, kernel);
+        return;
+    }
+
+    qt_pattern();
+    QSPI_W25Qxx_SetTiming(prescaler, shift, 0, 0);
+    if (phase && !QSPI_W25Qxx_Init())
+        unit = qt_calibrate();
+    if (unit >= 0) {
+        QSPI_W25Qxx_SetTiming(prescaler, shift, phase, unit);
+        if (!QSPI_W25Qxx_Init() && !qt_check(1) && !QSPI_W25Qxx_Init()) {
+            printk(KERN_INFO "flash: tuned timing, %dMHz",
+                   clk_qspi_freq() / (int)(prescaler + 1) / 1000000);
+            return;
+        }
+    }
+
+    printk(KERN_WARNING "flash: tuned timing failed, back to defaults");
+    QSPI_W25Qxx_SetTiming(QT_DEFAULT);
+    QSPI_W25Qxx_Init();
+}
+
+static int qt_tune(void)
+{
+    int kernel = clk_qspi_freq();
+    int prescaler, unit, t, run, best, best_end;
+    unsigned int shift, phase;
+    char pass[QT_POINTS + 1], val[24];
+
+    prescaler = kernel / QSPI_FLASH_MAX_HZ;
+    if (prescaler < 1)
+        prescaler = 1;  // 0 breaks memory mapped reads
+
+    for (; prescaler <= 3; prescaler++) {
+        QSPI_W25Qxx_SetTiming(prescaler, QSPI_SAMPLE_SHIFTING_HALFCYCLE, 0, 0);
+        if (QSPI_W25Qxx_Init())
+            continue;
+        unit = qt_calibrate();
+
+        best = run = best_end = 0;
+        for (t = 0; t < QT_POINTS; t++) {
+            qt_point(t, &shift, &phase);
+            pass[t] = (!phase || unit >= 0) && !qt_try(prescaler, shift, phase, unit) ?
+                      'o' : 'x';
+            run = pass[t] == 'o' ? run + 1 : 0;
+            if (run > best) {
+                best = run;
+                best_end = t;
+            }
+        }
+
+        pass[QT_POINTS] = '\0';
+        printk("qspitune: %3dMHz, sampling point 0..%d: %s",
+               kernel / (prescaler + 1) / 1000000, QT_POINTS - 1, pass);
+
+        if (best >= 2 * QT_MARGIN + 1)
+            break;
+    }
+    if (prescaler > 3)
+        return -EIO;
+
+    // the center of the widest window
+    qt_point(best_end - (best - 1) / 2, &shift, &phase);
+    if (qt_try(prescaler, shift, phase, unit))
+        return -EIO;
+
+    scnprintf(val, sizeof(val), "%d,%u,%u,%d", prescaler, shift, phase, kernel / 1000000);
+    printk(KERN_INFO "qspitune: qspitiming=%s, %dMHz, %dMB/s", val,
+           kernel / (prescaler + 1) / 1000000, qspi_read_speed());
+    return env_set("qspitiming", val);
+}
+
+int do_qspitune(const char *buf)
+{
+    int idx = 0, ret;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+
+    if (!strncmp(&buf[idx], "reset", 5)) {
+        QSPI_W25Qxx_SetTiming(QT_DEFAULT);
+        QSPI_W25Qxx_Init();
+        ret = env_set("qspitiming", NULL);
+        return ret ? ret : env_save();
+    }
+
+    ret = qt_prepare();
+    if (ret) {
+        printk(KERN_ERR "qspitune: no pattern at 0x%06x", QSPI_TUNE_ADDR);
+        return ret;
+    }
+    printk("qspitune: built-in timing %dMB/s", qspi_read_speed());
+
+    ret = qt_tune();
+    if (ret) {
+        printk(KERN_ERR "qspitune: no stable timing, back to defaults");
+        QSPI_W25Qxx_SetTiming(QT_DEFAULT);
+        QSPI_W25Qxx_Init();
+        return ret;
+    }
+    // the env is written at the new timing
+    QSPI_W25Qxx_Init();
+    return env_save();
+}
+
+void help_qspitune(void)
+{
+    printsh("qspitune [reset]");
+    printsh("sweep qspi clock, sample shift and delay block phase on a pattern sector,");
+    printsh("keep the center of the widest stable window at the fastest clock in the env");
+}
+SHELL_EXPORT_CMD(qspitune, help_qspitune, do_qspitune);
@@ -0,0 +1,313 @@
+/**
+ * @file script.c
+ * @brief command lists and boot scripts
+ * @version 1.0
+ *
+ * a line holds commands separated by ';', '&&' or '||', the last two
+ * test the return code of the previous command like sh does,
+ * a script is such lines separated by '\n', '#' starts a comment line
+ *
+ *      update fdt && update kernel && boot || echo
+ *
+ * `bootcmd` runs after `bootdelay` seconds unless a key is hit,
+ * both are env variables, quote them to keep the separators:
+ *
+ *      env set bootcmd 'update kernel && boot'
+ */
+#include <stm32h7xx_hal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bsp.h"
+#include "errno.h"
+#include "cmd.h"
+#include "qspi-flash.h"
+
+#define SCRIPT_LINE_MAX    128
+#define SCRIPT_MAX_SIZE    2048
+
+#define __stringify_1(x)   #x
+#define __stringify(x)     __stringify_1(x)
+
+/*
+ * defaults of the variables scripts use, the env overrides them
+ */
+static const struct {
+    const char *name;
+    const char *val;
+} vars[] = {
+    { "bootcmd",   CONFIG_BOOTCMD },
+    { "bootdelay", __stringify(CONFIG_BOOTDELAY) },
+};
+
+const char *script_getvar(const char *name, int len)
+{
+    char key[32];
+    const char *val;
+    int i;
+
+    if (len >= (int)sizeof(key))
+        return NULL;
+    memcpy(key, name, len);
+    key[len] = '\0';
+
+    val = env_get(key);
+    if (val)
+        return val;
+    for (i = 0; i < ARRAY_SIZE(vars); i++)
+        if (!strcmp(vars[i].name, key))
+            return vars[i].val;
+    return NULL;
+}
+
+/**
+ * run one command, returns what the command returns
+ * a ".b" / ".w" / ".l" suffix of the name is left to the command
+ */
+int run_command(const char *buf)
+{
+    const struct cmd *cmd;
+    int len = strcspn(buf, " .");
+
+    if (!len)
+        return 0;
+
+    cmd = find_cmd(buf, len);
+    if (!cmd) {
+        printk(KERN_ERR "%.*s: no such a command", len, buf);
+        return -ENOENT;
+    }
+    return cmd->exec(buf);
+}
+
+/*
+ * length of the command at `s`, up to a separator,
+ * separators inside '' or "" don't count
+ */
+static int command_len(const char *s)
+{
+    int len = 0;
+    char quote = 0;
+
+    for (; s[len] && s[len] != '\n'; len++) {
+        if (quote) {
+            if (s[len] == quote)
+                quote = 0;
+            continue;
+        }
+        if (s[len] == '\'' || s[len] == '"')
+            quote = s[len];
+        else if (s[len] == ';' ||
+                 (s[len] == '&' && s[len+1] == '&') ||
+                 (s[len] == '|' && s[len+1] == '|'))
+            break;
+    }
+    return len;
+}
+
+/**
+ * run a command list or a whole script
+ *
+ * `timed`: log each command with its return code and duration,
+ *          ctrl-c aborts
+ * returns the code of the last command that ran
+ */
+int run_command_list(const char *s, int timed)
+{
+    char line[SCRIPT_LINE_MAX];
+    int ret = 0, skip = 0;
+    int len, start;
+
+    while (*s) {
+        while (*s == ' ' || *s == '\t' || *s == '\r')
+            s++;
+        if (*s == '#') {
+            s += strcspn(s, "\n");
+            continue;
+        }
+
+        len = command_len(s);
+        if (len >= SCRIPT_LINE_MAX) {
+            printk(KERN_ERR "script: line too long: %.*s...", 16, s);
+            return -E2BIG;
+        }
+        memcpy(line, s, len);
+        while (len && (line[len-1] == ' ' || line[len-1] == '\r'))
+            len--;
+        line[len] = '\0';
+        s += command_len(s);
+
+        if (!skip && line[0]) {
+            // ctrl-c between two commands stops a script
+            if (timed && console_ctrlc()) {
+                printk(KERN_WARNING "script: interrupted");
+                return -EINTR;
+            }
+            start = HAL_GetTick();
+            ret = run_command(line);
+            if (timed)
+                printk(KERN_INFO "script: %s = %d, %dms", line, ret,
+                        (int)HAL_GetTick() - start);
+        }
+
+        if (*s == '&') {
+            skip = ret != 0;
+            s += 2;
+        } else if (*s == '|') {
+            skip = ret == 0;
+            s += 2;
+        } else if (*s) {
+            skip = 0;
+            s++;
+        }
+    }
+    return ret;
+}
+
+/**
+ * count down `bootdelay` seconds, then run `bootcmd`
+ * returns if a key is hit or `bootcmd` returns
+ */
+void autoboot(void)
+{
+    const char *delay_str = script_getvar("bootdelay", 9);
+    const char *bootcmd = script_getvar("bootcmd", 7);
+    int delay = delay_str ? atoi(delay_str) : -1;
+
+    if (delay < 0 || !bootcmd)
+        return;
+
+    printf("Hit any key to stop autoboot: %2d", delay);
+    for (;;) {
+        if (console_getc(delay ? 1000 : 0) >= 0) {
+            printf("\r\n");
+            return;
+        }
+        if (!delay)
+            break;
+        printf("\b\b%2d", --delay);
+    }
+    printf("\r\n");
+
+    run_command_list(bootcmd, 1);
+}
+
+
+/*
+ * source: run a script from sdcard or memory
+ */
+static char script_buf[SCRIPT_MAX_SIZE] __dma_buf __attribute__((aligned(32)));
+static int script_busy;
+
+static int script_read_mem(unsigned int addr)
+{
+    extern QSPI_HandleTypeDef hqspi;
+    unsigned int qspi_end = QSPI_FLASH_BASE_ADDR + QSPI_FLASH_SIZE_MB * 0x100000;
+    int room, len;
+
+    // qspi-flash or ram, nothing past their end
+    if (addr >= QSPI_FLASH_BASE_ADDR && addr < qspi_end)
+        room = qspi_end - addr;
+    else
+        room = mem_room(addr);
+    if (room < 0)
+        return room;
+    if (room > SCRIPT_MAX_SIZE - 1)
+        room = SCRIPT_MAX_SIZE - 1;
+
+    // qspi-flash isn't memory mapped in the shell, unless `qftool map`
+    if (addr >= QSPI_FLASH_BASE_ADDR && addr < qspi_end &&
+        HAL_QSPI_GetState(&hqspi) != HAL_QSPI_STATE_BUSY_MEM_MAPPED) {
+        if (QSPI_W25Qxx_ReadBuffer((uint8_t *)script_buf, addr - QSPI_FLASH_BASE_ADDR, room))
+            return -EIO;
+    } else {
+        memcpy(script_buf, (void *)addr, room);
+    }
+
+    // ends at '\0', erased flash or the end of the memory
+    for (len = 0; len < room; len++)
+        if (script_buf[len] == '\0' || script_buf[len] == (char)0xff)
+            break;
+    return len;
+}
+
+int do_source(const char *buf)
+{
+    int idx = 0, addr, len, ret;
+    const char *arg;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+    arg = &buf[idx];
+
+    if (!arg[0])
+        return -EINVAL;
+    // scripts share one buffer
+    if (script_busy)
+        return -EBUSY;
+
+    if (!strncmp(arg, "0x", 2)) {
+        addr = strtoul(arg, NULL, 16);
+        len = script_read_mem(addr);
+    } else {
+        ret = sdmmc_load_file(arg, script_buf, SCRIPT_MAX_SIZE - 1, &len);
+        if (ret)
+            return ret;
+    }
+    if (len < 0)
+        return len;
+    script_buf[len] = '\0';
+
+    script_busy = 1;
+    ret = run_command_list(script_buf, 1);
+    script_busy = 0;
+    return ret;
+}
+
+void help_source(void)
+{
+    printsh("source <file / 0x<address>>");
+    printsh("run a script: commands separated by newline ; && ||");
+    printsh("e.g. source 0:boot.scr, source 0x90700000");
+}
+SHELL_EXPORT_CMD(source, help_source, do_source);
+
+/*
+ * run: run the commands in a variable
+ */
+int do_run(const char *buf)
+{
+    int idx = 0, len, ret = 0;
+    const char *val;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+
+    if (!buf[idx])
+        return -EINVAL;
+
+    while (buf[idx] != '\0') {
+        len = strcspn(&buf[idx], " ");
+        val = script_getvar(&buf[idx], len);
+        if (!val) {
+            printk(KERN_ERR "run: %.*s not defined", len, &buf[idx]);
+            return -ENOENT;
+        }
+        ret = run_command_list(val, 1);
+        if (ret)
+            return ret;
+        idx += len;
+        while (buf[idx] == ' ') idx++;
+    }
+    return ret;
+}
+
+void help_run(void)
+{
+    printsh("run <var> [var ...]");
+    printsh("run the command list in variables, stop at the first failure");
+    printsh("e.g. run bootcmd");
+}
+SHELL_EXPORT_CMD(run, help_run, do_run);
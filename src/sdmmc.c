@@ -1,5 +1,5 @@
+#include <stm32h7xx_hal.h>
 #include <stdio.h>
-#include <malloc.h>
 #include "sdmmc_sd.h"
 #include "ff.h"
 #include "ff_gen_drv.h"
@@ -7,7 +7,12 @@
 #include "bsp.h"
 #include "errno.h"
 
-static FATFS sdmmc_fatfs;
+/*
+ * the volume and the one open file, 4KB sector windows each, in AXI
+ * SRAM where the card's IDMA reaches them, not on the DTCM stack
+ */
+static FATFS sdmmc_fatfs __dma_buf __attribute__((aligned(32)));
+static FIL sdmmc_file __dma_buf __attribute__((aligned(32)));
 
 /**
  * get total and free volume of sdcard
@@ -33,14 +38,15 @@ static void sdmmc_get_capacity(void)
     total_capacity = total_sector / 1024 / 1024 * byte_per_sector;
 
     if (free_capacity > 4096)
-        printk(KERN_INFO "sdmmc: free: %3.1fGB, total: %3.1fGB", 
-                (float)free_capacity/1024, (float)total_capacity/1024);
+        printk(KERN_INFO "sdmmc: free: %d.%dGB, total: %d.%dGB",
+                free_capacity / 1024, free_capacity % 1024 * 10 / 1024,
+                total_capacity / 1024, total_capacity % 1024 * 10 / 1024);
     else if (total_capacity < 4096)
         printk(KERN_INFO "sdmmc: free: %dMB, total: %dMB", 
                 free_capacity, total_capacity);
     else {
-        printk(KERN_INFO "sdmmc: free: %dMB, total: %3.1fGB", 
-                free_capacity, (float)total_capacity/1024);
+        printk(KERN_INFO "sdmmc: free: %dMB, total: %d.%dGB",
+                free_capacity, total_capacity / 1024, total_capacity % 1024 * 10 / 1024);
     }
 }
 
@@ -51,7 +57,6 @@ static void sdmmc_get_capacity(void)
 void sdmmc_mount(void)
 {
     char path[4];
-    BYTE work[FF_MAX_SS];
     FRESULT fs_ret;
 
     FATFS_LinkDriver(&SD_Driver, path);
@@ -67,38 +72,226 @@ void sdmmc_mount(void)
 
 
 /*
- * read kernel image from sdmmc
+ * read whole contiguous sectors with one disk_read each,
+ * bypassing the per-cluster split of f_read
+ *
+ * fastseek link map: [size, (clusters, start cluster) * n, 0]
+ * one fragment means the file is contiguous on disk
  */
-int sdmmc_read_file(const char *file_name, unsigned char **file_obj, int *file_size)
+#define SD_BLOCK_SIZE   512
+#define SD_MAX_BLOCKS   0x8000  // 16MB per transfer, IDMA DLEN limit is 32MB
+
+static int sdmmc_read_contiguous(FIL *file, unsigned char *buf, int size)
+{
+    FATFS *fs = file->obj.fs;
+    DWORD clmt[4] = {0};
+    DWORD sector;
+    int blocks, n;
+
+    file->cltbl = clmt;
+    clmt[0] = sizeof(clmt) / sizeof(clmt[0]);
+    if (f_lseek(file, CREATE_LINKMAP) != FR_OK || clmt[3] != 0) {
+        file->cltbl = NULL;
+        return 0; // fragmented
+    }
+    file->cltbl = NULL;
+
+    sector = fs->database + (clmt[2] - 2) * fs->csize;
+    blocks = size / SD_BLOCK_SIZE;
+
+    for (n = 0; n < blocks; n += SD_MAX_BLOCKS) {
+        if (disk_read(fs->pdrv, buf + n * SD_BLOCK_SIZE, sector + n,
+                (blocks - n) > SD_MAX_BLOCKS ? SD_MAX_BLOCKS : (blocks - n)) != RES_OK)
+            return -EIO;
+    }
+    return blocks * SD_BLOCK_SIZE;
+}
+
+/**
+ * raw read speed of the card, `len` bytes from sector 0 into `buf`
+ * returns bytes per ms, ~KB/s
+ */
+int sdmmc_read_speed(void *buf, int len)
+{
+    int blocks = len / SD_BLOCK_SIZE, n, ms;
+    int start = HAL_GetTick();
+
+    if (!sdmmc_fatfs.fs_type)
+        return -ENODEV;
+
+    for (n = 0; n < blocks; n += SD_MAX_BLOCKS) {
+        if (disk_read(sdmmc_fatfs.pdrv, (BYTE *)buf + n * SD_BLOCK_SIZE, n,
+                (blocks - n) > SD_MAX_BLOCKS ? SD_MAX_BLOCKS : (blocks - n)) != RES_OK)
+            return -EIO;
+    }
+    ms = HAL_GetTick() - start;
+    return ms ? blocks * SD_BLOCK_SIZE / ms : 0;
+}
+
+/**
+ * load file into memory at `addr`, at most `max_size` bytes
+ *
+ * DMA needs a 32B aligned buffer in AXI SRAM or SDRAM, then contiguous files
+ * are read in a few multi-block transfers, otherwise falls back to f_read
+ */
+int sdmmc_load_file(const char *file_name, void *addr, int max_size, int *file_size)
 {
     FRESULT fs_ret;
-    FIL file;
+    FIL *file = &sdmmc_file;
     UINT bytes_read;
+    int size, done = 0;
+    int start = HAL_GetTick(), ms;
 
     // open file
-    fs_ret = f_open(&file, file_name, FA_OPEN_EXISTING | FA_READ);
+    fs_ret = f_open(file, file_name, FA_OPEN_EXISTING | FA_READ);
     if (fs_ret != FR_OK) {
-        printk(KERN_ERR "file doesn't exist");
+        printk(KERN_ERR "%s: file doesn't exist", file_name);
         return -ENOENT;
     }
 
-    // alloc buffer
-    *file_obj = (unsigned char *)SDRAM_BASE_ADDR;
-    if (*file_obj == NULL) {
-        f_close(&file);
-        printk(KERN_ERR "memory alloc failed for file");
-        return -ENOMEM;
+    size = f_size(file);
+    if (size > max_size) {
+        printk(KERN_ERR "%s: %d bytes exceeds %d", file_name, size, max_size);
+        f_close(file);
+        return -EFBIG;
+    }
+
+    if (!((int)addr & 31)) {
+        done = sdmmc_read_contiguous(file, addr, size);
+        if (done < 0) {
+            printk(KERN_ERR "%s: failed in reading sectors", file_name);
+            f_close(file);
+            return -EIO;
+        }
     }
 
-    // read
-    fs_ret = f_read(&file, *file_obj, f_size(&file), &bytes_read);
-    if (fs_ret != FR_OK || bytes_read != f_size(&file)) {
-        printk(KERN_ERR "failed in reading file");
-        f_close(&file);
+    // fragmented file or the last partial sector
+    if (done < size) {
+        fs_ret = f_lseek(file, done);
+        if (fs_ret == FR_OK)
+            fs_ret = f_read(file, (unsigned char *)addr + done, size - done, &bytes_read);
+        if (fs_ret != FR_OK || bytes_read != size - done) {
+            printk(KERN_ERR "%s: failed in reading file", file_name);
+            f_close(file);
+            return -EIO;
+        }
+    }
+    f_close(file);
+
+    ms = HAL_GetTick() - start;
+    printk(KERN_INFO "sdmmc: %s -> 0x%08x, %dKB in %dms (%d.%dMB/s)", file_name,
+            (int)addr, size / 1024, ms, ms ? size / ms / 1000 : 0,
+            ms ? size / ms / 100 % 10 : 0);
+
+    *file_size = size;
+    return 0;
+}
+
+/**
+ * write `size` bytes at `addr` into a new file
+ *
+ * clusters are allocated contiguous up front with f_expand, then the
+ * whole sectors go straight to the card in a few multi-block DMA
+ * writes, f_write only does the last partial sector
+ */
+int sdmmc_save_file(const char *file_name, const void *addr, int size)
+{
+    FRESULT fs_ret;
+    FIL *file = &sdmmc_file;
+    FATFS *fs;
+    UINT written = 0;
+    DWORD sector;
+    int blocks, n, done = 0;
+    int start = HAL_GetTick(), ms;
+
+    fs_ret = f_open(file, file_name, FA_CREATE_ALWAYS | FA_WRITE);
+    if (fs_ret != FR_OK) {
+        printk(KERN_ERR "%s: failed to create, %d", file_name, fs_ret);
+        return -EIO;
+    }
+
+    fs_ret = size ? f_expand(file, size, 1) : FR_OK;
+    if (fs_ret != FR_OK) {
+        printk(KERN_ERR "%s: no %dKB contiguous space", file_name, size / 1024);
+        f_close(file);
+        f_unlink(file_name);
+        return -ENOSPC;
+    }
+
+    // DMA needs a 32B aligned buffer in AXI SRAM or SDRAM
+    if (size && !((int)addr & 31)) {
+        fs = file->obj.fs;
+        sector = fs->database + (file->obj.sclust - 2) * fs->csize;
+        blocks = size / SD_BLOCK_SIZE;
+
+        for (n = 0; n < blocks; n += SD_MAX_BLOCKS) {
+            if (disk_write(fs->pdrv, (const BYTE *)addr + n * SD_BLOCK_SIZE, sector + n,
+                    (blocks - n) > SD_MAX_BLOCKS ? SD_MAX_BLOCKS : (blocks - n)) != RES_OK) {
+                printk(KERN_ERR "%s: failed in writing sectors", file_name);
+                f_close(file);
+                // the expanded file would keep whatever the sectors held
+                f_unlink(file_name);
+                return -EIO;
+            }
+        }
+        done = blocks * SD_BLOCK_SIZE;
+    }
+
+    fs_ret = f_lseek(file, done);
+    if (fs_ret == FR_OK && done < size)
+        fs_ret = f_write(file, (const BYTE *)addr + done, size - done, &written);
+    if (fs_ret == FR_OK)
+        fs_ret = f_close(file);
+    else
+        f_close(file);
+    if (fs_ret != FR_OK || (done < size && written != (UINT)(size - done))) {
+        printk(KERN_ERR "%s: failed in writing file", file_name);
+        f_unlink(file_name);
         return -EIO;
     }
 
-    *file_size = f_size(&file);
-    f_close(&file);
+    ms = HAL_GetTick() - start;
+    printk(KERN_INFO "sdmmc: 0x%08x -> %s, %dKB in %dms (%d.%dMB/s)", (int)addr,
+            file_name, size / 1024, ms, ms ? size / ms / 1000 : 0,
+            ms ? size / ms / 100 % 10 : 0);
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * size and fat date / time of a file, tells warmboot a file was replaced
+ */
+int sdmmc_file_stamp(const char *file_name, int *size, unsigned int *stamp)
+{
+    FILINFO info;
+
+    if (f_stat(file_name, &info) != FR_OK)
+        return -ENOENT;
+    *size = info.fsize;
+    *stamp = (unsigned int)info.fdate << 16 | info.ftime;
+    return 0;
+}
+
+/*
+ * read an image from sdmmc into an SDRAM buffer owned by `file_name`,
+ * arena_free it when done
+ */
+int sdmmc_read_file(const char *file_name, unsigned char **file_obj, int *file_size)
+{
+    FILINFO info;
+    int ret;
+
+    if (f_stat(file_name, &info) != FR_OK) {
+        printk(KERN_ERR "%s: file doesn't exist", file_name);
+        return -ENOENT;
+    }
+    *file_obj = arena_alloc(ARENA_SDRAM, info.fsize, file_name);
+    if (!*file_obj)
+        return -ENOMEM;
+
+    ret = sdmmc_load_file(file_name, *file_obj, info.fsize, file_size);
+    if (ret) {
+        arena_free(*file_obj);
+        *file_obj = NULL;
+    }
+    return ret;
+}
@@ -9,10 +9,15 @@
  */
 #include <stm32h7xx_hal.h>
 #include <stdio.h>
+#include <string.h>
 #include "bsp.h"
+#include "errno.h"
+#include "cmd.h"
 
 
 #define SDRAM_TIMEOUT                ((uint32_t)0x1000)
+// 64ms刷新8192行, 减20留余量
+#define SDRAM_REFRESH_COUNT(sdclk)   ((sdclk) / 1000 * 64 / 8192 - 20)
 // burst length
 #define SDRAM_MRD_BL_1               ((uint16_t)0x0000)
 #define SDRAM_MRD_BL_2               ((uint16_t)0x0001)
@@ -29,6 +34,8 @@
 #define SDRAM_MRD_WB_MODE_SINGLE     ((uint16_t)0x0200)
 // op mode默认为正常模式
 
+static SDRAM_HandleTypeDef hsdram1;
+
 /**
  * 初始化fmc-sdram引脚
  *     PF0  ---> FMC_A0        PD14 ---> FMC_D0       PC0  ---> FMC_SDNWE
@@ -92,8 +99,12 @@ void HAL_SDRAM_MspInit(SDRAM_HandleTypeDef *hsdram)
 /**
  * SDRAM相关时序和控制方式配置 - SDCMR
  */
-static void sdram_send_command(SDRAM_HandleTypeDef *hsdram)
+static void sdram_send_command(SDRAM_HandleTypeDef *hsdram, int cas, int bl)
 {
+        static const unsigned short mrd_bl[] = {
+                [1] = SDRAM_MRD_BL_1, [2] = SDRAM_MRD_BL_2,
+                [4] = SDRAM_MRD_BL_4, [8] = SDRAM_MRD_BL_8,
+        };
         FMC_SDRAM_CommandTypeDef cmd;
 /* 时钟使能 */
         cmd.CommandMode = FMC_SDRAM_CMD_CLK_ENABLE;
@@ -105,21 +116,70 @@ static void sdram_send_command(SDRAM_HandleTypeDef *hsdram)
 /* 预充电 */
         cmd.CommandMode = FMC_SDRAM_CMD_PALL;
         HAL_SDRAM_SendCommand(hsdram, &cmd, SDRAM_TIMEOUT);
-/* 自动刷新 */
+/* 自动刷新, 手册要求上电后8次 */
         cmd.CommandMode = FMC_SDRAM_CMD_AUTOREFRESH_MODE;
         cmd.AutoRefreshNumber = 8;
         HAL_SDRAM_SendCommand(hsdram, &cmd, SDRAM_TIMEOUT);
-/* 加载模式 */
+/* 加载模式, CAS要和FMC的一致 */
         cmd.CommandMode = FMC_SDRAM_CMD_LOAD_MODE;
         cmd.AutoRefreshNumber = 1;
-        cmd.ModeRegisterDefinition = SDRAM_MRD_BL_2 | SDRAM_MRD_BT_SEQUENTIAL |
-                SDRAM_MRD_CAS_LATENCY_3 | SDRAM_MRD_WB_MODE_SINGLE;
+        cmd.ModeRegisterDefinition = mrd_bl[bl] | SDRAM_MRD_BT_SEQUENTIAL |
+                (cas == 2 ? SDRAM_MRD_CAS_LATENCY_2 : SDRAM_MRD_CAS_LATENCY_3) |
+                SDRAM_MRD_WB_MODE_SINGLE;
         HAL_SDRAM_SendCommand(hsdram, &cmd, SDRAM_TIMEOUT);
 }
 
+/*
+ * 可调的时序, 单位是SDRAM时钟周期, env `sdramtiming` 保存
+ * "div,cas,rpipe,rcd,rp,twr,bl", 由sdramtune得出
+ */
+struct sdram_cfg {
+        int div;        // SDCLK = FMC时钟 / div, 2 or 3
+        int cas;        // 1 - 3
+        int rpipe;      // 读数据延迟的FMC时钟数, 0 - 2
+        int rcd;
+        int rp;
+        int twr;
+        int bl;         // 模式寄存器的突发长度, 1 2 4 8
+};
+
+static const struct sdram_cfg sdram_default = { 2, 3, 1, 2, 2, 3, 2 };
+static struct sdram_cfg sdram_cur;
+static int sdram_tuned;
+
+// 不调的时序, 手册值按最快时钟取整
+#define SDRAM_TMRD      2
+#define SDRAM_TXSR      7
+#define SDRAM_TRAS      4
+#define SDRAM_TRC       7
+// 手册: W9825G6KH-6, CL2到133MHz, tRCD tRP 15ns, tWR 2个时钟
+#define SDRAM_CL2_MAX_HZ        133000000
+#define SDRAM_TRCD_NS           15
+#define SDRAM_TRP_NS            15
+#define SDRAM_TWR_CLK           2
+
+// FMC要求 TWR >= TRAS - TRCD 且 TWR >= TRC - TRCD - TRP
+static int sdram_twr_min(const struct sdram_cfg *cfg)
+{
+        int min = SDRAM_TRAS - cfg->rcd;
+
+        if (min < SDRAM_TRC - cfg->rcd - cfg->rp)
+                min = SDRAM_TRC - cfg->rcd - cfg->rp;
+        return min > 1 ? min : 1;
+}
+
+static int sdram_cfg_valid(const struct sdram_cfg *cfg)
+{
+        // W9825G6KH只支持CL2和CL3
+        return cfg->div >= 2 && cfg->div <= 3 && cfg->cas >= 2 && cfg->cas <= 3 &&
+               cfg->rpipe >= 0 && cfg->rpipe <= 2 && cfg->rcd >= 1 && cfg->rcd <= 16 &&
+               cfg->rp >= 1 && cfg->rp <= 16 && cfg->twr >= 1 && cfg->twr <= 16 &&
+               (cfg->bl == 1 || cfg->bl == 2 || cfg->bl == 4 || cfg->bl == 8);
+}
+
 /* 初始化FMC和SDRAM配置
  *
- * 2分频-100MHz | 开启突发传输 | 读延迟-实际测此位可以设置无需延迟
+ * 2分频-120MHz | 开启突发传输 | 读延迟-实际测此位可以设置无需延迟
  *
  * 每行刷新所需时钟数
  * ! 如果在接受读取请求时发生内部刷新请求
@@ -127,42 +187,290 @@ static void sdram_send_command(SDRAM_HandleTypeDef *hsdram)
  * ! 目前公认的sdram中电容保存数据的上限是64ms, 即刷新周期64ms
  *
  * 刷新周期 / 行数 * 时钟速度 – 20 = 64ms / 8192 * 120MHz (or 1.2 x 10^5/ms) - 20 = 917.5
+ * 按实际SDCLK计算, 分频改了也不超64ms
+ *
+ * 已初始化时先关FMC再重配, SDRAM内容不保留
  */
-void sdram_init(void)
+static int sdram_configure(const struct sdram_cfg *cfg)
 {
+        static const unsigned int cas[] = { 0, FMC_SDRAM_CAS_LATENCY_1,
+                FMC_SDRAM_CAS_LATENCY_2, FMC_SDRAM_CAS_LATENCY_3 };
+        static const unsigned int rpipe[] = { FMC_SDRAM_RPIPE_DELAY_0,
+                FMC_SDRAM_RPIPE_DELAY_1, FMC_SDRAM_RPIPE_DELAY_2 };
         FMC_SDRAM_TimingTypeDef timing;
-        SDRAM_HandleTypeDef hsdram1;
+        int sdclk = clk_fmc_freq() / cfg->div;
+        int twr_min;
+
+        sdram_cur = *cfg;
+        twr_min = sdram_twr_min(&sdram_cur);
+        if (sdram_cur.twr < twr_min)
+                sdram_cur.twr = twr_min;
+
+        if (hsdram1.State != HAL_SDRAM_STATE_RESET) {
+                SCB_CleanInvalidateDCache();
+                __FMC_DISABLE();
+                HAL_SDRAM_DeInit(&hsdram1);
+        }
 
         hsdram1.Instance    = FMC_SDRAM_DEVICE;
         hsdram1.Init.SDBank = FMC_SDRAM_BANK1;
-        hsdram1.Init.ReadPipeDelay = FMC_SDRAM_RPIPE_DELAY_1;
+        hsdram1.Init.ReadPipeDelay = rpipe[sdram_cur.rpipe];
         hsdram1.Init.ReadBurst     = FMC_SDRAM_RBURST_ENABLE;
-        hsdram1.Init.SDClockPeriod = FMC_SDRAM_CLOCK_PERIOD_2;
+        hsdram1.Init.SDClockPeriod = sdram_cur.div == 3 ? FMC_SDRAM_CLOCK_PERIOD_3 :
+                                                          FMC_SDRAM_CLOCK_PERIOD_2;
         hsdram1.Init.WriteProtection    = FMC_SDRAM_WRITE_PROTECTION_DISABLE;
-        hsdram1.Init.CASLatency         = FMC_SDRAM_CAS_LATENCY_3;
+        hsdram1.Init.CASLatency         = cas[sdram_cur.cas];
         hsdram1.Init.InternalBankNumber = FMC_SDRAM_INTERN_BANKS_NUM_4;
         hsdram1.Init.MemoryDataWidth    = FMC_SDRAM_MEM_BUS_WIDTH_16;
         hsdram1.Init.RowBitsNumber      = FMC_SDRAM_ROW_BITS_NUM_13;
         hsdram1.Init.ColumnBitsNumber   = FMC_SDRAM_COLUMN_BITS_NUM_9;
-/* FMC使用的HCLK3时钟，200MHz，用于SDRAM的话，至少2分频，也就是100MHz，即1个SDRAM时钟周期是10ns
- * 下面参数单位均为10ns
- */     timing.LoadToActiveDelay    = 2; // 20ns, TMRD定义加载模式寄存器的命令与激活命令或刷新命令之间的延迟
-        timing.ExitSelfRefreshDelay = 7; // 70ns, TXSR定义从发出自刷新命令到发出激活命令之间的延迟
-        timing.SelfRefreshTime      = 4; // 50ns, TRAS定义最短的自刷新周期
-        timing.RowCycleDelay        = 7; // 70ns, TRC定义刷新命令和激活命令之间的延迟
-        timing.WriteRecoveryTime    = 3; // 30ns, TWR定义在写命令和预充电命令之间的延迟
-        timing.RPDelay              = 2; // 20ns, TRP定义预充电命令与其它命令之间的延迟
-        timing.RCDDelay             = 2; // 20ns, TRCD定义激活命令与读/写命令之间的延迟
+/* FMC使用的HCLK3时钟，240MHz，用于SDRAM的话，至少2分频，也就是120MHz，即1个SDRAM时钟周期是8.3ns
+ * 下面参数单位均为SDRAM时钟周期
+ */     timing.LoadToActiveDelay    = SDRAM_TMRD; // TMRD定义加载模式寄存器的命令与激活命令或刷新命令之间的延迟
+        timing.ExitSelfRefreshDelay = SDRAM_TXSR; // TXSR定义从发出自刷新命令到发出激活命令之间的延迟
+        timing.SelfRefreshTime      = SDRAM_TRAS; // TRAS定义最短的自刷新周期
+        timing.RowCycleDelay        = SDRAM_TRC;  // TRC定义刷新命令和激活命令之间的延迟
+        timing.WriteRecoveryTime    = sdram_cur.twr; // TWR定义在写命令和预充电命令之间的延迟
+        timing.RPDelay              = sdram_cur.rp;  // TRP定义预充电命令与其它命令之间的延迟
+        timing.RCDDelay             = sdram_cur.rcd; // TRCD定义激活命令与读/写命令之间的延迟
 /* 初始化FMC接口
  * 配置命令和刷新率
+ * 软复位前已进入自刷新时, 这套时钟使能/预充电/刷新/加载模式的流程会退出自刷新且不破坏内容
  */     if (HAL_SDRAM_Init(&hsdram1, &timing))
-            printk(KERN_ERR "sdram: init failed");
+                return -EIO;
+
+        sdram_send_command(&hsdram1, sdram_cur.cas, sdram_cur.bl);
+
+        if (HAL_SDRAM_ProgramRefreshRate(&hsdram1, SDRAM_REFRESH_COUNT(sdclk)))
+                return -EIO;
+        return 0;
+}
+
+/*
+ * env里的时序, 没有或不合法时用默认值
+ */
+static int sdram_cfg_load(struct sdram_cfg *cfg)
+{
+        const char *s = env_get("sdramtiming");
+        struct sdram_cfg c;
+
+        if (!s || sscanf(s, "%d,%d,%d,%d,%d,%d,%d", &c.div, &c.cas, &c.rpipe,
+                         &c.rcd, &c.rp, &c.twr, &c.bl) != 7)
+                return 0;
+        if (!sdram_cfg_valid(&c)) {
+                printk(KERN_WARNING "sdram: bad sdramtiming %s", s);
+                return 0;
+        }
+        *cfg = c;
+        return 1;
+}
+
+void sdram_init(void)
+{
+        struct sdram_cfg cfg = sdram_default;
+
+        sdram_tuned = sdram_cfg_load(&cfg);
+        if (sdram_configure(&cfg))
+                printk(KERN_ERR "sdram: init failed");
+        else
+                printk(KERN_INFO "sdram: configure success%s", sdram_tuned ? ", tuned timing" : "");
+}
+
+/**
+ * 调过的时序没通过自检时退回默认值, 已经是默认值返回 -ENOENT
+ */
+int sdram_fallback(void)
+{
+        if (!sdram_tuned)
+                return -ENOENT;
+        sdram_tuned = 0;
+        printk(KERN_WARNING "sdram: tuned timing failed, back to defaults");
+        return sdram_configure(&sdram_default);
+}
+
+int sdram_clock(void)
+{
+        return clk_fmc_freq() / sdram_cur.div;
+}
+
+/*
+ * FMC内核时钟为 `fmc_hz` 时的刷新计数, 切换CPU时钟前后调用
+ */
+void sdram_refresh(int fmc_hz)
+{
+        int count = SDRAM_REFRESH_COUNT(fmc_hz / sdram_cur.div);
+
+        // FMC要求至少41, 停在HSE时(6.25MHz)也还在7.8us以内
+        if (count < 41)
+                count = 41;
+        if (hsdram1.State != HAL_SDRAM_STATE_RESET)
+                HAL_SDRAM_ProgramRefreshRate(&hsdram1, count);
+}
+
+/*
+ * 清零 .sdram_bss, 在sdram_init和自检之后, sdramtest/sdramtune也会改写它
+ */
+void sdram_bss_init(void)
+{
+        extern char _ssdram_bss, _esdram_bss;
+
+        if (hsdram1.State != HAL_SDRAM_STATE_RESET)
+                memset(&_ssdram_bss, 0, &_esdram_bss - &_ssdram_bss);
+}
+
+
+/*
+ * 进入自刷新, 之后不能再访问SDRAM, 由复位后的sdram_init退出
+ */
+void sdram_self_refresh(void)
+{
+        FMC_SDRAM_CommandTypeDef cmd;
+
+        cmd.CommandMode = FMC_SDRAM_CMD_SELFREFRESH_MODE;
+        cmd.CommandTarget = FMC_SDRAM_CMD_TARGET_BANK1;
+        cmd.AutoRefreshNumber = 1;
+        cmd.ModeRegisterDefinition = 0;
+        HAL_SDRAM_SendCommand(&hsdram1, &cmd, SDRAM_TIMEOUT);
+}
 
-        sdram_send_command(&hsdram1);
 
-        if (HAL_SDRAM_ProgramRefreshRate(&hsdram1, 918))
-            printk(KERN_INFO "sdram: chuck in set refresh rate");
+/*
+ * sdramtune: 每个参数从快到慢扫一遍, 其余参数保持当前值, 每档都跑
+ * 压力测试和带宽测试
+ *
+ * 余量: 比手册快的值, 要更快一档也通过才采用
+ * rpipe手册没有, 以默认值为准; 突发长度取带宽最高的
+ */
+#define SDRAM_TUNE_SIZE         0x200000
+#define SDRAM_TUNE_ROUNDS       3
+
+// buf: SDRAM_TUNE_SIZE字节, 前一半拷到后一半
+int sdram_bandwidth(void *buf)
+{
+        void *src = buf;
+        void *dst = (char *)buf + SDRAM_TUNE_SIZE / 2;
+        unsigned int t, best = ~0u;
+        int i;
+
+        for (i = 0; i < 3; i++) {
+                SCB_CleanInvalidateDCache();
+                t = get_cycles();
+                memcpy(dst, src, SDRAM_TUNE_SIZE / 2);
+                SCB_CleanDCache();
+                t = get_cycles() - t;
+                if (t < best)
+                        best = t;
+        }
+        // 读写各一遍
+        return (unsigned int)SDRAM_TUNE_SIZE * (SystemCoreClock / 1000000) / best;
+}
+
+static int sdram_try(const struct sdram_cfg *cfg, int rounds, int *mbps)
+{
+        int err = sdram_configure(cfg), i;
+        char val[48];
 
-        printk(KERN_INFO "sdram: configure success");
+        for (i = 0; i < rounds && !err; i++)
+                err = sdram_stress(SDRAM_BASE_ADDR, SDRAM_TUNE_SIZE);
+        *mbps = err ? 0 : sdram_bandwidth((void *)SDRAM_BASE_ADDR);
+        scnprintf(val, sizeof(val), "clk/%d cl%d rpipe%d rcd%d rp%d twr%d bl%d",
+                 sdram_cur.div, sdram_cur.cas, sdram_cur.rpipe, sdram_cur.rcd,
+                 sdram_cur.rp, sdram_cur.twr, sdram_cur.bl);
+        printk("sdramtune: %s: %s %dMB/s", val, err ? "FAIL" : "ok", *mbps);
+        return err;
 }
 
+static void sdram_sweep(struct sdram_cfg *cfg, int *field, int lo, int hi, int spec)
+{
+        int keep = *field, v, pass, prev = 0, mbps;
+
+        for (v = lo; v <= hi; v++) {
+                *field = v;
+                pass = !sdram_try(cfg, 1, &mbps);
+                if (pass && (v >= spec || prev))
+                        return;
+                prev = pass;
+        }
+        *field = keep;
+}
+
+static int sdram_tune(struct sdram_cfg *cfg)
+{
+        static const int bls[] = { 1, 2, 4, 8 };
+        int ns, mbps, best = 0, best_bl = cfg->bl, i;
+
+        // 默认时序都不过就降频
+        while (sdram_try(cfg, 1, &mbps)) {
+                if (++cfg->div > 3)
+                        return -EIO;
+        }
+        ns = 1000000000 / (clk_fmc_freq() / cfg->div) + 1;
+
+        sdram_sweep(cfg, &cfg->cas, 2, 3,
+                    clk_fmc_freq() / cfg->div > SDRAM_CL2_MAX_HZ ? 3 : 2);
+        sdram_sweep(cfg, &cfg->rpipe, 0, 2, sdram_default.rpipe);
+        sdram_sweep(cfg, &cfg->rcd, 1, 4, (SDRAM_TRCD_NS + ns - 1) / ns);
+        sdram_sweep(cfg, &cfg->rp, 1, 4, (SDRAM_TRP_NS + ns - 1) / ns);
+        sdram_sweep(cfg, &cfg->twr, sdram_twr_min(cfg), 4,
+                    sdram_twr_min(cfg) > SDRAM_TWR_CLK ? sdram_twr_min(cfg) : SDRAM_TWR_CLK);
+
+        for (i = 0; i < ARRAY_SIZE(bls); i++) {
+                cfg->bl = bls[i];
+                if (!sdram_try(cfg, 1, &mbps) && mbps > best) {
+                        best = mbps;
+                        best_bl = bls[i];
+                }
+        }
+        cfg->bl = best_bl;
+        if (cfg->twr < sdram_twr_min(cfg))
+                cfg->twr = sdram_twr_min(cfg);
+
+        // 最终结果多跑几轮
+        return sdram_try(cfg, SDRAM_TUNE_ROUNDS, &mbps) ? -EIO : 0;
+}
+
+int do_sdramtune(const char *buf)
+{
+        struct sdram_cfg cfg = sdram_default;
+        char val[32];
+        int idx = 0, ret, mbps;
+
+        while (buf[idx] != ' ' && buf[idx] != '\0')
+                idx ++;
+        while (buf[idx] == ' ') idx++;
+
+        printk(KERN_WARNING "sdramtune: SDRAM content is lost");
+        if (!strncmp(&buf[idx], "reset", 5)) {
+                sdram_tuned = 0;
+                sdram_configure(&sdram_default);
+                ret = env_set("sdramtiming", NULL);
+                return ret ? ret : env_save();
+        }
+
+        sdram_try(&sdram_default, 1, &mbps);
+        printk("sdramtune: default %dMB/s", mbps);
+
+        ret = sdram_tune(&cfg);
+        if (ret) {
+                printk(KERN_ERR "sdramtune: no stable timing, back to defaults");
+                sdram_tuned = 0;
+                sdram_configure(&sdram_default);
+                return ret;
+        }
+
+        scnprintf(val, sizeof(val), "%d,%d,%d,%d,%d,%d,%d", sdram_cur.div, sdram_cur.cas,
+                 sdram_cur.rpipe, sdram_cur.rcd, sdram_cur.rp, sdram_cur.twr, sdram_cur.bl);
+        printk(KERN_INFO "sdramtune: sdramtiming=%s", val);
+        sdram_tuned = 1;
+        ret = env_set("sdramtiming", val);
+        return ret ? ret : env_save();
+}
+
+void help_sdramtune(void)
+{
+        printsh("sdramtune [reset]");
+        printsh("sweep clock divider, cas, read pipe, rcd, rp, twr and burst length");
+        printsh("under stress and bandwidth tests, keep the fastest with margin in the env");
+        printsh("reset: back to the built-in timing, destroys SDRAM content");
+}
+SHELL_EXPORT_CMD(sdramtune, help_sdramtune, do_sdramtune);
@@ -0,0 +1,440 @@
+/**
+ * @file sdramtest.c
+ * @brief SDRAM integrity tests, a quick POST and a thorough run
+ * @version 1.0
+ *
+ * post (< 1s):  data bus, address bus, byte lanes, own address
+ * thorough:     + inverted own address, march C-, bank interleave,
+ *                 row ping-pong, moving inversions
+ *
+ * bus tests and the interleave patterns run with the dcache off, so
+ * every access reaches the chip in program order. the array passes
+ * run cached, each line is one burst on the bus, backgrounds are
+ * DMA2D fills and the check of a pass is folded into the writes of
+ * the next, march C- is therefore line granular
+ *
+ * a failure prints the address, bank / row / column, the expected
+ * and read words, the bits of all failures are summed up as DQ lines
+ */
+#include <stm32h7xx_hal.h>
+#include <stdio.h>
+#include <string.h>
+#include "bsp.h"
+#include "errno.h"
+#include "cmd.h"
+
+// W9825G6KH: 16 bit, 9 column, 13 row, 2 bank bits
+// FMC map: column HADDR[9:1], row [22:10], bank [24:23]
+#define ST_COL_BITS     9
+#define ST_ROW_BITS     13
+#define ST_BANK_BITS    2
+#define ST_ROW_SHIFT   (1 + ST_COL_BITS)
+#define ST_BANK_SHIFT  (ST_ROW_SHIFT + ST_ROW_BITS)
+#define ST_BANKS       (1 << ST_BANK_BITS)
+#define ST_ROW_WORDS   (1 << ST_COL_BITS >> 1)
+#define ST_SIZE        (SDRAM_SIZE_MB * 0x100000)
+#define ST_REPORT       8   // failures printed per test
+
+struct st_ctx {
+    unsigned int *mem;
+    int words;
+    int errors;     // of all tests
+    int shown;      // of this one
+    unsigned int bits;
+};
+
+static void st_error(struct st_ctx *c, unsigned int *p, unsigned int expect, unsigned int got)
+{
+    unsigned int off = (unsigned int)p - SDRAM_BASE_ADDR;
+
+    c->errors++;
+    c->bits |= expect ^ got;
+    if (c->shown++ < ST_REPORT)
+        printk(KERN_ERR "sdramtest: 0x%08x bank %d row %d col %d: 0x%08x != 0x%08x",
+               (unsigned int)p, (off >> ST_BANK_SHIFT) & (ST_BANKS - 1),
+               (off >> ST_ROW_SHIFT) & ((1 << ST_ROW_BITS) - 1),
+               (off >> 1) & ((1 << ST_COL_BITS) - 1), got, expect);
+}
+
+/*
+ * array passes, a line of 8 words at a time, word k of a line at `a`
+ * holds `pat ^ (a & amask)`, amask 0 for a pattern, ~0 for own address
+ * the kernels return the first bad line, the caller sorts it out
+ */
+static __itcm void st_write(unsigned int *p, int n, unsigned int wr, unsigned int amask)
+{
+    unsigned int w;
+    int i, k;
+
+    for (i = 0; i < n; i += 8) {
+        w = ((unsigned int)&p[i] & amask) ^ wr;
+        for (k = 0; k < 8; k++)
+            p[i + k] = w ^ (k * 4 & amask);
+    }
+}
+
+static __itcm int st_check(unsigned int *p, int n, unsigned int exp, unsigned int amask)
+{
+    unsigned int e, diff;
+    int i, k;
+
+    for (i = 0; i < n; i += 8) {
+        e = ((unsigned int)&p[i] & amask) ^ exp;
+        diff = 0;
+        for (k = 0; k < 8; k++)
+            diff |= p[i + k] ^ e ^ (k * 4 & amask);
+        if (diff)
+            return i;
+    }
+    return n;
+}
+
+static __itcm int st_rw_up(unsigned int *p, int n, unsigned int exp, unsigned int wr,
+                           unsigned int amask)
+{
+    unsigned int a, diff;
+    int i, k;
+
+    for (i = 0; i < n; i += 8) {
+        a = (unsigned int)&p[i] & amask;
+        diff = 0;
+        for (k = 0; k < 8; k++)
+            diff |= p[i + k] ^ a ^ exp ^ (k * 4 & amask);
+        if (diff)
+            return i;
+        for (k = 0; k < 8; k++)
+            p[i + k] = a ^ wr ^ (k * 4 & amask);
+    }
+    return n;
+}
+
+static __itcm int st_rw_down(unsigned int *p, int n, unsigned int exp, unsigned int wr,
+                             unsigned int amask)
+{
+    unsigned int a, diff;
+    int i, k;
+
+    for (i = n - 8; i >= 0; i -= 8) {
+        a = (unsigned int)&p[i] & amask;
+        diff = 0;
+        for (k = 7; k >= 0; k--)
+            diff |= p[i + k] ^ a ^ exp ^ (k * 4 & amask);
+        if (diff)
+            return i;
+        for (k = 7; k >= 0; k--)
+            p[i + k] = a ^ wr ^ (k * 4 & amask);
+    }
+    return -1;
+}
+
+// the slow way through a bad line
+static void st_line(struct st_ctx *c, unsigned int *p, unsigned int exp, unsigned int wr,
+                    unsigned int amask, int write)
+{
+    unsigned int a;
+    int k;
+
+    for (k = 0; k < 8; k++) {
+        a = (unsigned int)&p[k] & amask;
+        if (p[k] != (a ^ exp))
+            st_error(c, &p[k], a ^ exp, p[k]);
+        if (write)
+            p[k] = a ^ wr;
+    }
+}
+
+enum { ST_WRITE, ST_CHECK, ST_UP, ST_DOWN };
+
+/*
+ * one pass over the array: check `exp` unless ST_WRITE,
+ * then write `wr` unless ST_CHECK
+ */
+static void st_pass(struct st_ctx *c, int mode, unsigned int exp, unsigned int wr,
+                    unsigned int amask)
+{
+    unsigned int *p = c->mem;
+    int n = c->words, i = 0, bad;
+
+    if (mode == ST_WRITE) {
+        st_write(p, n, wr, amask);
+    } else if (mode == ST_DOWN) {
+        while ((bad = st_rw_down(p, n, exp, wr, amask)) >= 0) {
+            st_line(c, p + bad, exp, wr, amask, 1);
+            n = bad;
+        }
+    } else {
+        while (i < n) {
+            if (mode == ST_UP)
+                bad = i + st_rw_up(p + i, n - i, exp, wr, amask);
+            else
+                bad = i + st_check(p + i, n - i, exp, amask);
+            if (bad >= n)
+                break;
+            st_line(c, p + bad, exp, wr, amask, mode == ST_UP);
+            i = bad + 8;
+        }
+    }
+    // dirty lines still in the cache: next pass reads the chip
+    SCB_CleanInvalidateDCache();
+}
+
+/*
+ * bus tests, dcache off
+ */
+static void st_data_bus(struct st_ctx *c)
+{
+    volatile unsigned int *p = c->mem, *q = c->mem + 1;
+    unsigned int v;
+    int bit;
+
+    for (bit = 0; bit < 32; bit++) {
+        *p = 1u << bit;
+        *q = ~(1u << bit);    // drive the bus the other way in between
+        v = *p;
+        if (v != 1u << bit)
+            st_error(c, (unsigned int *)p, 1u << bit, v);
+        *p = ~(1u << bit);
+        *q = 1u << bit;
+        v = *p;
+        if (v != ~(1u << bit))
+            st_error(c, (unsigned int *)p, ~(1u << bit), v);
+    }
+}
+
+static void st_addr_bus(struct st_ctx *c)
+{
+    volatile unsigned short *p = (volatile unsigned short *)c->mem;
+    volatile unsigned char *b = (volatile unsigned char *)c->mem;
+    int halfs = ST_SIZE / 2, off, test;
+    unsigned short v;
+
+    // every address line, alone and against each of the others
+    for (off = 1; off < halfs; off <<= 1)
+        p[off] = 0x5555;
+    p[0] = 0xaaaa;
+    for (off = 1; off < halfs; off <<= 1) {
+        v = p[off];
+        if (v != 0x5555)
+            st_error(c, (unsigned int *)&p[off & ~1], 0x5555, v);
+    }
+    p[0] = 0x5555;
+    for (test = 1; test < halfs; test <<= 1) {
+        p[test] = 0xaaaa;
+        for (off = 1; off < halfs; off <<= 1) {
+            v = off == test ? 0xaaaa : 0x5555;
+            if (p[off] != v)
+                st_error(c, (unsigned int *)&p[off & ~1], v, p[off]);
+        }
+        p[test] = 0x5555;
+    }
+
+    // NBL0 / NBL1
+    p[0] = 0;
+    b[0] = 0x12;
+    b[1] = 0x34;
+    if (p[0] != 0x3412)
+        st_error(c, (unsigned int *)p, 0x3412, p[0]);
+}
+
+/*
+ * own address ^ pattern in access order, dcache off
+ * pingpong: two rows of a bank in turns, a precharge and an
+ *           activate for every access (tRP, tRCD, tRAS)
+ * else:     the four banks in turns on the same row
+ * a range under 8MB stays in one bank, its rows only
+ */
+static void st_touch(struct st_ctx *c, int row, int bank, int word, unsigned int pat,
+                     int check)
+{
+    volatile unsigned int *p = (unsigned int *)((unsigned int)c->mem +
+            (row << ST_ROW_SHIFT | bank << ST_BANK_SHIFT | word << 2));
+    unsigned int v;
+
+    if (!check) {
+        *p = (unsigned int)p ^ pat;
+        return;
+    }
+    v = *p;
+    if (v != ((unsigned int)p ^ pat))
+        st_error(c, (unsigned int *)p, (unsigned int)p ^ pat, v);
+}
+
+static void st_interleave(struct st_ctx *c, int pingpong, unsigned int pat)
+{
+    int banks = c->words * 4 >> ST_BANK_SHIFT, rows;
+    int check, r, b, w;
+
+    if (banks < 1)
+        banks = 1;
+    if (banks > ST_BANKS)
+        banks = ST_BANKS;
+    rows = (c->words * 4 >> ST_ROW_SHIFT) / banks;
+
+    for (check = 0; check < 2; check++) {
+        if (pingpong) {
+            for (b = 0; b < banks; b++)
+                for (r = 0; r < rows; r += 2)
+                    for (w = 0; w < ST_ROW_WORDS; w++) {
+                        st_touch(c, r, b, w, pat, check);
+                        st_touch(c, r + 1, b, w, pat, check);
+                    }
+        } else {
+            for (r = 0; r < rows; r++)
+                for (w = 0; w < ST_ROW_WORDS; w++)
+                    for (b = 0; b < banks; b++)
+                        st_touch(c, r, b, w, pat, check);
+        }
+    }
+}
+
+/*
+ * tests
+ */
+static void t_data_bus(struct st_ctx *c)   { st_data_bus(c); }
+static void t_addr_bus(struct st_ctx *c)   { st_addr_bus(c); }
+static void t_interleave(struct st_ctx *c) { st_interleave(c, 0, 0xffffffff); }
+static void t_pingpong(struct st_ctx *c)   { st_interleave(c, 1, 0xa5a5a5a5); }
+
+static void t_own_addr(struct st_ctx *c)
+{
+    st_pass(c, ST_WRITE, 0, 0, ~0);
+    st_pass(c, ST_CHECK, 0, 0, ~0);
+}
+
+static void t_own_addr_inv(struct st_ctx *c)
+{
+    st_pass(c, ST_WRITE, 0, 0, ~0);
+    st_pass(c, ST_UP, 0, ~0, ~0);
+    st_pass(c, ST_CHECK, ~0, 0, ~0);
+}
+
+// ⇑w0 ⇑(r0,w1) ⇑(r1,w0) ⇓(r0,w1) ⇓(r1,w0) ⇑r0
+static void t_march_c(struct st_ctx *c)
+{
+    mem_fill(c->mem, 0, 4, c->words * 4);
+    st_pass(c, ST_UP, 0, ~0, 0);
+    st_pass(c, ST_UP, ~0, 0, 0);
+    st_pass(c, ST_DOWN, 0, ~0, 0);
+    st_pass(c, ST_DOWN, ~0, 0, 0);
+    st_pass(c, ST_CHECK, 0, 0, 0);
+}
+
+// p: ⇑(r p, w ~p) ⇓(r ~p, w next p), the last one checked at the end
+static void t_moving_inv(struct st_ctx *c)
+{
+    static const unsigned int pats[] = {
+        0x00000000, 0x55555555, 0x33333333, 0x0f0f0f0f, 0x00ff00ff, 0x0000ffff,
+    };
+    int i;
+
+    mem_fill(c->mem, pats[0], 4, c->words * 4);
+    for (i = 0; i < ARRAY_SIZE(pats); i++) {
+        st_pass(c, ST_UP, pats[i], ~pats[i], 0);
+        st_pass(c, ST_DOWN, ~pats[i], i + 1 < ARRAY_SIZE(pats) ? pats[i + 1] : pats[i], 0);
+    }
+    st_pass(c, ST_CHECK, pats[i - 1], 0, 0);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(struct st_ctx *);
+    int uncached;
+    int post;
+} tests[] = {
+    { "data bus",         t_data_bus,     1, 1 },
+    { "address bus",      t_addr_bus,     1, 1 },
+    { "own address",      t_own_addr,     0, 1 },
+    { "own address inv",  t_own_addr_inv, 0, 0 },
+    { "march C-",         t_march_c,      0, 0 },
+    { "bank interleave",  t_interleave,   1, 0 },
+    { "row ping-pong",    t_pingpong,     1, 0 },
+    { "moving inversion", t_moving_inv,   0, 0 },
+};
+
+/**
+ * @brief test all of SDRAM, its content is lost
+ *        `post`: the quick set only
+ */
+int sdram_test(int post)
+{
+    struct st_ctx c = { (unsigned int *)SDRAM_BASE_ADDR, ST_SIZE / 4, 0, 0, 0 };
+    int dcache_was_on = SCB->CCR & SCB_CCR_DC_Msk;
+    unsigned int start, t;
+    unsigned int dq;
+    int i, err;
+
+    start = HAL_GetTick();
+    for (i = 0; i < ARRAY_SIZE(tests); i++) {
+        if (post && !tests[i].post)
+            continue;
+        if (console_ctrlc()) {
+            printk(KERN_WARNING "sdramtest: interrupted");
+            break;
+        }
+
+        if (tests[i].uncached)
+            SCB_DisableDCache();
+        else if (dcache_was_on)
+            SCB_EnableDCache();
+
+        c.shown = 0;
+        err = c.errors;
+        t = HAL_GetTick();
+        tests[i].run(&c);
+        t = HAL_GetTick() - t;
+        if (!post || c.errors != err)
+            printk("sdramtest: %-16s %s, %dms", tests[i].name,
+                   c.errors == err ? "ok" : "FAILED", t);
+    }
+    if (dcache_was_on)
+        SCB_EnableDCache();
+
+    if (c.errors) {
+        dq = (c.bits | c.bits >> 16) & 0xffff;
+        printk(KERN_ERR "sdramtest: %d errors, bad bits 0x%08x (DQ mask 0x%04x)",
+               c.errors, c.bits, dq);
+        return -EIO;
+    }
+    printk(KERN_INFO "sdramtest: %s passed, %dMB in %dms", post ? "post" : "all",
+           SDRAM_SIZE_MB, (int)(HAL_GetTick() - start));
+    return 0;
+}
+
+/**
+ * @brief errors of a short silent stress of `len` bytes at `base`,
+ *        row aligned, for sdramtune
+ */
+int sdram_stress(unsigned int base, int len)
+{
+    struct st_ctx c = { (unsigned int *)base, len / 4, 0, ST_REPORT, 0 };
+    int dcache_was_on = SCB->CCR & SCB_CCR_DC_Msk;
+
+    SCB_DisableDCache();
+    st_data_bus(&c);
+    st_interleave(&c, 1, 0xa5a5a5a5);
+    if (dcache_was_on)
+        SCB_EnableDCache();
+    t_own_addr_inv(&c);
+    t_moving_inv(&c);
+    return c.errors;
+}
+
+int do_sdramtest(const char *buf)
+{
+    int idx = 0;
+
+    while (buf[idx] != ' ' && buf[idx] != '\0')
+        idx ++;
+    while (buf[idx] == ' ') idx++;
+
+    printk(KERN_WARNING "sdramtest: SDRAM content is lost");
+    return sdram_test(!strncmp(&buf[idx], "post", 4));
+}
+
+void help_sdramtest(void)
+{
+    printsh("sdramtest [post]");
+    printsh("bus, march C-, interleave and moving inversion tests of all SDRAM");
+    printsh("post: the quick set run at boot, destroys SDRAM content");
+}
+SHELL_EXPORT_CMD(sdramtest, help_sdramtest, do_sdramtest);
@@ -9,52 +9,97 @@
  */
 #include <stm32h7xx_hal.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 #include "bsp.h"
 #include "errno.h"
 #include "cmd.h"
 
 /*
- * ascii escape character code
+ * line editor output, batched: keys of one input burst are
+ * rendered into `out` and written once no more input is pending
+ *
+ * only the change is sent: a plain echo when typing at the end,
+ * the tail of the line when editing in the middle
  */
-#define sav_cur_pos()   printf("\033[s")
-#define rec_cur_pos()   printf("\033[u")
-#define hide_cursor()   printf("\033[?25l")
-#define show_cursor()   printf("\033[?25h")
-#define move_cursor(ch) printf("\033[%dG", ch)
-#define clear_to_eol()  printf("\033[K")
+static struct {
+    char buf[128];
+    int len;
+} out;
 
-static void backspace(int ch)
+static void out_flush(void)
 {
-    // default 1 -> although if 0: backspace 1
-    if (ch > 0) {
-        printf("\033[%dD", ch);
+    if (out.len) {
+        _write(1, out.buf, out.len);
+        out.len = 0;
     }
 }
 
-static void forwspace(int ch)
+static void out_put(const char *s, int n)
 {
-    if (ch > 0) {
-        printf("\033[%dC", ch);
+    int len;
+
+    while (n) {
+        if (out.len == sizeof(out.buf))
+            out_flush();
+        len = sizeof(out.buf) - out.len;
+        if (len > n)
+            len = n;
+        memcpy(&out.buf[out.len], s, len);
+        out.len += len;
+        s += len;
+        n -= len;
     }
 }
 
+#define out_str(s)      out_put(s, strlen(s))
+#define clear_to_eol()  out_put("\033[K", 3)
+
+// cursor left / right by `ch`, a single step left is just '\b'
+static void backspace(int ch)
+{
+    char esc[12];
+
+    if (ch == 1)
+        out_put("\b", 1);
+    else if (ch > 0)
+        out_put(esc, scnprintf(esc, sizeof(esc), "\033[%dD", ch));
+}
+
+static void forwspace(int ch)
+{
+    char esc[12];
+
+    if (ch > 0)
+        out_put(esc, scnprintf(esc, sizeof(esc), "\033[%dC", ch));
+}
 
 /*
- * shell
+ * turn the line on screen from `old` into `new`, cursor at `adx`
+ * before, at the end of `new` after
  */
-#define MAX_HISTORY_LINE   32
-#define MAX_CMD_LENGTH     64
+static void redraw(const char *old, int adx, const char *new)
+{
+    int same = 0, oldlen = strlen(old), newlen = strlen(new);
 
-struct cmd *head;
+    while (same < oldlen && same < newlen && old[same] == new[same])
+        same++;
 
-static void add_command(struct cmd *command)
-{
-    command->next = head->next;
-    head->next = command;
+    if (adx > same)
+        backspace(adx - same);
+    else
+        forwspace(same - adx);
+    out_put(&new[same], newlen - same);
+    if (oldlen > newlen)
+        clear_to_eol();
 }
 
+
+/*
+ * shell
+ */
+#define MAX_HISTORY_LINE   32
+#define MAX_CMD_LENGTH     64
+
 // cmd cache
 struct cc_cache {
     char cache[MAX_HISTORY_LINE][MAX_CMD_LENGTH];
@@ -93,25 +138,61 @@ static inline void load_nextcmd(char *buf)
 }
 
 static void command_read(char *buf);
-static void parse_command(const char *);
+static void complete(char *buf, int *idx, int *adx);
+
+/*
+ * compare `len` chars of `name` with a whole command name
+ */
+static int cmd_cmp(const char *name, int len, const char *cmd)
+{
+    int ret = strncmp(name, cmd, len);
+
+    if (ret)
+        return ret;
+    return cmd[len] ? -1 : 0;
+}
 
 /**
- ** init commands from section `.shell_cmd`
- * append all to cmd linklist
+ * binary search of the sorted command table
  */
-void commands_init(void)
+const struct cmd *find_cmd(const char *name, int len)
 {
-    extern struct cmd _shell_cmd_start,
-                      _shell_cmd_end;
-    struct cmd *current = &_shell_cmd_start;
+    int lo = 0, hi = _shell_cmd_end - _shell_cmd_start;
+    int mid, ret;
 
-    head = malloc(sizeof(struct cmd));
-    head->next = NULL;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        ret = cmd_cmp(name, len, _shell_cmd_start[mid].name);
+        if (!ret)
+            return &_shell_cmd_start[mid];
+        if (ret < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
 
-    while (current < &_shell_cmd_end) {
-        add_command(current);
-        current ++;
+/*
+ * commands starting with `prefix`: [*first, *first + return)
+ */
+static int find_prefix(const char *prefix, int len, const struct cmd **first)
+{
+    int lo = 0, hi = _shell_cmd_end - _shell_cmd_start;
+    int mid, n = 0;
+
+    // lower bound
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (strncmp(_shell_cmd_start[mid].name, prefix, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    *first = &_shell_cmd_start[lo];
+    while (&(*first)[n] < _shell_cmd_end && !strncmp((*first)[n].name, prefix, len))
+        n++;
+    return n;
 }
 
 /**
@@ -131,15 +212,16 @@ __itcm void console_cmd(void)
     char buf[MAX_CMD_LENGTH+1];
 
 #ifdef CONSOLE_CMD
-    commands_init();
     setvbuf(stdin,  NULL, _IONBF, 0);
     setvbuf(stdout, NULL, _IONBF, 0);
 
+    autoboot();
+
 input:
     memset(buf, 0, sizeof(buf));
     printf("=> ");
     command_read(buf);
-    parse_command(buf);
+    run_command_list(buf, 0);
     goto input;
 #endif
 
@@ -156,28 +238,30 @@ input:
  */
 static void command_read(char *buf)
 {
+    char old[MAX_CMD_LENGTH + 1];
     int idx = 0;
     int adx = idx;
-    int i, len;
-    struct cmd *iter;
     char rc;
 
     while (1) {
+    if (!console_tstc())
+        out_flush();
     rc = getchar();
 
     switch (rc) {
     case '\033': // Arrow and DEL
         getchar();
-        switch (getchar()) {
+        switch (rc = getchar()) {
         case 'B': // next command
-            hide_cursor();
-            backspace(strlen(buf));
-            clear_to_eol();
-            load_nextcmd(buf);
+        case 'A': // last command
+            memcpy(old, buf, sizeof(old));
+            if (rc == 'A')
+                load_lastcmd(buf);
+            else
+                load_nextcmd(buf);
+            redraw(old, adx, buf);
             idx = strlen(buf);
             adx = idx;
-            printf("%s", buf);
-            show_cursor();
             break;
         case 'C': // right
             if (adx < idx) {
@@ -185,16 +269,6 @@ static void command_read(char *buf)
                 adx++;
             }
             break;
-        case 'A': // last command
-            hide_cursor();
-            backspace(strlen(buf));
-            clear_to_eol();
-            load_lastcmd(buf);
-            idx = strlen(buf);
-            adx = idx;
-            printf("%s", buf);
-            show_cursor();
-            break;
         case 'D': // left
             if (adx > 0) {
                 backspace(1);
@@ -207,77 +281,90 @@ static void command_read(char *buf)
         continue;
     case 127: // Backspace key
         if (adx > 0) {
-            backspace(1);
-            hide_cursor();
-            sav_cur_pos();
-            clear_to_eol();
-            printf("%s", &buf[adx]);
-            rec_cur_pos();
-            show_cursor();
             memmove(&buf[adx-1], &buf[adx], idx-adx);
             buf[--idx] = '\0';
             --adx;
+            // back, tail, blank the last column, back again
+            backspace(1);
+            out_put(&buf[adx], idx-adx);
+            out_put(" ", 1);
+            backspace(idx-adx+1);
         }
-        if (!idx) buf[idx] = '\0';
         continue;
     case '\t': // Tab Complete
-        for (iter = head->next; iter; iter = iter->next)
-            if (!strncmp(buf, iter->name, idx)) {
-                len = strlen(iter->name+idx);
-                printf("%s", iter->name+idx);
-                memcpy(&buf[idx], iter->name+idx, len);
-                idx += len;
-                adx += len;
-            }
+        complete(buf, &idx, &adx);
         continue;
     case '\r': // Enter
-        printf("\r\n");
+        out_str("\r\n");
+        out_flush();
         if (strlen(buf)) {
             storeto_cmd_cache(buf);
             ccache.curr = ccache.tail;
         }
         return;
     case 3: // ctrl-c
-        printf("\r\n");
+        out_str("\r\n");
+        out_flush();
         memset(buf, 0, strlen(buf));
         return;
     default:
         if (unlikely( idx >= MAX_CMD_LENGTH ))
             break;
-        hide_cursor();
-        sav_cur_pos();
-        clear_to_eol();
-        printf("%c%s", rc, &buf[adx]);
-        rec_cur_pos();
-        forwspace(1);
-        show_cursor();
         // insert
-        if (idx == adx) {
-            buf[idx++] = rc;
-            adx++;
-        } else {
-            memmove(&buf[adx+1], &buf[adx], idx-adx);
-            buf[adx++] = rc;
-            idx++;
-        }
+        memmove(&buf[adx+1], &buf[adx], idx-adx);
+        buf[adx++] = rc;
+        idx++;
+        // at the end this is a plain echo
+        out_put(&buf[adx-1], idx-adx+1);
+        backspace(idx-adx);
     }
     }
 }
 
 /*
- * parse command input
+ * complete the command name at the end of the line:
+ * extend to the common prefix of all candidates,
+ * list them if that adds nothing
  */
-static void parse_command(const char *buf) {
-    struct cmd *iter;
+static void complete(char *buf, int *idx, int *adx)
+{
+    const struct cmd *first;
+    int i, n, len, common;
+
+    if (*adx != *idx || memchr(buf, ' ', *idx))
+        return;
 
-    if (!strlen(buf))
+    n = find_prefix(buf, *idx, &first);
+    if (!n)
         return;
 
-    for (iter = head->next; iter; iter = iter->next)
-        if (!strncmp(buf, iter->name, strlen(iter->name))) {
-            iter->exec(buf);
-            return;
+    common = strlen(first[0].name);
+    for (i = 1; i < n; i++) {
+        len = *idx;
+        while (len < common && first[i].name[len] == first[0].name[len])
+            len++;
+        common = len;
+    }
+    if (common >= MAX_CMD_LENGTH - 1)
+        return;
+
+    if (common > *idx) {
+        out_put(first[0].name + *idx, common - *idx);
+        memcpy(&buf[*idx], first[0].name + *idx, common - *idx);
+        *idx = *adx = common;
+        if (n == 1 && common < MAX_CMD_LENGTH - 1) {
+            out_put(" ", 1);
+            buf[(*idx)++] = ' ';
+            (*adx)++;
         }
+        return;
+    }
 
-    printk(KERN_ERR "%s: no such a command", buf);
-}
\ No newline at end of file
+    out_str("\r\n");
+    for (i = 0; i < n; i++) {
+        out_str(first[i].name);
+        out_put("  ", 2);
+    }
+    out_str("\r\n=> ");
+    out_str(buf);
+}
@@ -12,8 +12,8 @@
 #include <stdarg.h>
 #include <string.h>
 #include <cmsis_gcc.h>
-#include <stdlib.h>
 #include "bsp.h"
+#include "errno.h"
 
 #define SOH_RED     "\033[31m"
 #define SOH_YEL     "\033[33m"
@@ -21,65 +21,390 @@
 #define EOL_COLOR   "\033[0m"
 
 static UART_HandleTypeDef huart;
+static DMA_HandleTypeDef hdma_tx;
+static DMA_HandleTypeDef hdma_rx;
 
-struct epb {
-    char buffer[EPB_BUF_SIZE];
-    int ptr;
-    int flag;
-};
-static struct epb ebuf = { .flag = 1 };
+/*
+ * tx ring in AXI-SRAM, DMA1 can't reach DTCM
+ *   head: written by _write
+ *   tail: released by dma callbacks
+ *   [tx_start, tx_start + tx_len) is in flight
+ */
+#define TX_RING_SIZE    4096
 
+static char tx_ring[TX_RING_SIZE] __dma_buf __attribute__((aligned(32)));
+static volatile int tx_head, tx_tail;
+static volatile int tx_start, tx_len;
 
-/* lib prototype */
-int _write(int file, char *ptr, int len)
+/*
+ * rx ring written by circular dma, never stops on its own,
+ * head is derived from the dma counter
+ *   total: bytes landed, summed up at every rx event (ht / tc / idle)
+ *   taken: bytes read, a gap of a whole ring means the dma went
+ *          past the reader and overwrote what it hadn't read
+ */
+#define RX_RING_SIZE    1024
+
+static char rx_ring[RX_RING_SIZE] __dma_buf __attribute__((aligned(32)));
+static int rx_tail;
+static volatile unsigned int rx_total, rx_taken;
+static int rx_last;             // ring position at the last rx event
+static volatile int rx_overrun;
+static int rx_overruns;
+
+#ifdef CONSOLE_XONXOFF
+#define XON             0x11
+#define XOFF            0x13
+// checked on idle and every half ring (ht / tc), a paste has no idle gap:
+// above the mark there is still room for half a ring plus what's in flight
+#define RX_HIGH_WATER   (RX_RING_SIZE / 4)
+#define RX_LOW_WATER    (RX_RING_SIZE / 8)
+// keep dma chunks short so a flow control char isn't queued for long
+#define TX_CHUNK_MAX    256
+
+static volatile int rx_stopped;
+static volatile char tx_xchar;
+#else
+#define TX_CHUNK_MAX    TX_RING_SIZE
+#endif
+
+/*
+ * printk always goes to the log ring, to the uart only once
+ * console_init has run and while the console is enabled
+ */
+static int console_ready;
+static int console_enabled = 1;
+
+
+/*
+ * start dma on the continuous part after tail, irq must be masked
+ */
+static void tx_kick(void)
 {
-    (void)file;
-    HAL_UART_Transmit(&huart, (uint8_t *)ptr, len, 0xff);
-    return len;
+    int start = tx_tail, len;
+    int a, b;
+
+    if (tx_len)
+        return;
+#ifdef CONSOLE_XONXOFF
+    if (tx_xchar) {
+        while (!__HAL_UART_GET_FLAG(&huart, UART_FLAG_TXE))
+            ;
+        huart.Instance->TDR = tx_xchar;
+        tx_xchar = 0;
+    }
+#endif
+    if (tx_head == start)
+        return;
+
+    len = tx_head > start ? tx_head - start : TX_RING_SIZE - start;
+    if (len > TX_CHUNK_MAX)
+        len = TX_CHUNK_MAX;
+
+    a = (int)&tx_ring[start] & ~31;
+    b = (int)&tx_ring[start + len];
+    SCB_CleanDCache_by_Addr((uint32_t *)a, b - a);
+
+    tx_start = start;
+    tx_len = len;
+    if (HAL_UART_Transmit_DMA(&huart, (uint8_t *)&tx_ring[start], len) != HAL_OK)
+        tx_len = 0;
 }
 
-int _read(int file, char *ptr, int len)
+void HAL_UART_TxHalfCpltCallback(UART_HandleTypeDef *h)
 {
-    (void)file;
-    HAL_UART_Receive(&huart, (uint8_t *)ptr, len, HAL_MAX_DELAY);
-    return len;
+    // first half is out of the fifo, let writers reuse it
+    tx_tail = tx_start + tx_len / 2;
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *h)
+{
+    tx_tail = (tx_start + tx_len) % TX_RING_SIZE;
+    tx_len = 0;
+    tx_kick();
+}
+
+static int rx_head(void)
+{
+    return RX_RING_SIZE - __HAL_DMA_GET_COUNTER(&hdma_rx);
+}
+
+static int rx_count(void)
+{
+    return (rx_head() - rx_tail + RX_RING_SIZE) % RX_RING_SIZE;
+}
+
+#ifdef CONSOLE_XONXOFF
+/*
+ * irq must be masked
+ */
+static void rx_flow(int stop)
+{
+    if (rx_stopped == stop)
+        return;
+    rx_stopped = stop;
+    tx_xchar = stop ? XOFF : XON;
+    tx_kick();
+}
+#endif
+
+// ht stays on, a paste has no idle gap and each lap must be counted
+static void rx_start(void)
+{
+    rx_tail = 0;
+    rx_last = 0;
+    HAL_UARTEx_ReceiveToIdle_DMA(&huart, (uint8_t *)rx_ring, RX_RING_SIZE);
+}
+
+static void rx_reverse(int a, int b)
+{
+    char t;
+
+    for (b--; a < b; a++, b--)
+        t = rx_ring[a], rx_ring[a] = rx_ring[b], rx_ring[b] = t;
+}
+
+/*
+ * restart after the dma was aborted, the unread bytes are rotated to
+ * the end of the ring so the new reception from 0 continues after them
+ */
+static void rx_restart(void)
+{
+    int n = rx_count(), d = (RX_RING_SIZE - rx_head()) % RX_RING_SIZE;
+
+    // count what landed since the last event, positions restart at 0
+    rx_total += (rx_head() - rx_last + RX_RING_SIZE) % RX_RING_SIZE;
+    SCB_InvalidateDCache_by_Addr((uint32_t *)rx_ring, RX_RING_SIZE);
+    if (n && d) {
+        // rotate right by d, head lands on 0
+        rx_reverse(0, RX_RING_SIZE);
+        rx_reverse(0, d);
+        rx_reverse(d, RX_RING_SIZE);
+        SCB_CleanDCache_by_Addr((uint32_t *)rx_ring, RX_RING_SIZE);
+    }
+    rx_start();
+    rx_tail = (RX_RING_SIZE - n) % RX_RING_SIZE;
+}
+
+/*
+ * dma ht / tc or idle line: a burst has landed
+ */
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *h, uint16_t pos)
+{
+    pos %= RX_RING_SIZE;
+    rx_total += (pos - rx_last + RX_RING_SIZE) % RX_RING_SIZE;
+    rx_last = pos;
+    if (rx_total - rx_taken >= RX_RING_SIZE)
+        rx_overrun = 1;
+#ifdef CONSOLE_XONXOFF
+    if (rx_count() > RX_HIGH_WATER)
+        rx_flow(1);
+#endif
+}
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *h)
+{
+    // hal aborts dma reception on framing/noise errors, restart it
+    if (h->RxState == HAL_UART_STATE_READY)
+        rx_restart();
+}
+
+/*
+ * after rx_tail moved on, resume a sender stopped by XOFF
+ */
+static void rx_consumed(void)
+{
+#ifdef CONSOLE_XONXOFF
+    if (rx_stopped && rx_count() < RX_LOW_WATER) {
+        int primask = __get_PRIMASK();
+
+        __disable_irq();
+        rx_flow(0);
+        __set_PRIMASK(primask);
+    }
+#endif
+}
+
+/*
+ * after an overrun the unread chars are partly overwritten, drop them
+ * all and tell once per overrun
+ */
+static void rx_sync(void)
+{
+    int primask;
+
+    if (likely(!rx_overrun))
+        return;
+    primask = __get_PRIMASK();
+    __disable_irq();
+    rx_tail = rx_head();
+    rx_taken = rx_total + (rx_tail - rx_last + RX_RING_SIZE) % RX_RING_SIZE;
+    rx_overrun = 0;
+    __set_PRIMASK(primask);
+    printk(KERN_WARNING "console: rx overrun, input dropped (%d)", ++rx_overruns);
+}
+
+/**
+ * test whether a char is waiting
+ */
+int console_tstc(void)
+{
+    rx_sync();
+    return rx_count();
+}
+
+/**
+ * read one char, wait at most `timeout` ms, < 0 waits forever
+ */
+int console_getc(int timeout)
+{
+    int tick = HAL_GetTick();
+    char c;
+
+    while (!console_tstc())
+        if (timeout >= 0 && HAL_GetTick() - tick >= timeout)
+            return -ETIMEDOUT;
+
+    SCB_InvalidateDCache_by_Addr((uint32_t *)((int)&rx_ring[rx_tail] & ~31), 32);
+    c = rx_ring[rx_tail];
+    rx_tail = (rx_tail + 1) % RX_RING_SIZE;
+    rx_taken++;
+    rx_consumed();
+    return (unsigned char)c;
+}
+
+/**
+ * ctrl-c among the unread chars: it and what was typed before it are
+ * dropped, as a tty does on intr, anything else stays for console_getc
+ */
+int console_ctrlc(void)
+{
+    int n = console_tstc(), i, p;
+
+    if (!n)
+        return 0;
+    SCB_InvalidateDCache_by_Addr((uint32_t *)rx_ring, RX_RING_SIZE);
+    for (i = 0; i < n; i++) {
+        p = (rx_tail + i) % RX_RING_SIZE;
+        if (rx_ring[p] == 3) {
+            rx_tail = (p + 1) % RX_RING_SIZE;
+            rx_taken += i + 1;
+            rx_consumed();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void console_irq_handler(void)
+{
+    HAL_UART_IRQHandler(&huart);
 }
 
-static float get_log_time(void)
+void console_tx_dma_irq_handler(void)
 {
-    int load, val;
-    float us, ms;
+    HAL_DMA_IRQHandler(&hdma_tx);
+}
 
-    load = SysTick->LOAD;
-    val  = SysTick->VAL;
+void console_rx_dma_irq_handler(void)
+{
+    HAL_DMA_IRQHandler(&hdma_rx);
+}
 
-    us = (float)(load - val) / load * 0.001;
-    ms = HAL_GetTick() * 0.001;
+/*
+ * wait for the dma to make room, when interrupts can't be
+ * taken (masked or in fault handlers) run the handlers by hand
+ */
+static void tx_wait(void)
+{
+    int primask = __get_PRIMASK();
 
-    return ms + us;
+    __disable_irq();
+    if (primask || __get_IPSR()) {
+        console_tx_dma_irq_handler();
+        console_irq_handler();
+    }
+    tx_kick(); // retry if the uart was locked last time
+    __set_PRIMASK(primask);
 }
 
-static void flush_epb(void)
+/*
+ * drain the tx ring, call before anything else touches the uart
+ */
+void console_flush(void)
 {
-    int i = 0;
-    char *buf;
+    if (huart.gState == HAL_UART_STATE_RESET)
+        return;
+
+    while (tx_head != tx_tail || tx_len)
+        tx_wait();
+    while (!__HAL_UART_GET_FLAG(&huart, UART_FLAG_TC))
+        ;
+}
+
+/*
+ * console hands over to linux earlycon, polled again from here
+ */
+void console_shutdown(void)
+{
+    console_flush();
+    HAL_UART_AbortReceive(&huart);
+    HAL_NVIC_DisableIRQ(USART1_IRQn);
+    HAL_NVIC_DisableIRQ(DMA1_Stream0_IRQn);
+    HAL_NVIC_DisableIRQ(DMA1_Stream1_IRQn);
+    HAL_DMA_DeInit(&hdma_tx);
+    HAL_DMA_DeInit(&hdma_rx);
+}
+
+/* lib prototype */
+int _write(int file, char *ptr, int len)
+{
+    int primask, head, n;
+    int left = len;
+
+    (void)file;
+    while (left) {
+        head = tx_head;
+        n = (tx_tail - head - 1 + TX_RING_SIZE) % TX_RING_SIZE;
+        if (!n) {
+            tx_wait();
+            continue;
+        }
+        if (n > TX_RING_SIZE - head)
+            n = TX_RING_SIZE - head;
+        if (n > left)
+            n = left;
+
+        memcpy(&tx_ring[head], ptr, n);
+        ptr  += n;
+        left -= n;
 
-    while (ebuf.buffer[i]) {
-        buf = &ebuf.buffer[i];
-        printf("%s\r\n", buf);
-        // jump over '\0'
-        i += strlen(buf) + 1;
+        primask = __get_PRIMASK();
+        __disable_irq();
+        tx_head = (head + n) % TX_RING_SIZE;
+        tx_kick();
+        __set_PRIMASK(primask);
     }
+    return len;
 }
 
 /*
- * message before uart init
- *   cached into ebp buffer
- * else
- *   print directly
- *
- * gcc will inline get_log_time
+ * block for the first char only, then take what has arrived
  */
+int _read(int file, char *ptr, int len)
+{
+    int n = 0;
+
+    (void)file;
+    if (len <= 0)
+        return 0;
+
+    ptr[n++] = console_getc(-1);
+    while (n < len && console_tstc())
+        ptr[n++] = console_getc(0);
+    return n;
+}
+
 static int get_log_level(const char *level_str) {
     const char *start = strchr(level_str, '<');
     if (!start || start[1] > '7' || start[1] < '0' || start[2] != '>')
@@ -87,70 +412,176 @@ static int get_log_level(const char *level_str) {
     return start[1] - '0';
 }
 
-static void log_prefix(int level)
+static const char *log_prefix(int level)
 {
-    char *prefix;
+    switch (level) {
+    case 3: return SOH_RED "err: "   EOL_COLOR;
+    case 4: return SOH_YEL "warn: "  EOL_COLOR;
+    case 7: return SOH_BLK "DEBUG: " EOL_COLOR;
+    default: return "";
+    }
+}
 
-    if (ebuf.flag == 0)
-        switch (level) {
-        case 3: printf(SOH_RED "err: "   EOL_COLOR); break;
-        case 4: printf(SOH_YEL "warn: "  EOL_COLOR); break;
-        case 7: printf(SOH_BLK "DEBUG: " EOL_COLOR); break;
-        }
-    else {
-        switch (level) {
-        case 3: prefix = SOH_RED "err: "   EOL_COLOR; break;
-        case 4: prefix = SOH_YEL "warn: "  EOL_COLOR; break;
-        case 7: prefix = SOH_BLK "DEBUG: " EOL_COLOR; break;
-        default: return;
-        }
-        memcpy(&ebuf.buffer[ebuf.ptr], prefix, strlen(prefix));
-        ebuf.ptr += strlen(prefix);
+/*
+ * format one line into `buf`, return its length
+ */
+static int log_format(char *buf, int size, const char *fmt, va_list args)
+{
+    unsigned int sec, usec;
+    int level = get_log_level(fmt);
+    int len = 0;
+
+    if (level) {
+        log_time(&sec, &usec);
+        len = scnprintf(buf, size, "[%5u.%06u] %s", sec, usec, log_prefix(level));
+        fmt += 3;
     }
+    return len + vscnprintf(buf + len, size - len, fmt, args);
+}
+
+void console_enable(int on)
+{
+    console_enabled = on;
 }
 
-void printk(const char *fmt, ...)
+/*
+ * log first, then echo to the uart
+ */
+void _printk(const char *fmt, ...)
 {
-    char log_time[15];
-    char *buf;
+    char line[160];
     va_list args;
-    int level = get_log_level(fmt);
+    int len;
 
     va_start(args, fmt);
+    len = log_format(line, sizeof(line) - 2, fmt, args);
+    va_end(args);
 
-    if (likely(ebuf.flag == 0)) {
-        if (level) {
-            printf("[%12.6f] ", get_log_time());
-            log_prefix(level);
-            fmt += 3;
-        }
-        vprintf(fmt, args);
-        printf("\r\n");
-        goto end;
+    line[len] = '\n';
+    log_write(line, len + 1);
+
+    if (likely(console_ready && console_enabled)) {
+        line[len++] = '\r';
+        line[len++] = '\n';
+        _write(1, line, len);
     }
+}
 
-    // early print
-    if (level) {
-        sprintf(log_time, "[%12.6f] ", get_log_time());
-        fmt += 3;
+/*
+ * usart1 kernel clock candidates, the one giving the smallest
+ * baud error wins, pclk2 and oversampling 16 first on a tie
+ */
+static const struct {
+    int source;
+    const char *name;
+} baud_clocks[] = {
+    { RCC_USART16CLKSOURCE_D2PCLK2, "pclk2" },
+    { RCC_USART16CLKSOURCE_HSI,     "hsi"   },
+    { RCC_USART16CLKSOURCE_CSI,     "csi"   },
+    { RCC_USART16CLKSOURCE_PLL3,    "pll3q" },  // when a clock profile runs it
+};
+
+static int baud_clock_freq(int source)
+{
+    PLL3_ClocksTypeDef pll3;
+
+    switch (source) {
+    case RCC_USART16CLKSOURCE_HSI: return HSI_VALUE >> (__HAL_RCC_GET_HSI_DIVIDER() >> 3);
+    case RCC_USART16CLKSOURCE_CSI: return CSI_VALUE;
+    case RCC_USART16CLKSOURCE_PLL3:
+        if (!__HAL_RCC_GET_FLAG(RCC_FLAG_PLL3RDY))
+            return 0;
+        HAL_RCCEx_GetPLL3ClockFreq(&pll3);
+        return pll3.PLL3_Q_Frequency;
+    default:                       return HAL_RCC_GetPCLK2Freq();
     }
-    vasiprintf(&buf, fmt, args);
+}
+
+/*
+ * error in ppm of `baud` from `freq` with oversampling `over`
+ */
+static int baud_error(int freq, int over, int baud)
+{
+    int div, real;
 
-    memcpy(&ebuf.buffer[ebuf.ptr],
-            log_time, sizeof(log_time));
-    ebuf.ptr += sizeof(log_time);
+    div = ((long long)freq * (16 / over) + baud / 2) / baud;
+    if (div < 16 || div > 0xffff)
+        return -1;
+    real = (long long)freq * (16 / over) / div;
+    return (long long)(real > baud ? real - baud : baud - real) * 1000000 / baud;
+}
 
-    log_prefix(level);
+static int console_baud = UART_Baudrate;
 
-    memcpy(&ebuf.buffer[ebuf.ptr],
-            buf, strlen(buf));
-    ebuf.ptr += strlen(buf);
+int console_get_baud(void)
+{
+    return console_baud;
+}
 
-    ebuf.buffer[ebuf.ptr++] = '\0';
-    free(buf);
+/**
+ * reprogram usart1 for `baud`, wait for the tx ring to drain first
+ */
+int console_set_baud(int baud)
+{
+    int i, over, err, best = -1, source = 0, sampling = 0;
 
-end:
-    va_end(args);
+    if (baud <= 0)
+        return -EINVAL;
+
+    for (i = 0; i < ARRAY_SIZE(baud_clocks); i++)
+        for (over = 16; over >= 8; over -= 8) {
+            err = baud_error(baud_clock_freq(baud_clocks[i].source), over, baud);
+            if (err >= 0 && (best < 0 || err < best)) {
+                best = err;
+                source = i;
+                sampling = over == 16 ? UART_OVERSAMPLING_16 : UART_OVERSAMPLING_8;
+            }
+        }
+    // receivers tolerate ~2%, keep well inside
+    if (best < 0 || best > 10000)
+        return -ERANGE;
+
+    console_flush();
+    HAL_UART_AbortReceive(&huart);
+
+    if (baud_clocks[source].source == RCC_USART16CLKSOURCE_HSI)
+        __HAL_RCC_HSI_ENABLE();
+    // not HAL_RCCEx_PeriphCLKConfig, that would reprogram PLL3
+    __HAL_RCC_USART16_CONFIG(baud_clocks[source].source);
+
+    huart.Init.BaudRate = baud;
+    huart.Init.OverSampling = sampling;
+    HAL_UART_Init(&huart);
+    rx_start();
+
+    console_baud = baud;
+    printk(KERN_DEBUG "console: %d baud from %s, oversampling %d, error %dppm",
+            baud, baud_clocks[source].name, sampling ? 8 : 16, best);
+    return 0;
+}
+
+/*
+ * baud setting, "baudrate" in the env
+ */
+int console_baud_save(void)
+{
+    char val[12];
+
+    scnprintf(val, sizeof(val), "%d", console_baud);
+    if (env_set("baudrate", val) || env_save())
+        return -EIO;
+    return 0;
+}
+
+/*
+ * switch to the saved baud
+ */
+void console_baud_load(void)
+{
+    int baud = env_get_int("baudrate", console_baud);
+
+    if (baud != console_baud && console_set_baud(baud))
+        printk(KERN_WARNING "console: saved baud %d unusable", baud);
 }
 
 /*
@@ -160,6 +591,7 @@ void console_init(void)
 {
     GPIO_InitTypeDef IO_Init;
     RCC_PeriphCLKInitTypeDef CLK_Init = {0};
+    int early;
 
     __HAL_RCC_USART1_CLK_ENABLE();
     __HAL_RCC_GPIOA_CLK_ENABLE();
@@ -182,7 +614,42 @@ void console_init(void)
     huart.Init.Parity = UART_PARITY_NONE;
     huart.Init.Mode   = UART_MODE_TX_RX;
     HAL_UART_Init(&huart);
-    ebuf.flag = 0;
+
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    hdma_tx.Instance = DMA1_Stream0;
+    hdma_tx.Init.Request   = DMA_REQUEST_USART1_TX;
+    hdma_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_tx.Init.MemInc    = DMA_MINC_ENABLE;
+    hdma_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_tx.Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE;
+    hdma_tx.Init.Mode      = DMA_NORMAL;
+    hdma_tx.Init.Priority  = DMA_PRIORITY_LOW;
+    hdma_tx.Init.FIFOMode  = DMA_FIFOMODE_DISABLE;
+    HAL_DMA_Init(&hdma_tx);
+    __HAL_LINKDMA(&huart, hdmatx, hdma_tx);
+
+    hdma_rx.Instance = DMA1_Stream1;
+    hdma_rx.Init = hdma_tx.Init;
+    hdma_rx.Init.Request   = DMA_REQUEST_USART1_RX;
+    hdma_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_rx.Init.Mode      = DMA_CIRCULAR;
+    hdma_rx.Init.Priority  = DMA_PRIORITY_HIGH;
+    HAL_DMA_Init(&hdma_rx);
+    __HAL_LINKDMA(&huart, hdmarx, hdma_rx);
+
+    HAL_NVIC_SetPriority(DMA1_Stream1_IRQn, 13, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Stream1_IRQn);
+
+    HAL_NVIC_SetPriority(DMA1_Stream0_IRQn, 13, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Stream0_IRQn);
+    HAL_NVIC_SetPriority(USART1_IRQn, 13, 0);
+    HAL_NVIC_EnableIRQ(USART1_IRQn);
+    rx_start();
+    console_baud_load();
+
+    early = log_offset();
+    console_ready = 1;
 
     printk("");
     printk("----------- _______________  ____  ____  ______  ");
@@ -191,7 +658,11 @@ void console_init(void)
     printk("   ------ ___/ // / / /_/ / /_/ / /_/ / / /      ");
     printk("-------- /____//_/ /_____/\\____/\\____/ /_/     ");
     printk("");
-    flush_epb();
+#ifndef CONFIG_PRINTK_BINARY
+    log_replay(early);
+#else
+    printk("printk: binary log, 'dmesg' and decode with tools/logdecode.py");
+#endif
 
     printk(KERN_INFO "console: uart1 init success");
 }
\ No newline at end of file
@@ -0,0 +1,187 @@
+/**
+ * @file vsprintf.c
+ * @brief small integer-only formatter for printk, no malloc, no float
+ *        %d %i %u %x %X %p %s %c %%, flags '-' '0', width, .precision
+ *        length modifiers are accepted and ignored (all 32-bit)
+ * @version 1.0
+ *
+ */
+#include <stdarg.h>
+#include "bsp.h"
+
+#define LEFT    0x1
+#define ZEROPAD 0x2
+#define SIGN    0x4
+#define UPPER   0x8
+
+struct out {
+    char *buf;
+    int size;
+    int len;
+};
+
+static __itcm void put(struct out *o, char c)
+{
+    if (o->len < o->size - 1)
+        o->buf[o->len] = c;
+    o->len++;
+}
+
+static __itcm void pad(struct out *o, char c, int n)
+{
+    while (n-- > 0)
+        put(o, c);
+}
+
+static __itcm void number(struct out *o, unsigned int num, int base,
+                          int width, int flags)
+{
+    const char *digits = (flags & UPPER) ? "0123456789ABCDEF" : "0123456789abcdef";
+    char tmp[11];
+    int i = 0, n, neg = 0;
+
+    if ((flags & SIGN) && (int)num < 0) {
+        neg = 1;
+        num = -num;
+        width--;
+    }
+    do {
+        tmp[i++] = digits[num % base];
+        num /= base;
+    } while (num);
+    n = i;
+
+    if (!(flags & LEFT) && !(flags & ZEROPAD))
+        pad(o, ' ', width - i);
+    if (neg)
+        put(o, '-');
+    if (!(flags & LEFT) && (flags & ZEROPAD))
+        pad(o, '0', width - i);
+    while (i)
+        put(o, tmp[--i]);
+    if (flags & LEFT)
+        pad(o, ' ', width - n);
+}
+
+static __itcm void string(struct out *o, const char *s, int width,
+                          int prec, int flags)
+{
+    int len = 0;
+
+    if (!s)
+        s = "(null)";
+    while (s[len] && (prec < 0 || len < prec))
+        len++;
+
+    if (!(flags & LEFT))
+        pad(o, ' ', width - len);
+    while (len--)
+        put(o, *s++), width--;
+    if (flags & LEFT)
+        pad(o, ' ', width);
+}
+
+/**
+ * like vsnprintf, but returns the number of chars actually
+ * written into `buf` (not counting '\0')
+ */
+__itcm int vscnprintf(char *buf, int size, const char *fmt, va_list args)
+{
+    struct out o = { buf, size, 0 };
+    int flags, width, prec;
+
+    if (size <= 0)
+        return 0;
+
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') {
+            put(&o, *fmt);
+            continue;
+        }
+
+        flags = 0;
+        for (;;) {
+            fmt++;
+            if (*fmt == '-')      flags |= LEFT;
+            else if (*fmt == '0') flags |= ZEROPAD;
+            else break;
+        }
+
+        width = 0;
+        if (*fmt == '*') {
+            width = va_arg(args, int);
+            fmt++;
+        } else {
+            while (*fmt >= '0' && *fmt <= '9')
+                width = width * 10 + *fmt++ - '0';
+        }
+
+        prec = -1;
+        if (*fmt == '.') {
+            prec = 0;
+            fmt++;
+            if (*fmt == '*') {
+                prec = va_arg(args, int);
+                fmt++;
+            }
+            while (*fmt >= '0' && *fmt <= '9')
+                prec = prec * 10 + *fmt++ - '0';
+        }
+
+        while (*fmt == 'l' || *fmt == 'h' || *fmt == 'z')
+            fmt++;
+
+        switch (*fmt) {
+        case 'c':
+            pad(&o, ' ', (flags & LEFT) ? 0 : width - 1);
+            put(&o, (char)va_arg(args, int));
+            pad(&o, ' ', (flags & LEFT) ? width - 1 : 0);
+            break;
+        case 's':
+            string(&o, va_arg(args, const char *), width, prec, flags);
+            break;
+        case 'p':
+            put(&o, '0');
+            put(&o, 'x');
+            number(&o, va_arg(args, unsigned int), 16, 8, ZEROPAD);
+            break;
+        case 'd':
+        case 'i':
+            number(&o, va_arg(args, int), 10, width, flags | SIGN);
+            break;
+        case 'u':
+            number(&o, va_arg(args, unsigned int), 10, width, flags);
+            break;
+        case 'X':
+            flags |= UPPER;
+            /* fall through */
+        case 'x':
+            number(&o, va_arg(args, unsigned int), 16, width, flags);
+            break;
+        case '%':
+            put(&o, '%');
+            break;
+        case '\0':
+            fmt--;
+            break;
+        default: // unsupported, print as is
+            put(&o, '%');
+            put(&o, *fmt);
+            break;
+        }
+    }
+
+    buf[o.len < size ? o.len : size - 1] = '\0';
+    return o.len < size ? o.len : size - 1;
+}
+
+__itcm int scnprintf(char *buf, int size, const char *fmt, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vscnprintf(buf, size, fmt, args);
+    va_end(args);
+    return len;
+}
@@ -0,0 +1,171 @@
+/**
+ * @file warmboot.c
+ * @brief keep images loaded into SDRAM across soft resets
+ * @version 1.0
+ *
+ * before `reset`, SDRAM is put into self-refresh and a descriptor of the
+ * resident images is left in .noinit. if the next boot is a soft reset
+ * and the descriptor is intact, images whose content crc still matches
+ * and whose file on the sdcard has the same size and date are reused
+ * instead of being read again.
+ *
+ * linux reboots are soft resets too, but linux owns SDRAM by then,
+ * the content crc catches anything it has overwritten.
+ */
+#include <stm32h7xx_hal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include "bsp.h"
+#include "errno.h"
+
+#define WARMBOOT_MAGIC      0x57524d42  // "WRMB"
+#define WARMBOOT_IMAGES     4
+#define WARMBOOT_NAME_LEN   24
+
+struct warm_image {
+    char name[WARMBOOT_NAME_LEN];
+    int addr;
+    int size;
+    unsigned int crc;
+    unsigned int stamp; // fat date << 16 | time of the file
+};
+
+struct warm_desc {
+    unsigned int magic;
+    int count;
+    struct warm_image img[WARMBOOT_IMAGES];
+    unsigned int crc; // of all fields above
+};
+
+static struct warm_desc desc __noinit;
+static int warm;
+
+static unsigned int desc_crc(void)
+{
+    return crc32(0, &desc, offsetof(struct warm_desc, crc));
+}
+
+static void desc_update(void)
+{
+    desc.magic = WARMBOOT_MAGIC;
+    desc.crc = desc_crc();
+}
+
+/**
+ * must run before anything else reads or clears the reset flags
+ */
+void warmboot_init(void)
+{
+    int soft = __HAL_RCC_GET_FLAG(RCC_FLAG_SFTRST);
+
+    __HAL_RCC_CLEAR_RESET_FLAGS();
+
+    warm = soft && desc.magic == WARMBOOT_MAGIC &&
+           desc.count >= 0 && desc.count <= WARMBOOT_IMAGES &&
+           desc.crc == desc_crc();
+
+    if (!warm) {
+        memset(&desc, 0, sizeof(desc));
+        desc_update();
+        return;
+    }
+    printk(KERN_INFO "warmboot: soft reset, %d image(s) in SDRAM", desc.count);
+}
+
+int warmboot_active(void)
+{
+    return warm;
+}
+
+static struct warm_image *find_image(const char *name, int addr)
+{
+    int i;
+
+    for (i = 0; i < desc.count; i++)
+        if (desc.img[i].addr == addr && !strncmp(desc.img[i].name, name, WARMBOOT_NAME_LEN))
+            return &desc.img[i];
+    return NULL;
+}
+
+static void drop_image(struct warm_image *img)
+{
+    memmove(img, img + 1, (char *)&desc.img[--desc.count] - (char *)img);
+    desc_update();
+}
+
+/**
+ * return 0 and set *size if `name` is still resident at `addr`
+ */
+int warmboot_lookup(const char *name, int addr, int *size)
+{
+    struct warm_image *img;
+    unsigned int stamp;
+    int fsize;
+
+    if (!warm)
+        return -ENOENT;
+
+    img = find_image(name, addr);
+    if (!img)
+        return -ENOENT;
+
+    if (sdmmc_file_stamp(name, &fsize, &stamp) || fsize != img->size || stamp != img->stamp) {
+        printk(KERN_INFO "warmboot: %s changed on the sdcard, reload", name);
+        drop_image(img);
+        return -ESTALE;
+    }
+    if (crc32(0, (void *)img->addr, img->size) != img->crc) {
+        printk(KERN_WARNING "warmboot: %s at 0x%08x corrupted, reload", name, addr);
+        drop_image(img);
+        return -EIO;
+    }
+
+    *size = img->size;
+    printk(KERN_INFO "warmboot: reuse %s at 0x%08x, %dKB", name, addr, img->size / 1024);
+    return 0;
+}
+
+/**
+ * remember an image just loaded into SDRAM, drop the ones it overlaps
+ */
+void warmboot_record(const char *name, int addr, int size)
+{
+    struct warm_image *img;
+    int i, fsize;
+
+    for (i = desc.count - 1; i >= 0; i--) {
+        img = &desc.img[i];
+        if (addr < img->addr + img->size && img->addr < addr + size)
+            drop_image(img);
+    }
+    if (desc.count == WARMBOOT_IMAGES)
+        drop_image(&desc.img[0]);
+
+    img = &desc.img[desc.count++];
+    strncpy(img->name, name, WARMBOOT_NAME_LEN);
+    img->addr = addr;
+    img->size = size;
+    img->crc = crc32(0, (void *)addr, size);
+    // lookup stats the file again, one it cannot stat is never reused
+    if (sdmmc_file_stamp(name, &fsize, &img->stamp))
+        img->stamp = 0;
+    desc_update();
+}
+
+/**
+ * soft reset keeping SDRAM content
+ */
+void warmboot_reset(void)
+{
+    if (desc.count)
+        printk(KERN_INFO "warmboot: %d image(s) kept in SDRAM", desc.count);
+    console_flush();
+
+    // write-back cache: dirty lines must reach SDRAM and the log ring first
+    SCB_CleanDCache();
+    __disable_irq();
+    if (desc.count)
+        sdram_self_refresh();
+    NVIC_SystemReset();
+}
@@ -0,0 +1,222 @@
+/*
+ * usart1 and its dma on the uart end of a pty
+ *
+ * rx: a thread plays the circular dma, it takes at most `sim_rate`
+ * bytes per ms from the pty into the buffer, counts NDTR down and
+ * raises the ht / tc events and idle after 1ms without a byte.
+ * tx: a transfer is written to the pty and completed from the same
+ * thread. the last char written to TDR is the flow control state,
+ * after XOFF the rx side stops taking bytes, the pty then blocks
+ * the writer like a terminal honouring XON/XOFF would
+ *
+ * interrupts are one recursive lock, taken by __disable_irq and by
+ * the simulated isr around the callbacks
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include "stm32h7xx_hal.h"
+
+#define XOFF    0x13
+
+USART_TypeDef sim_usart1;
+volatile uint32_t sim_rx_counter;
+int sim_fd = -1;
+int sim_rate = 11;      // 115200 baud
+
+static pthread_mutex_t irq = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static __thread int masked, in_isr;
+
+static UART_HandleTypeDef *sim_uart;
+static uint8_t *rx_buf;
+static uint16_t rx_size;
+static volatile int rx_on, sim_done;
+static const uint8_t *tx_buf;
+static volatile int tx_len;
+static pthread_t sim_thread;
+
+uint32_t __get_PRIMASK(void)
+{
+    return masked;
+}
+
+void __disable_irq(void)
+{
+    if (!masked) {
+        pthread_mutex_lock(&irq);
+        masked = 1;
+    }
+}
+
+void __enable_irq(void)
+{
+    if (masked) {
+        masked = 0;
+        pthread_mutex_unlock(&irq);
+    }
+}
+
+void __set_PRIMASK(uint32_t v)
+{
+    if (v)
+        __disable_irq();
+    else
+        __enable_irq();
+}
+
+uint32_t __get_IPSR(void)
+{
+    return in_isr;
+}
+
+static void isr_enter(void)
+{
+    pthread_mutex_lock(&irq);
+    in_isr = 1;
+}
+
+static void isr_exit(void)
+{
+    in_isr = 0;
+    pthread_mutex_unlock(&irq);
+}
+
+uint32_t HAL_GetTick(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+// irq held
+static void tx_complete(void)
+{
+    int n, done = 0;
+
+    if (!tx_len)
+        return;
+    while (done < tx_len) {
+        n = write(sim_fd, tx_buf + done, tx_len - done);
+        if (n > 0)
+            done += n;
+    }
+    tx_len = 0;
+    HAL_UART_TxCpltCallback(sim_uart);
+}
+
+static void rx_event(uint16_t pos)
+{
+    isr_enter();
+    HAL_UARTEx_RxEventCallback(sim_uart, pos);
+    isr_exit();
+}
+
+static void *sim_run(void *arg)
+{
+    uint8_t c;
+    struct pollfd p = { .fd = sim_fd, .events = POLLIN };
+    int n, since = 0;
+
+    (void)arg;
+    while (!sim_done) {
+        if (tx_len) {
+            isr_enter();
+            tx_complete();
+            isr_exit();
+        }
+        if (!rx_on || sim_usart1.TDR == XOFF) {
+            usleep(100);
+            continue;
+        }
+        if (poll(&p, 1, 1) <= 0) {
+            if (since)
+                rx_event(rx_size - sim_rx_counter);
+            since = 0;
+            continue;
+        }
+
+        // one ms worth of bytes at the line rate
+        for (n = 0; n < sim_rate && rx_on && sim_usart1.TDR != XOFF; n++) {
+            if (poll(&p, 1, 0) <= 0 || read(sim_fd, &c, 1) != 1)
+                break;
+            rx_buf[rx_size - sim_rx_counter] = c;
+            __atomic_store_n(&sim_rx_counter, sim_rx_counter - 1, __ATOMIC_RELEASE);
+            since = 1;
+            if (!sim_rx_counter) {
+                __atomic_store_n(&sim_rx_counter, rx_size, __ATOMIC_RELEASE);
+                rx_event(rx_size);
+                since = 0;
+            } else if (sim_rx_counter == rx_size / 2) {
+                rx_event(rx_size / 2);
+                since = 0;
+            }
+        }
+        usleep(1000);
+    }
+    return NULL;
+}
+
+void sim_start(int fd)
+{
+    sim_fd = fd;
+    pthread_create(&sim_thread, NULL, sim_run, NULL);
+}
+
+void sim_stop(void)
+{
+    sim_done = 1;
+    pthread_join(sim_thread, NULL);
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *h, uint8_t *buf, uint16_t size)
+{
+    sim_uart = h;
+    rx_buf = buf;
+    rx_size = size;
+    sim_rx_counter = size;
+    h->RxState = 0x22;
+    rx_on = 1;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *h)
+{
+    rx_on = 0;
+    h->RxState = HAL_UART_STATE_READY;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *h, const uint8_t *buf, uint16_t len)
+{
+    sim_uart = h;
+    tx_buf = buf;
+    tx_len = len;
+    return HAL_OK;
+}
+
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *h)
+{
+    if (sim_uart && h == sim_uart->hdmatx)
+        tx_complete();
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *h)
+{
+    h->gState = HAL_UART_STATE_READY;
+    h->RxState = HAL_UART_STATE_READY;
+    return HAL_OK;
+}
+
+void HAL_UART_IRQHandler(UART_HandleTypeDef *h) { (void)h; }
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *h) { (void)h; return HAL_OK; }
+HAL_StatusTypeDef HAL_DMA_DeInit(DMA_HandleTypeDef *h) { (void)h; return HAL_OK; }
+void HAL_NVIC_SetPriority(int n, uint32_t p, uint32_t s) { (void)n; (void)p; (void)s; }
+void HAL_NVIC_EnableIRQ(int n) { (void)n; }
+void HAL_NVIC_DisableIRQ(int n) { (void)n; }
+void HAL_GPIO_Init(void *port, GPIO_InitTypeDef *init) { (void)port; (void)init; }
+uint32_t HAL_RCC_GetPCLK2Freq(void) { return 120000000; }
+void HAL_RCCEx_GetPLL3ClockFreq(PLL3_ClocksTypeDef *c) { c->PLL3_Q_Frequency = 0; }
+HAL_StatusTypeDef HAL_RCCEx_PeriphCLKConfig(RCC_PeriphCLKInitTypeDef *c) { (void)c; return HAL_OK; }
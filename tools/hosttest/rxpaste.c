@@ -0,0 +1,158 @@
+/*
+ * console rx ring under a paste: src/uart.c on a pty, see hal_sim.c
+ *
+ *   rxpaste fast   the reader keeps up, the paste must come through
+ *                  _read byte for byte
+ *   rxpaste slow   the reader takes 8 bytes/ms against 11 on the line,
+ *                  with CONSOLE_XONXOFF the paste must still come through
+ *                  byte for byte, without it the overrun must be reported
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stm32h7xx_hal.h>
+#include "bsp.h"
+
+#define PASTE_SIZE  8192
+
+void sim_start(int fd);
+void sim_stop(void);
+void console_init(void);
+int _read(int, char *, int);
+
+static char paste[PASTE_SIZE], got[PASTE_SIZE * 2];
+static char logged[16384];
+static int logged_len, term_fd;
+
+/* what uart.c needs besides the hal */
+void log_write(const char *buf, int len)
+{
+    if (logged_len + len < (int)sizeof(logged)) {
+        memcpy(&logged[logged_len], buf, len);
+        logged_len += len;
+    }
+}
+
+void log_time(unsigned int *sec, unsigned int *usec)
+{
+    unsigned int ms = HAL_GetTick();
+
+    *sec = ms / 1000;
+    *usec = ms % 1000 * 1000;
+}
+
+int log_offset(void) { return 0; }
+void log_replay(int end) { (void)end; }
+int env_get_int(const char *key, int def) { (void)key; return def; }
+int env_set(const char *key, const char *val) { (void)key; (void)val; return 0; }
+int env_save(void) { return 0; }
+
+/*
+ * the terminal: sends the paste, throws away what the console echoes
+ */
+static void *terminal(void *arg)
+{
+    struct pollfd p = { .fd = term_fd, .events = POLLIN | POLLOUT };
+    char sink[256];
+    int sent = 0, n;
+
+    (void)arg;
+    while (1) {
+        p.events = POLLIN | (sent < PASTE_SIZE ? POLLOUT : 0);
+        if (poll(&p, 1, 100) < 0)
+            break;
+        if (p.revents & POLLIN)
+            read(term_fd, sink, sizeof(sink));
+        if (p.revents & POLLOUT) {
+            n = write(term_fd, paste + sent, PASTE_SIZE - sent > 64 ? 64 : PASTE_SIZE - sent);
+            if (n > 0)
+                sent += n;
+        }
+    }
+    return NULL;
+}
+
+static int pty_open(int *uart_fd)
+{
+    struct termios t;
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (fd < 0 || grantpt(fd) || unlockpt(fd))
+        return -1;
+    *uart_fd = open(ptsname(fd), O_RDWR | O_NOCTTY);
+    if (*uart_fd < 0)
+        return -1;
+    // no line discipline, ^S / ^Q are data for the console
+    tcgetattr(*uart_fd, &t);
+    cfmakeraw(&t);
+    t.c_iflag &= ~(IXON | IXOFF);
+    tcsetattr(*uart_fd, TCSANOW, &t);
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    int slow = argc > 1 && !strcmp(argv[1], "slow");
+    int uart_fd, len = 0, n, i, idle;
+    unsigned int seed = 1;
+    pthread_t term;
+
+    // a lost byte would leave _read waiting forever
+    alarm(20);
+
+    for (i = 0; i < PASTE_SIZE; i++) {
+        seed = seed * 1103515245 + 12345;
+        paste[i] = (i % 64 == 63) ? '\r' : ' ' + (seed >> 16) % 95;
+    }
+
+    term_fd = pty_open(&uart_fd);
+    if (term_fd < 0) {
+        perror("pty");
+        return 2;
+    }
+    sim_start(uart_fd);
+    console_init();
+    pthread_create(&term, NULL, terminal, NULL);
+
+    if (!slow) {
+        while (len < PASTE_SIZE)
+            len += _read(0, got + len, PASTE_SIZE - len);
+    } else {
+        // until the line has been quiet for 500ms
+        for (idle = HAL_GetTick(); HAL_GetTick() - idle < 500; ) {
+            if (!console_tstc())
+                continue;
+            n = _read(0, got + len, 16);
+            len += n;
+            idle = HAL_GetTick();
+            usleep(2000);
+            if (len >= PASTE_SIZE)
+                break;
+        }
+    }
+    sim_stop();
+
+    logged[logged_len] = '\0';
+    n = strstr(logged, "rx overrun") != NULL;
+#ifdef CONSOLE_XONXOFF
+    if (len == PASTE_SIZE && !memcmp(got, paste, PASTE_SIZE) && !n) {
+#else
+    if (slow ? n : len == PASTE_SIZE && !memcmp(got, paste, PASTE_SIZE)) {
+#endif
+        printf("rxpaste %s: ok, %d of %d bytes%s\n", slow ? "slow" : "fast", len,
+               PASTE_SIZE, n ? ", overrun reported" : "");
+        return 0;
+    }
+    for (i = 0; i < len && got[i] == paste[i]; i++)
+        ;
+    printf("rxpaste %s: FAIL, %d of %d bytes, first difference at %d%s\n",
+           slow ? "slow" : "fast", len, PASTE_SIZE, i, n ? ", overrun reported" : "");
+    return 1;
+}
@@ -0,0 +1,101 @@
+/*
+ * line editor output: command_read of src/shell.c fed from a key
+ * string, counting what it writes to the console
+ *
+ *   typed   console_tstc is 0, every key is flushed on its own
+ *   burst   console_tstc sees the rest of the string, the whole
+ *           line must leave in one write
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int test_getchar(void);
+#define getchar         test_getchar
+
+// the linker makes these for a section named like an identifier
+#define _shell_cmd_start    __start_testcmds
+#define _shell_cmd_end      __stop_testcmds
+
+#include "../../src/shell.c"
+
+__attribute__((used, section("testcmds")))
+static const struct cmd cmd_help = { .name = "help" };
+__attribute__((used, section("testcmds")))
+static const struct cmd cmd_memtest = { .name = "memtest" };
+
+static const char *keys;
+static int burst, written, writes;
+static char screen[1024];
+
+static int test_getchar(void)
+{
+    if (!*keys) {
+        printf("shellkeys: command_read read past the keys\n");
+        exit(1);
+    }
+    return (unsigned char)*keys++;
+}
+
+int console_tstc(void)
+{
+    return burst ? (int)strlen(keys) : 0;
+}
+
+int _write(int fd, char *buf, int len)
+{
+    (void)fd;
+    if (written + len < (int)sizeof(screen))
+        memcpy(&screen[written], buf, len);
+    written += len;
+    writes++;
+    return len;
+}
+
+void autoboot(void) { }
+int run_command_list(const char *buf, int n) { (void)buf; (void)n; return 0; }
+void kernel_entry(int a, int b) { (void)a; (void)b; }
+
+static const struct {
+    const char *name;
+    const char *keys;
+    int burst;
+    const char *line;   // buf after enter
+    int bytes;          // written, enter included
+    int writes;         // 0: not checked
+} cases[] = {
+    // the history builds up from the first case on
+    { "end of line",    "help\r",                       0, "help",  4 + 2 },
+    { "insert",         "hep\033[Dl\r",                 0, "help",  3 + 1 + 3 + 2 },
+    { "backspace",      "helpx\177\r",                  0, "help",  5 + 3 + 2 },
+    { "history",        "\033[A\r",                     0, "help",  4 + 2 },
+    { "history over",   "memtest\033[A\r",              0, "help",  7 + 4 + 4 + 3 + 2 },
+    { "burst",          "bootm 90010000 - 90000000\r",  1, "bootm 90010000 - 90000000", 25 + 2, 1 },
+};
+
+int main(void)
+{
+    char buf[MAX_CMD_LENGTH + 1];
+    unsigned int i;
+    int fail = 0;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        memset(buf, 0, sizeof(buf));
+        keys = cases[i].keys;
+        burst = cases[i].burst;
+        written = writes = 0;
+        command_read(buf);
+
+        if (strcmp(buf, cases[i].line) || written != cases[i].bytes ||
+            (cases[i].writes && writes != cases[i].writes)) {
+            printf("shellkeys %s: FAIL, \"%s\" in %d bytes / %d writes, "
+                   "expected \"%s\" in %d bytes\n", cases[i].name, buf,
+                   written, writes, cases[i].line, cases[i].bytes);
+            fail = 1;
+        } else {
+            printf("shellkeys %s: ok, %d bytes in %d writes\n",
+                   cases[i].name, written, writes);
+        }
+    }
+    return fail;
+}
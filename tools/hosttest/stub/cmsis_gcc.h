@@ -0,0 +1 @@
+/* see stm32h7xx_hal.h */
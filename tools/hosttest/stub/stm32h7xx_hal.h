@@ -0,0 +1,144 @@
+/*
+ * just enough of the HAL for uart.c and shell.c on a host, the
+ * peripherals are simulated in hal_sim.c
+ */
+#ifndef HOSTTEST_HAL_H
+#define HOSTTEST_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum { HAL_OK, HAL_ERROR, HAL_BUSY, HAL_TIMEOUT } HAL_StatusTypeDef;
+
+typedef struct {
+    volatile uint32_t TDR;
+} USART_TypeDef;
+
+typedef struct {
+    uint32_t Request, Direction, PeriphInc, MemInc;
+    uint32_t PeriphDataAlignment, MemDataAlignment;
+    uint32_t Mode, Priority, FIFOMode;
+} DMA_InitTypeDef;
+
+typedef struct {
+    void *Instance;
+    DMA_InitTypeDef Init;
+} DMA_HandleTypeDef;
+
+typedef struct {
+    uint32_t BaudRate, WordLength, StopBits, Parity, Mode, OverSampling;
+} UART_InitTypeDef;
+
+typedef struct {
+    USART_TypeDef *Instance;
+    UART_InitTypeDef Init;
+    DMA_HandleTypeDef *hdmatx, *hdmarx;
+    volatile uint32_t gState, RxState;
+} UART_HandleTypeDef;
+
+typedef struct {
+    uint32_t Pin, Mode, Pull, Speed, Alternate;
+} GPIO_InitTypeDef;
+
+typedef struct {
+    uint32_t PeriphClockSelection, Usart16ClockSelection;
+} RCC_PeriphCLKInitTypeDef;
+
+typedef struct {
+    uint32_t PLL3_P_Frequency, PLL3_Q_Frequency, PLL3_R_Frequency;
+} PLL3_ClocksTypeDef;
+
+extern USART_TypeDef sim_usart1;
+extern volatile uint32_t sim_rx_counter;
+
+#define USART1                  (&sim_usart1)
+#define GPIOA                   NULL
+#define DMA1_Stream0            NULL
+#define DMA1_Stream1            NULL
+#define USART1_IRQn             37
+#define DMA1_Stream0_IRQn       11
+#define DMA1_Stream1_IRQn       12
+
+#define HAL_UART_STATE_RESET    0x00
+#define HAL_UART_STATE_READY    0x20
+#define UART_FLAG_TC            0x40
+#define UART_FLAG_TXE           0x80
+#define UART_WORDLENGTH_8B      0
+#define UART_STOPBITS_1         0
+#define UART_PARITY_NONE        0
+#define UART_MODE_TX_RX         0x0c
+#define UART_OVERSAMPLING_16    0
+#define UART_OVERSAMPLING_8     0x8000
+
+#define DMA_REQUEST_USART1_RX   41
+#define DMA_REQUEST_USART1_TX   42
+#define DMA_PERIPH_TO_MEMORY    0
+#define DMA_MEMORY_TO_PERIPH    0x40
+#define DMA_PINC_DISABLE        0
+#define DMA_MINC_ENABLE         0x400
+#define DMA_PDATAALIGN_BYTE     0
+#define DMA_MDATAALIGN_BYTE     0
+#define DMA_NORMAL              0
+#define DMA_CIRCULAR            0x100
+#define DMA_PRIORITY_LOW        0
+#define DMA_PRIORITY_HIGH       0x20000
+#define DMA_FIFOMODE_DISABLE    0
+
+#define GPIO_PIN_9              0x0200
+#define GPIO_PIN_10             0x0400
+#define GPIO_MODE_AF_PP         2
+#define GPIO_NOPULL             0
+#define GPIO_SPEED_FREQ_HIGH    2
+#define GPIO_AF7_USART1         7
+
+#define RCC_PERIPHCLK_USART1            0x1
+#define RCC_USART16CLKSOURCE_D2PCLK2    0
+#define RCC_USART16CLKSOURCE_PLL3       2
+#define RCC_USART16CLKSOURCE_HSI        3
+#define RCC_USART16CLKSOURCE_CSI        4
+#define RCC_FLAG_PLL3RDY                0
+#define HSI_VALUE                       64000000
+#define CSI_VALUE                       4000000
+
+#define __HAL_DMA_GET_COUNTER(h)        (sim_rx_counter)
+#define __HAL_LINKDMA(h, f, d)          do { (h)->f = &(d); } while (0)
+#define __HAL_UART_GET_FLAG(h, f)       1
+#define __HAL_RCC_GET_FLAG(f)           0
+#define __HAL_RCC_GET_HSI_DIVIDER()     0
+#define __HAL_RCC_HSI_ENABLE()          ((void)0)
+#define __HAL_RCC_USART16_CONFIG(s)     ((void)0)
+#define __HAL_RCC_USART1_CLK_ENABLE()   ((void)0)
+#define __HAL_RCC_GPIOA_CLK_ENABLE()    ((void)0)
+#define __HAL_RCC_DMA1_CLK_ENABLE()     ((void)0)
+
+#define SCB_CleanDCache_by_Addr(a, n)       ((void)(a), (void)(n))
+#define SCB_InvalidateDCache_by_Addr(a, n)  ((void)(a), (void)(n))
+
+uint32_t HAL_GetTick(void);
+uint32_t HAL_RCC_GetPCLK2Freq(void);
+void HAL_RCCEx_GetPLL3ClockFreq(PLL3_ClocksTypeDef *);
+HAL_StatusTypeDef HAL_RCCEx_PeriphCLKConfig(RCC_PeriphCLKInitTypeDef *);
+void HAL_GPIO_Init(void *, GPIO_InitTypeDef *);
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *, const uint8_t *, uint16_t);
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *, uint8_t *, uint16_t);
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *);
+void HAL_UART_IRQHandler(UART_HandleTypeDef *);
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *);
+HAL_StatusTypeDef HAL_DMA_DeInit(DMA_HandleTypeDef *);
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *);
+void HAL_NVIC_SetPriority(int, uint32_t, uint32_t);
+void HAL_NVIC_EnableIRQ(int);
+void HAL_NVIC_DisableIRQ(int);
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *);
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *, uint16_t);
+
+/* interrupts are one recursive lock, the simulated isr takes it too */
+uint32_t __get_PRIMASK(void);
+void __set_PRIMASK(uint32_t);
+void __disable_irq(void);
+void __enable_irq(void);
+uint32_t __get_IPSR(void);
+
+#endif
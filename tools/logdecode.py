@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""
+decode st-boot binary printk records (CONFIG_PRINTK_BINARY)
+
+    logdecode.py stboot.elf <dump>
+
+<dump> is one of:
+  - the hex lines printed by `dmesg`
+  - /sys/fs/pstore/console-ramoops-0 from linux
+  - a raw dump of LOG_BUF_ADDR (starts with the ramoops header)
+
+record layout, see src/include/printk.h
+"""
+import re
+import struct
+import sys
+
+RAMOOPS_SIG = 0x43474244
+REC_MAGIC = 0xB
+COLORS = re.compile(r"\x1b\[[0-9;]*m")
+SPEC = re.compile(r"%([-0]*)(\d*|\*)(?:\.(\d+))?[lhz]*([diuxXpsc%])")
+
+
+def elf_section(path, name):
+    data = open(path, "rb").read()
+    if data[:4] != b"\x7fELF" or data[4] != 1:
+        sys.exit("%s: not an elf32 file" % path)
+    shoff, = struct.unpack_from("<I", data, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", data, 0x2e)
+
+    def sh(i):
+        return struct.unpack_from("<IIIIIIIIII", data, shoff + i * shentsize)
+
+    strtab = sh(shstrndx)
+    for i in range(shnum):
+        s = sh(i)
+        end = data.index(b"\0", strtab[4] + s[0])
+        if data[strtab[4] + s[0]:end].decode() == name:
+            return data[s[4]:s[4] + s[5]]
+    sys.exit("%s: no %s section, built without CONFIG_PRINTK_BINARY?" % (path, name))
+
+
+def read_dump(path):
+    raw = open(path, "rb").read()
+    try:
+        text = raw.decode("ascii")
+        if re.fullmatch(r"[0-9a-fA-F\s]+", text):
+            return bytes.fromhex("".join(text.split()))
+    except UnicodeDecodeError:
+        pass
+
+    sig, start, size = struct.unpack_from("<III", raw, 0) if len(raw) >= 12 else (0, 0, 0)
+    if sig == RAMOOPS_SIG:
+        data = raw[12:]
+        return data[start:size] + data[:start] if size == len(data) else data[:size]
+    return raw
+
+
+def c_format(spec, arg):
+    flags, width, prec, conv = spec
+    if isinstance(arg, str) and conv != "s":
+        return arg
+    if conv == "s" and not isinstance(arg, str):
+        return "<0x%08x>" % arg  # not a char *, can't follow it
+    if conv == "s":
+        s = arg if prec is None else arg[:int(prec)]
+        return ("%" + flags.replace("0", "") + width + "s") % s
+    if conv == "c":
+        return chr(arg & 0xff)
+    if conv == "p":
+        return "0x%08x" % arg
+    if conv in "di":
+        arg = arg - (1 << 32) if arg & 0x80000000 else arg
+        conv = "d"
+    return ("%" + flags + width + conv) % arg
+
+
+def decode(fmt, args):
+    out, i, pos = [], 0, 0
+    for m in SPEC.finditer(fmt):
+        out.append(fmt[pos:m.start()])
+        pos = m.end()
+        if m.group(4) == "%":
+            out.append("%")
+            continue
+        if i >= len(args):
+            out.append("<?>")
+            continue
+        out.append(c_format((m.group(1), m.group(2), m.group(3), m.group(4)), args[i]))
+        i += 1
+    out.append(fmt[pos:])
+    return "".join(out)
+
+
+def records(data, strs):
+    """walk the dump, resync on anything that isn't a record"""
+    i = 0
+    while i + 8 <= len(data):
+        hdr, ts = struct.unpack_from("<II", data, i)
+        nargs, strmask, off = hdr >> 24 & 0xf, hdr >> 16 & 0xff, hdr & 0xffff
+        if hdr >> 28 != REC_MAGIC or nargs > 8 or off >= len(strs) or (off and strs[off - 1]):
+            i += 1
+            continue
+
+        fmt = strs[off:strs.index(b"\0", off)].decode(errors="replace")
+        p, args = i + 8, []
+        for n in range(nargs):
+            if strmask >> n & 1:
+                end = data.find(b"\0", p)
+                if end < 0:
+                    break
+                args.append(data[p:end].decode(errors="replace"))
+                p += (end - p + 4) & ~3
+            else:
+                if p + 4 > len(data):
+                    break
+                args.append(struct.unpack_from("<I", data, p)[0])
+                p += 4
+        else:
+            yield ts, fmt, args
+            i = p
+            continue
+        return  # truncated at the end of the dump
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit(__doc__.strip())
+    strs = elf_section(sys.argv[1], ".logstr")
+    for ts, fmt, args in records(read_dump(sys.argv[2]), strs):
+        level = fmt[1] if fmt[:1] == "<" and fmt[2:3] == ">" else ""
+        msg = decode(fmt[3:] if level else fmt, args)
+        prefix = {"3": "err: ", "4": "warn: ", "7": "DEBUG: "}.get(level, "")
+        print("[%5u.%06u] %s%s" % (ts // 1000000, ts % 1000000, prefix, COLORS.sub("", msg)))
+
+
+if __name__ == "__main__":
+    main()